@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+// Allocator for vectors that are read with aligned SIMD loads
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(
+            ::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+        return false;
+    }
+};
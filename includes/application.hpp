@@ -11,7 +11,8 @@
 #include "scene.hpp"
 class Application {
    public:
-    Application(uint32_t width, uint32_t height, const char* name);
+    Application(uint32_t width, uint32_t height, const char* name,
+                config::RenderBackend backend = config::RenderBackend::Gpu);
     ~Application();
     void Run();
 
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <glm.hpp>
+#include <memory>
+#include <vector>
+
+#include "aligned_allocator.hpp"
+#include "dirty_ranges.hpp"
+
+struct Sphere;
+class TileScheduler;
+
+struct Aabb {
+    glm::vec3 min = glm::vec3(3.402823466e+38f);
+    glm::vec3 max = glm::vec3(-3.402823466e+38f);
+
+    void grow(const glm::vec3& point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+    void grow(const Aabb& other) {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+    bool empty() const { return min.x > max.x; }
+    float area() const {
+        if (empty()) return 0.0f;
+        glm::vec3 e = max - min;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+// Same layout as BvhNode in shader.comp (std430). Interior nodes have
+// count == 0 and their two children next to each other at leftFirst and
+// leftFirst + 1; leaves reference count primitives starting at
+// primitiveIndices()[leftFirst].
+struct BvhNode {
+    alignas(16) glm::vec3 aabbMin;
+    uint32_t leftFirst;
+    alignas(16) glm::vec3 aabbMax;
+    uint32_t count;
+
+    bool isLeaf() const { return count > 0; }
+};
+static_assert(sizeof(BvhNode) == 32, "BvhNode must match the std430 layout");
+
+enum class BvhBuilder { Sah, Linear };
+
+// Wall time of each phase of the last build, in milliseconds. The SAH
+// build only reports bounds, hierarchy and total.
+struct BvhBuildTimings {
+    double bounds = 0.0;
+    double morton = 0.0;
+    double sort = 0.0;
+    double hierarchy = 0.0;
+    double refit = 0.0;
+    double total = 0.0;
+};
+
+// Bounding volume hierarchy over the traced spheres. build() uses binned SAH
+// for the best trees; buildLinear() sorts the spheres along a Morton curve
+// and emits the hierarchy in parallel, fast enough to redo every frame.
+// Node 0 is the root and node 1 is left unused so that every pair of
+// siblings shares one 64 byte cache line.
+class Bvh {
+   public:
+    static constexpr uint32_t kMaxLeafSize = 4;
+    static constexpr uint32_t kBinCount = 16;
+    // Deepest tree the shader and CPU traversal stacks can hold
+    static constexpr uint32_t kMaxDepth = 64;
+
+    // Up to this many spheres Morton codes use 10 bits per axis (30 bit
+    // codes, half the sort passes), above it 21 bits per axis (63 bit)
+    static constexpr size_t kMorton30Limit = 1 << 16;
+
+    // Builds over the first count spheres
+    void build(const std::vector<Sphere>& spheres, size_t count);
+    // LBVH over the first count spheres with one sphere per leaf. Falls back
+    // to build() if the Morton tree would be deeper than kMaxDepth.
+    void buildLinear(const std::vector<Sphere>& spheres, size_t count,
+                     TileScheduler& scheduler);
+    // Updates the boxes of the leaves holding the given spheres and of their
+    // ancestors, keeping the topology. Every node whose box changed is added
+    // to changedNodes.
+    void refit(const std::vector<Sphere>& spheres,
+               const std::vector<uint32_t>& primitives,
+               DirtyRanges& changedNodes);
+
+    const std::vector<BvhNode, AlignedAllocator<BvhNode>>& nodes() const {
+        return m_nodes;
+    }
+    const std::vector<uint32_t>& primitiveIndices() const {
+        return m_primitiveIndices;
+    }
+    size_t primitiveCount() const { return m_primitiveIndices.size(); }
+    uint32_t depth() const { return m_depth; }
+    // Expected cost, in sphere tests, of a ray through the root box as it
+    // was built. Refits keep it up to date; the fixed root area means a
+    // sphere dragged away from the others reads as a worse tree rather than
+    // a larger scene.
+    float sahCost() const;
+    float builtSahCost() const { return m_builtSahCost; }
+    const BvhBuildTimings& lastBuildTimings() const { return m_timings; }
+
+   private:
+    struct Split {
+        int axis = -1;
+        uint32_t bin = 0;
+        float cost = 3.402823466e+38f;
+    };
+
+    // Scratch of buildLinear(), kept between builds so per frame rebuilds
+    // do not reallocate. Copies start out empty.
+    struct LinearScratch {
+        std::vector<uint64_t> codes;
+        std::vector<uint64_t> sortedCodes;
+        std::vector<uint32_t> sortedIndices;
+        std::vector<uint32_t> histograms;
+        // node holding each internal node, and its height in the tree
+        std::vector<uint32_t> internalNodes;
+        std::vector<uint32_t> heights;
+        std::unique_ptr<std::atomic<uint32_t>[]> visits;
+        size_t visitCapacity = 0;
+
+        LinearScratch() = default;
+        LinearScratch(const LinearScratch&) {}
+        LinearScratch& operator=(const LinearScratch&) { return *this; }
+    };
+
+    Split findBestSplit(const BvhNode& node, const Aabb& centroidBounds) const;
+    uint32_t binIndex(const glm::vec3& centroid, int axis,
+                      const Aabb& centroidBounds) const;
+    void updateBounds(BvhNode& node) const;
+    void sortMortonCodes(TileScheduler& scheduler, uint32_t bits);
+    void emitHierarchy(uint32_t internal);
+    void refitUpwards(uint32_t internal);
+    // Links the children of nodes [begin, end) to their parent and the
+    // primitives of leaves to their leaf, returns the nodes' summed cost
+    double linkNodes(uint32_t begin, uint32_t end);
+    double nodeCost(const BvhNode& node, const Aabb& bounds) const;
+    void finishBuild(double cost);
+
+   private:
+    std::vector<BvhNode, AlignedAllocator<BvhNode>> m_nodes;
+    std::vector<uint32_t> m_primitiveIndices;
+    uint32_t m_depth = 0;
+    BvhBuildTimings m_timings;
+
+    // refit state: parent of every node, leaf of every primitive and the
+    // unnormalised SAH cost
+    std::vector<uint32_t> m_parents;
+    std::vector<uint32_t> m_primitiveLeaves;
+    double m_cost = 0.0;
+    float m_builtRootArea = 0.0f;
+    float m_builtSahCost = 0.0f;
+
+    // build scratch, per primitive. buildLinear() keeps the boxes in Morton
+    // order and does not use the centroids.
+    std::vector<Aabb> m_primitiveBounds;
+    std::vector<glm::vec3> m_centroids;
+    LinearScratch m_linear;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Changed elements of an array, as sorted half-open ranges so uploads only
+// copy what changed. Ranges less than kMergeGap apart are merged since a
+// few extra elements are cheaper than another copy, and past kMaxRanges the
+// whole array is marked.
+class DirtyRanges {
+   public:
+    using Range = std::pair<uint32_t, uint32_t>;
+    static constexpr uint32_t kMergeGap = 16;
+    static constexpr size_t kMaxRanges = 1024;
+
+    void add(uint32_t index) { add(index, index + 1); }
+    void add(uint32_t begin, uint32_t end) {
+        if (m_all || begin >= end) return;
+        m_ranges.push_back({begin, end});
+        m_normalised = false;
+        if (m_ranges.size() > 2 * kMaxRanges) normalise();
+    }
+    void addAll() {
+        m_all = true;
+        m_ranges.clear();
+    }
+    void merge(const DirtyRanges& other) {
+        if (other.m_all) {
+            addAll();
+            return;
+        }
+        for (const Range& range : other.m_ranges) {
+            add(range.first, range.second);
+        }
+    }
+    void clear() {
+        m_all = false;
+        m_ranges.clear();
+        m_normalised = true;
+    }
+
+    bool all() const { return m_all; }
+    bool empty() const { return !m_all && m_ranges.empty(); }
+    // Sorted and merged, only meaningful when all() is false
+    const std::vector<Range>& ranges() {
+        normalise();
+        return m_ranges;
+    }
+
+   private:
+    void normalise() {
+        if (m_normalised) return;
+        m_normalised = true;
+        if (m_ranges.empty()) return;
+        std::sort(m_ranges.begin(), m_ranges.end());
+        size_t merged = 0;
+        for (size_t i = 1; i < m_ranges.size(); i++) {
+            Range& last = m_ranges[merged];
+            if (m_ranges[i].first <= last.second + kMergeGap) {
+                last.second = std::max(last.second, m_ranges[i].second);
+            } else {
+                m_ranges[++merged] = m_ranges[i];
+            }
+        }
+        m_ranges.resize(merged + 1);
+        if (m_ranges.size() > kMaxRanges) addAll();
+    }
+
+   private:
+    std::vector<Range> m_ranges;
+    bool m_all = false;
+    bool m_normalised = true;
+};
@@ -15,9 +15,12 @@
 // #define NOMINMAX
 // #endif
 
+#include <future>
 #include <glm.hpp>
 #include <vector>
 
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
 #include "yaml-cpp/yaml.h"
 struct UniformBufferObject {
     alignas(16) glm::vec3 camera_forward;
@@ -28,6 +31,42 @@ struct UniformBufferObject {
     alignas(4) uint32_t frameCount;
 };
 
+// Per frame data pushed to the trace shaders, same layout as the
+// push_constant block in trace.glsl. The frame index is not pushed: the
+// sample count is in SceneSettings, so a still camera pushes the same values
+// every frame and the recorded dispatches stay valid.
+struct FramePushConstants {
+    alignas(16) glm::vec3 cameraForward;
+    alignas(16) glm::vec3 cameraRight;
+    alignas(16) glm::vec3 cameraUp;
+    alignas(16) glm::vec3 cameraPosition;
+    alignas(4) uint32_t clearAccumulation;
+    // set per dispatch when a frame records several
+    alignas(4) uint32_t dispatchIndex;
+    // set per dispatch by the wavefront integrator, the first pixel of the
+    // batch it traces and the bounce
+    alignas(4) uint32_t firstPath;
+    alignas(4) uint32_t bounce;
+};
+// padded to 80, the block itself ends at 76
+static_assert(sizeof(FramePushConstants) == 80,
+              "FramePushConstants must match the push_constant block");
+
+// Settings of a frame slot, same layout as SceneData in trace.glsl (std140).
+// Only rewritten when they change.
+struct SceneSettings {
+    alignas(4) int sphereCount;
+    // samples in the accumulation before this frame's, 0 when it clears
+    alignas(4) uint32_t accumulatedSamples;
+    // paths per pixel each of the frame's dispatches traces
+    alignas(4) uint32_t samplesPerPixel;
+    // bounces every path takes before Russian roulette may end it
+    alignas(4) uint32_t rouletteDepth;
+    // relative standard error at which adaptive sampling stops tracing a
+    // pixel, 0 when it is off
+    alignas(4) float noiseThreshold;
+};
+
 struct Sphere {
     alignas(16) glm::vec3 center;  // Aligned to 16 bytes
     alignas(4) float radius;       // Aligned to 4 bytes
@@ -96,13 +135,49 @@ struct convert<Sphere> {
 };
 }  // namespace YAML
 
+// Scene data changed since the last Scene::takeChanges(), for uploads
+struct SceneChanges {
+    DirtyRanges spheres;
+    // nodes of Scene::wideBvh(), the tree the GPU traces
+    DirtyRanges bvhNodes;
+    bool bvhIndices = false;
+
+    void merge(const SceneChanges& other) {
+        spheres.merge(other.spheres);
+        bvhNodes.merge(other.bvhNodes);
+        bvhIndices = bvhIndices || other.bvhIndices;
+    }
+    void addAll() {
+        spheres.addAll();
+        bvhNodes.addAll();
+        bvhIndices = true;
+    }
+};
+
 #include <iostream>
 class Scene {
    public:
+    // Refits are given up for a background rebuild once they make the tree
+    // this much more expensive than when it was built
+    static constexpr float kRebuildCostRatio = 1.25f;
+
     Scene();
     ~Scene();
     const std::vector<Sphere>& spheres() const { return m_spheres; }
     const UniformBufferObject& camera() const { return m_camera; }
+    // Hierarchy over the first sphereCount spheres
+    const Bvh& bvh() const { return m_bvh; }
+    // The same hierarchy collapsed to eight children per node
+    const WideBvh<8>& wideBvh() const { return m_wideBvh; }
+    void rebuildBvh(BvhBuilder builder = BvhBuilder::Sah);
+    // Records that m_spheres[index] was edited
+    void markSphereDirty(uint32_t index);
+    // Refits the hierarchy over the spheres edited since the last call and
+    // swaps in a finished background rebuild. Call once per frame.
+    void updateBvh();
+    SceneChanges takeChanges();
+    // Spheres were edited or reloaded since the last takeChanges()
+    bool spheresChanged() const { return !m_changes.spheres.empty(); }
     void update(float dt) {
         m_camera.frameCount++;
         glm::vec3 old_position = m_camera.camera_position;
@@ -126,4 +201,35 @@ class Scene {
     glm::vec3 velocity = glm::vec3(0.0f);
     float yaw = 90.0f;
     float pitch = 0.0f;
+
+   private:
+    // Rebuild running on another thread, copies of the scene start
+    // without one
+    struct BackgroundBuild {
+        struct Trees {
+            Bvh bvh;
+            WideBvh<8> wideBvh;
+        };
+        std::future<Trees> result;
+        uint64_t generation = 0;
+        // spheres edited since the build took its copy
+        std::vector<uint32_t> edits;
+
+        BackgroundBuild() = default;
+        BackgroundBuild(const BackgroundBuild&) {}
+        BackgroundBuild& operator=(const BackgroundBuild&) { return *this; }
+    };
+
+    void startBackgroundRebuild();
+    void collectBackgroundRebuild();
+
+   private:
+    Bvh m_bvh;
+    WideBvh<8> m_wideBvh;
+    // bumped by every synchronous rebuild so stale background ones are
+    // dropped
+    uint64_t m_bvhGeneration = 0;
+    std::vector<uint32_t> m_editedSpheres;
+    BackgroundBuild m_rebuild;
+    SceneChanges m_changes;
 };
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Half-open rectangle [x0, x1) x [y0, y1). One dimensional jobs use a single
+// row, so x0/x1 are the item range.
+struct Tile {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+    uint32_t width() const { return x1 - x0; }
+    uint32_t height() const { return y1 - y0; }
+};
+
+// Counters for one worker, accumulated until resetStats()
+struct WorkerStats {
+    uint64_t tilesExecuted = 0;
+    uint64_t tilesStolen = 0;
+    uint64_t tilesSplit = 0;
+    double busyMs = 0.0;
+    double idleMs = 0.0;
+    double utilisation() const {
+        double total = busyMs + idleMs;
+        return total > 0.0 ? busyMs / total : 0.0;
+    }
+};
+
+// Work-stealing scheduler over persistent worker threads. Each worker owns a
+// deque of tiles: it takes work from the front and thieves steal from the
+// back. When fewer tiles are left than there are workers, tiles are halved
+// before running so the tail of a job is spread over every core. The calling
+// thread takes part as worker 0, one job runs at a time. A task that calls
+// parallelTiles() or parallelFor() runs the nested job itself, on its own
+// worker, since the workers are all busy with the outer job.
+class TileScheduler {
+   public:
+    using TileFunction = std::function<void(const Tile& tile, unsigned worker)>;
+    using RangeFunction =
+        std::function<void(uint32_t begin, uint32_t end, unsigned worker)>;
+
+    explicit TileScheduler(unsigned threadCount = 0);
+    ~TileScheduler();
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+    // Shared instance with one worker per hardware thread
+    static TileScheduler& global();
+
+    // Runs fn over width x height split into tileSize squares. Tiles are
+    // never split below minTileSize.
+    void parallelTiles(uint32_t width, uint32_t height, uint32_t tileSize,
+                       const TileFunction& fn, uint32_t minTileSize = 4);
+    // Runs fn over [0, count) in chunks of grain items
+    void parallelFor(uint32_t count, uint32_t grain, const RangeFunction& fn);
+
+    unsigned threadCount() const {
+        return static_cast<unsigned>(m_queues.size());
+    }
+    const std::vector<WorkerStats>& workerStats() const { return m_stats; }
+    void resetStats();
+
+   private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    void run(std::vector<Tile>& tiles, const TileFunction& fn,
+             uint32_t minWidth, uint32_t minHeight);
+    void workerLoop(unsigned worker);
+    void runJob(unsigned worker);
+    bool popTile(unsigned worker, Tile& tile);
+    bool stealTile(unsigned worker, Tile& tile);
+    bool splitTile(Tile& tile, Tile& other) const;
+
+   private:
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::vector<WorkerStats> m_stats;
+
+    // current job
+    std::mutex m_jobMutex;
+    const TileFunction* m_function = nullptr;
+    uint32_t m_minWidth = 1;
+    uint32_t m_minHeight = 1;
+    std::atomic<int64_t> m_unfinished{0};
+    std::atomic<int64_t> m_unstarted{0};
+    std::atomic<bool> m_cancelled{false};
+    std::exception_ptr m_exception;
+    std::mutex m_exceptionMutex;
+
+    // worker wake up and completion
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    uint64_t m_generation = 0;
+    unsigned m_activeWorkers = 0;
+    bool m_stop = false;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aligned_allocator.hpp"
+#include "bvh.hpp"
+#include "dirty_ranges.hpp"
+
+// Node of a Width-ary BVH. WideBvhNode<8> has the same layout as WideBvhNode
+// in def.glsl (std430). Child boxes are stored as 8 bit steps of
+// 2^(exponent - 127) from origin, rounded outwards so they always contain the
+// exact boxes: 52 bytes for four children and 80 for eight, against 32 bytes
+// per child in the binary tree.
+template <uint32_t Width>
+struct WideBvhNode {
+    static constexpr uint8_t kInterior = 0xe0;
+
+    float origin[3];
+    // biased exponent of each axis in bits 0-7, 8-15 and 16-23
+    uint32_t exponents;
+    // interior children are stored next to each other from childBase and
+    // the primitives of leaf children from primitiveBase
+    uint32_t childBase;
+    uint32_t primitiveBase;
+    // per slot: 0 when empty, kInterior | rank for the interior child at
+    // childBase + rank, count << 5 | offset for a leaf of count primitives
+    // at primitiveBase + offset
+    uint8_t meta[Width];
+    uint8_t lo[3][Width];
+    uint8_t hi[3][Width];
+
+    bool isEmpty(uint32_t slot) const { return meta[slot] == 0; }
+    bool isInterior(uint32_t slot) const {
+        return (meta[slot] & kInterior) == kInterior;
+    }
+    uint32_t childRank(uint32_t slot) const { return meta[slot] & 0x1f; }
+    uint32_t leafCount(uint32_t slot) const { return meta[slot] >> 5; }
+    uint32_t leafOffset(uint32_t slot) const { return meta[slot] & 0x1f; }
+    uint32_t exponent(int axis) const {
+        return (exponents >> (8 * axis)) & 0xff;
+    }
+    float scale(int axis) const {
+        uint32_t bits = exponent(axis) << 23;
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+static_assert(sizeof(WideBvhNode<4>) == 52, "BVH4 nodes must stay compact");
+static_assert(sizeof(WideBvhNode<8>) == 80,
+              "WideBvhNode<8> must match the std430 layout");
+
+// Bvh collapsed into nodes of up to Width children, so a ray tests all the
+// children of a node at once and takes about a third of the steps. Built
+// from a binary tree and refitted along with it.
+template <uint32_t Width>
+class WideBvh {
+   public:
+    using Node = WideBvhNode<Width>;
+    // Traversal stacks pack a node index and an 8 bit child mask into 32 bits
+    static constexpr uint32_t kMaxNodes = 1u << 24;
+
+    // Pulls the children of the largest interior child up into each node
+    // until it has Width children or only leaves
+    void build(const Bvh& bvh);
+    // Requantises the nodes holding any of the binary nodes in
+    // changedNodes, after bvh.refit(). Every node rewritten is added to
+    // changedWideNodes.
+    void refit(const Bvh& bvh, DirtyRanges& changedNodes,
+               DirtyRanges& changedWideNodes);
+
+    const std::vector<Node, AlignedAllocator<Node>>& nodes() const {
+        return m_nodes;
+    }
+    const std::vector<uint32_t>& primitiveIndices() const {
+        return m_primitiveIndices;
+    }
+    size_t primitiveCount() const { return m_primitiveIndices.size(); }
+    uint32_t depth() const { return m_depth; }
+
+   private:
+    void quantise(const Bvh& bvh, uint32_t node);
+
+   private:
+    std::vector<Node, AlignedAllocator<Node>> m_nodes;
+    std::vector<uint32_t> m_primitiveIndices;
+    uint32_t m_depth = 0;
+
+    // binary node in each slot, Width per node, and the node each binary
+    // node was collapsed into
+    std::vector<uint32_t> m_slotNodes;
+    std::vector<uint32_t> m_owners;
+};
+
+extern template class WideBvh<4>;
+extern template class WideBvh<8>;
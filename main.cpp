@@ -1,10 +1,282 @@
+#include <chrono>
+#include <cstring>
+#include <string>
+
 #include "application.hpp"
 #include "src/engine/engine.hpp"
+#include "tile_scheduler.hpp"
+#include "utils.hpp"
+
+// raytracer [--headless] [--cpu] [--width W] [--height H] [--frames N]
+//           [--frames-in-flight N] [--accumulation rgb32f|rgb16f|rgb9e5]
+//           [--spp N] [--dispatches N] [--integrator megakernel|wavefront]
+//           [--roulette-depth N] [--noise-threshold X] [--output P]
+//           [--bvh-bench N]
+struct LaunchOptions {
+    bool headless = false;
+    config::RenderBackend backend = config::RenderBackend::Gpu;
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    uint32_t frames = 256;
+    // headless only, the window has a slider for it
+    uint32_t framesInFlight = config::DEFAULT_FRAMES_IN_FLIGHT;
+    // headless GPU only, to compare the compact formats against rgb32f
+    config::AccumulationFormat accumulation =
+        config::AccumulationFormat::Rgb32f;
+    // headless GPU only, paths per pixel per dispatch and dispatches per
+    // frame after the first
+    uint32_t samplesPerPixel = 1;
+    uint32_t dispatchesPerFrame = 1;
+    // headless GPU only, to compare their lane occupancy
+    config::Integrator integrator = config::Integrator::Megakernel;
+    // headless only, bounces before Russian roulette, GPU and CPU
+    uint32_t rouletteDepth = config::DEFAULT_ROULETTE_DEPTH;
+    // headless GPU only, adaptive sampling's noise threshold, 0 for off.
+    // The run stops early once every tile has converged.
+    float noiseThreshold = 0.0f;
+    std::string output = "output.ppm";
+    // times the BVH builders over this many spheres instead of rendering
+    uint32_t bvhBenchmark = 0;
+};
+
+static config::AccumulationFormat parseAccumulationFormat(
+    const std::string& name) {
+    if (name == "rgb32f") return config::AccumulationFormat::Rgb32f;
+    if (name == "rgb16f") return config::AccumulationFormat::Rgb16f;
+    if (name == "rgb9e5") return config::AccumulationFormat::Rgb9e5;
+    throw std::runtime_error("unknown accumulation format: " + name);
+}
+
+static config::Integrator parseIntegrator(const std::string& name) {
+    if (name == "megakernel") return config::Integrator::Megakernel;
+    if (name == "wavefront") return config::Integrator::Wavefront;
+    throw std::runtime_error("unknown integrator: " + name);
+}
+
+static LaunchOptions parseArguments(int argc, char** argv) {
+    LaunchOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--headless") == 0) {
+            options.headless = true;
+        } else if (strcmp(argv[i], "--cpu") == 0) {
+            options.backend = config::RenderBackend::Cpu;
+        } else if (strcmp(argv[i], "--width") == 0 && hasValue) {
+            options.width = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--height") == 0 && hasValue) {
+            options.height = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+            options.frames = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--frames-in-flight") == 0 && hasValue) {
+            options.framesInFlight =
+                static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--accumulation") == 0 && hasValue) {
+            options.accumulation = parseAccumulationFormat(argv[++i]);
+        } else if (strcmp(argv[i], "--spp") == 0 && hasValue) {
+            options.samplesPerPixel =
+                static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--dispatches") == 0 && hasValue) {
+            options.dispatchesPerFrame =
+                static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--integrator") == 0 && hasValue) {
+            options.integrator = parseIntegrator(argv[++i]);
+        } else if (strcmp(argv[i], "--roulette-depth") == 0 && hasValue) {
+            options.rouletteDepth =
+                static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--noise-threshold") == 0 && hasValue) {
+            options.noiseThreshold = std::stof(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && hasValue) {
+            options.output = argv[++i];
+        } else if (strcmp(argv[i], "--bvh-bench") == 0 && hasValue) {
+            options.bvhBenchmark = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else {
+            throw std::runtime_error(std::string("unknown argument: ") +
+                                     argv[i]);
+        }
+    }
+    return options;
+}
+
+static void runHeadless(const LaunchOptions& options) {
+    Scene scene;
+    auto start = std::chrono::high_resolution_clock::now();
+    uint32_t frames = options.frames;
+    if (options.backend == config::RenderBackend::Cpu) {
+        // No Vulkan at all, the CPU renderer writes the image itself
+        CpuRenderer renderer(options.width, options.height, scene);
+        renderer.setRouletteDepth(options.rouletteDepth);
+        printf("cpu: %u threads, %s sphere kernels\n", renderer.threadCount(),
+               simdLevelName(renderer.simdLevel()));
+        for (uint32_t i = 0; i < options.frames; i++) {
+            scene.update(0.0f);
+            renderer.render();
+        }
+        renderer.save(options.output);
+        printf("cpu: %.2f bounces per path in the last frame\n",
+               renderer.averagePathLength());
+
+        const std::vector<WorkerStats>& stats =
+            renderer.scheduler().workerStats();
+        for (size_t w = 0; w < stats.size(); w++) {
+            printf("worker %zu: %5.1f%% busy, %llu tiles (%llu stolen, %llu "
+                   "split)\n",
+                   w, stats[w].utilisation() * 100.0,
+                   static_cast<unsigned long long>(stats[w].tilesExecuted),
+                   static_cast<unsigned long long>(stats[w].tilesStolen),
+                   static_cast<unsigned long long>(stats[w].tilesSplit));
+        }
+    } else {
+        Engine engine(options.width, options.height, scene);
+        engine.printStartupTimings();
+        engine.setFramesInFlight(options.framesInFlight);
+        printf("frames in flight: %u\n", engine.framesInFlight());
+        engine.setAccumulationFormat(options.accumulation);
+        engine.setSampleBatch(options.samplesPerPixel,
+                              options.dispatchesPerFrame);
+        engine.setIntegrator(options.integrator);
+        engine.setRouletteDepth(options.rouletteDepth);
+        engine.setNoiseThreshold(options.noiseThreshold);
+        for (uint32_t i = 0; i < options.frames; i++) {
+            scene.update(0.0f);
+            engine.render();
+            if (engine.converged()) {
+                frames = i + 1;
+                printf("converged after %u frames\n", frames);
+                break;
+            }
+        }
+        engine.saveOutput(options.output);
+
+        // Averages over the last frames collected
+        const GpuProfiler& profiler = engine.profiler();
+        if (profiler.enabled()) {
+            const char* separator = "gpu:";
+            for (int m = 0; m < static_cast<int>(ProfilerMetric::Count); m++) {
+                ProfilerMetric metric = static_cast<ProfilerMetric>(m);
+                printf("%s %s %.2f", separator, profilerMetricName(metric),
+                       profiler.series(metric).average());
+                separator = ",";
+            }
+            printf("\n");
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("%u frames in %.3f s (%.2f frames/s) -> %s\n", frames, seconds,
+           frames / seconds, options.output.c_str());
+}
+
+static void benchmarkBvh(uint32_t sphereCount) {
+    // Same distribution as the random spheres of the default scene
+    std::vector<Sphere> spheres(sphereCount);
+    for (Sphere& sphere : spheres) {
+        sphere.center =
+            glm::vec3(random_float(-15.0f, 15.0f), random_float(-15.0f, 15.0f),
+                      random_float(-15.0f, 15.0f));
+        sphere.radius = random_float(0.5f, 3.0f);
+    }
+    TileScheduler& scheduler = TileScheduler::global();
+    printf("bvh: %u spheres, %u threads\n", sphereCount,
+           scheduler.threadCount());
+
+    // The first linear build also allocates its scratch
+    Bvh bvh;
+    for (int i = 0; i < 5; i++) {
+        bvh.buildLinear(spheres, spheres.size(), scheduler);
+        const BvhBuildTimings& timings = bvh.lastBuildTimings();
+        printf("linear: bounds %.2f, morton %.2f, sort %.2f, hierarchy %.2f, "
+               "refit %.2f, total %.2f ms (depth %u)\n",
+               timings.bounds, timings.morton, timings.sort,
+               timings.hierarchy, timings.refit, timings.total, bvh.depth());
+    }
+    bvh.build(spheres, spheres.size());
+    const BvhBuildTimings& timings = bvh.lastBuildTimings();
+    printf("sah: bounds %.2f, hierarchy %.2f, total %.2f ms (depth %u)\n",
+           timings.bounds, timings.hierarchy, timings.total, bvh.depth());
+
+    auto collapseStart = std::chrono::high_resolution_clock::now();
+    WideBvh<4> bvh4;
+    bvh4.build(bvh);
+    auto collapseMid = std::chrono::high_resolution_clock::now();
+    WideBvh<8> bvh8;
+    bvh8.build(bvh);
+    auto collapseEnd = std::chrono::high_resolution_clock::now();
+    printf("collapse: bvh4 %.2f ms (depth %u), bvh8 %.2f ms (depth %u)\n",
+           std::chrono::duration<double, std::milli>(collapseMid -
+                                                     collapseStart)
+               .count(),
+           bvh4.depth(),
+           std::chrono::duration<double, std::milli>(collapseEnd - collapseMid)
+               .count(),
+           bvh8.depth());
+    printf("nodes: binary %zu KiB, bvh4 %zu KiB, bvh8 %zu KiB\n",
+           bvh.nodes().size() * sizeof(BvhNode) / 1024,
+           bvh4.nodes().size() * sizeof(WideBvhNode<4>) / 1024,
+           bvh8.nodes().size() * sizeof(WideBvhNode<8>) / 1024);
+
+    // Rays from inside the scene in every direction, like the bounces that
+    // make up most of a path
+    constexpr uint32_t kRayCount = 100000;
+    std::vector<glm::vec3> origins(kRayCount);
+    std::vector<glm::vec3> directions(kRayCount);
+    for (uint32_t i = 0; i < kRayCount; i++) {
+        origins[i] =
+            glm::vec3(random_float(-15.0f, 15.0f), random_float(-15.0f, 15.0f),
+                      random_float(-15.0f, 15.0f));
+        directions[i] = glm::normalize(glm::vec3(random_float(-1.0f, 1.0f),
+                                                 random_float(-1.0f, 1.0f),
+                                                 random_float(-1.0f, 1.0f)));
+    }
+    SphereSoA soa;
+    soa.build(spheres, spheres.size());
+    SimdLevel level = detectSimdLevel();
+    auto traceRays = [&](const char* name, auto&& trace) {
+        TraversalStats stats;
+        for (uint32_t i = 0; i < kRayCount; i++) {
+            trace(origins[i], directions[i], &stats);
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint32_t i = 0; i < kRayCount; i++) {
+            trace(origins[i], directions[i], nullptr);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double rays = static_cast<double>(stats.rays);
+        printf("%s: %.1f nodes, %.1f spheres, %.0f bytes per ray, "
+               "%.2f Mrays/s\n",
+               name, stats.nodeVisits / rays, stats.sphereTests / rays,
+               stats.bytesFetched / rays,
+               kRayCount / std::chrono::duration<double>(end - start).count() /
+                   1e6);
+    };
+    traceRays("binary", [&](const glm::vec3& origin,
+                            const glm::vec3& direction, TraversalStats* stats) {
+        intersectBvh(bvh, soa, origin, direction, 3.402823466e+38f, stats);
+    });
+    traceRays("bvh4", [&](const glm::vec3& origin, const glm::vec3& direction,
+                          TraversalStats* stats) {
+        intersectWideBvh(bvh4, soa, origin, direction, 3.402823466e+38f, level,
+                         stats);
+    });
+    traceRays("bvh8", [&](const glm::vec3& origin, const glm::vec3& direction,
+                          TraversalStats* stats) {
+        intersectWideBvh(bvh8, soa, origin, direction, 3.402823466e+38f, level,
+                         stats);
+    });
+}
 
-int main() {
+int main(int argc, char** argv) {
     try {
-        Application app(1280, 720, "Raytracing");
-        app.Run();
+        LaunchOptions options = parseArguments(argc, argv);
+        if (options.bvhBenchmark > 0) {
+            benchmarkBvh(options.bvhBenchmark);
+        } else if (options.headless) {
+            runHeadless(options);
+        } else {
+            Application app(options.width, options.height, "Raytracing",
+                            options.backend);
+            app.Run();
+        }
     } catch (const std::exception& e) {
         printf("%s\n", e.what());
         return 1;
@@ -4,6 +4,27 @@ struct Sphere {
     vec3 color;
 };
 
+// Same layout as WideBvhNode<8> in includes/wide_bvh.hpp, with the byte
+// arrays packed four to a uint. Child boxes are origin + q * 2^(exponent - 127)
+// per axis. A meta byte of 0 is an empty slot, 0xe0 | rank the interior child
+// childBase + rank, count << 5 | offset a leaf at primitiveBase + offset.
+struct WideBvhNode {
+    vec3 origin;
+    uint exponents;
+    uint childBase;
+    uint primitiveBase;
+    uint meta[2];
+    uint lo[6];
+    uint hi[6];
+};
+
+#define WIDE_BVH_WIDTH 8
+#define WIDE_BVH_INTERIOR 0xe0u
+
+// Bvh::kMaxDepth, the builder keeps the tree within it. The wide tree is
+// never deeper and pushes at most one entry per level.
+#define BVH_STACK_SIZE 64
+
 struct Ray {
     vec3 origin;
     vec3 direction;
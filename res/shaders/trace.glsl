@@ -0,0 +1,510 @@
+// Shared by shader.comp and wavefront.comp, and tiles.comp for set 0: the
+// specialization constants they have in common, descriptor set 0,
+// intersection, one bounce of a path and the accumulation. Specialization
+// constants are set per variant from ComputeVariant in compute_variant.hpp.
+layout (constant_id = 2) const int MAX_DEPTH = 50;
+layout (constant_id = 3) const bool USE_EMISSION = true;
+layout (constant_id = 4) const bool USE_ROUGHNESS = true;
+// spheres traced by testing them all, 0 to traverse the BVH
+layout (constant_id = 5) const int SMALL_SCENE_COUNT = 0;
+// config::AccumulationFormat
+const int ACCUMULATION_RGB32F = 0;
+const int ACCUMULATION_RGB16F = 1;
+const int ACCUMULATION_RGB9E5 = 2;
+layout (constant_id = 6) const int ACCUMULATION_FORMAT = ACCUMULATION_RGB32F;
+// Adaptive sampling: every pixel keeps its own sample count and luminance
+// variance, and after the frame that clears only the tiles in ActiveTiles
+// are traced
+layout (constant_id = 7) const bool ADAPTIVE = false;
+
+#include "def.glsl"
+
+// Linear radiance of the frame, tonemapped for display by tonemap.comp
+layout (binding = 0, rgba32f) uniform writeonly image2D outputImage;
+// 3, 2 or 1 words per pixel, row after row, depending on ACCUMULATION_FORMAT
+layout (binding = 1) buffer accumulationBuffer {
+    uint words[];
+} Accumulation;
+layout (binding = 2) buffer sphereBuffer {
+    Sphere spheres[];
+} SphereData;
+layout (binding = 3) uniform SceneSettings {
+    int sphereCount;
+    uint accumulatedSamples;
+    // paths traced per pixel by each dispatch
+    uint samplesPerPixel;
+    // bounces every path takes before Russian roulette may end it
+    uint rouletteDepth;
+    // relative standard error a pixel's mean luminance converges at, with
+    // ADAPTIVE
+    float noiseThreshold;
+} SceneData;
+// FramePushConstants in includes/scene.hpp
+layout (push_constant) uniform FramePushConstants {
+    vec3 camera_forward;
+    vec3 camera_right;
+    vec3 camera_up;
+    vec3 camera_position;
+    uint clearAccumulation;
+    // which of the frame's dispatches this is, each traces its own samples
+    uint dispatchIndex;
+    // first pixel of the batch of paths a wavefront pass works on, and the
+    // bounce its dispatch does
+    uint firstPath;
+    uint bounce;
+} Frame;
+layout (binding = 4) readonly buffer bvhBuffer {
+    WideBvhNode nodes[];
+} BvhData;
+layout (binding = 5) readonly buffer primitiveBuffer {
+    uint indices[];
+} PrimitiveData;
+// OccupancyCounters in gpu_profiler.hpp, lanes that worked on a path bounce
+// and lanes launched, each a 64-bit count split in two words
+layout (binding = 6) buffer occupancyBuffer {
+    uint activeLow;
+    uint activeHigh;
+    uint launchedLow;
+    uint launchedHigh;
+} Occupancy;
+// With ADAPTIVE, the running luminance mean and sum of squared differences
+// (Welford) of each pixel's samples and their count, row after row
+struct PixelVariance {
+    float mean;
+    float m2;
+    uint samples;
+};
+layout (binding = 7) buffer varianceBuffer {
+    PixelVariance pixels[];
+} Variance;
+// With ADAPTIVE, the tiles still traced as x | y << 16, and the
+// VkDispatchIndirectCommand over them padded to 16 bytes. The trace reads
+// this frame's list while tiles.comp appends the next one's.
+layout (binding = 8) readonly buffer activeTileBuffer {
+    uvec4 dispatchSize;
+    uint tiles[];
+} ActiveTiles;
+layout (binding = 9) buffer nextTileBuffer {
+    uvec4 dispatchSize;
+    uint tiles[];
+} NextTiles;
+
+// Side of a tile in pixels, ComputePipeline::kTileSize, the megakernel's
+// workgroup
+const int TILE_SIZE = 8;
+// samples a pixel takes before its variance may stop it
+const uint MIN_ADAPTIVE_SAMPLES = 16u;
+
+Ray CreateRay(vec3 origin, vec3 direction)
+{
+    Ray ray;
+    ray.origin = origin;
+    ray.direction = direction;
+    return ray;
+}
+
+RayHit CreateRayHit()
+{
+    RayHit hit;
+    hit.position = vec3(0.0f, 0.0f, 0.0f);
+    hit.distance = pos_infinity;
+    hit.normal = vec3(0.0f, 0.0f, 0.0f);
+    hit.sphereIndex = -1;
+    return hit;
+}
+
+// Entry distance into the box, pos_infinity on a miss or beyond tMax
+float IntersectAabb(Ray ray, vec3 invDirection, vec3 aabbMin, vec3 aabbMax, float tMax)
+{
+    vec3 t0 = (aabbMin - ray.origin) * invDirection;
+    vec3 t1 = (aabbMax - ray.origin) * invDirection;
+    vec3 tNearAxis = min(t0, t1);
+    vec3 tFarAxis = max(t0, t1);
+    float tNear = max(max(tNearAxis.x, tNearAxis.y), tNearAxis.z);
+    float tFar = min(min(tFarAxis.x, tFarAxis.y), tFarAxis.z);
+    if (tFar >= tNear && tFar > 0.0f && tNear <= tMax)
+        return tNear;
+    return pos_infinity;
+}
+
+void IntersectSphere(Ray ray, int i, inout RayHit bestHit)
+{
+    Sphere sphere = SphereData.spheres[i];
+    vec3 origin = ray.origin - sphere.center;
+    float a = dot(ray.direction, ray.direction);
+    float b = 2.0f * dot(origin, ray.direction);
+    float c = dot(origin, origin) - sphere.radius * sphere.radius;
+    float discriminant = b * b - 4.0f * a * c;
+    if (discriminant < 0.0f)
+        return;
+    float closestD = (-b - sqrt(discriminant)) / (2.0f * a);
+    // leaves are not in index order, equal hits keep the lowest index
+    if (closestD > 0 && (closestD < bestHit.distance ||
+        (closestD == bestHit.distance && i < bestHit.sphereIndex)))
+    {
+        bestHit.distance = closestD;
+        bestHit.sphereIndex = i;
+    }
+}
+
+void TraverseBvh(Ray ray, inout RayHit bestHit)
+{
+    // zero components would give 0 * inf in the slab test
+    vec3 invDirection = vec3(
+        ray.direction.x == 0.0f ? 1e30f : 1.0f / ray.direction.x,
+        ray.direction.y == 0.0f ? 1e30f : 1.0f / ray.direction.y,
+        ray.direction.z == 0.0f ? 1e30f : 1.0f / ray.direction.z);
+    // Each entry is childBase << 8 | mask of the child ranks still to visit
+    uint stack[BVH_STACK_SIZE];
+    uint stackSize = 0;
+    uint nodeIndex = 0;
+    while (true)
+    {
+        WideBvhNode node = BvhData.nodes[nodeIndex];
+        vec3 scale = vec3(uintBitsToFloat((node.exponents & 0xffu) << 23),
+                          uintBitsToFloat(((node.exponents >> 8) & 0xffu) << 23),
+                          uintBitsToFloat(((node.exponents >> 16) & 0xffu) << 23));
+        uint interior = 0u;
+        float childDistances[WIDE_BVH_WIDTH];
+        for (uint slot = 0u; slot < WIDE_BVH_WIDTH; slot++)
+        {
+            uint word = slot >> 2;
+            uint shift = (slot & 3u) * 8u;
+            uint meta = (node.meta[word] >> shift) & 0xffu;
+            if (meta == 0u)
+                break;
+            vec3 lo = vec3((node.lo[word] >> shift) & 0xffu,
+                           (node.lo[word + 2] >> shift) & 0xffu,
+                           (node.lo[word + 4] >> shift) & 0xffu);
+            vec3 hi = vec3((node.hi[word] >> shift) & 0xffu,
+                           (node.hi[word + 2] >> shift) & 0xffu,
+                           (node.hi[word + 4] >> shift) & 0xffu);
+            float distance = IntersectAabb(ray, invDirection, node.origin + lo * scale, node.origin + hi * scale, bestHit.distance);
+            if (distance == pos_infinity)
+                continue;
+            if ((meta & WIDE_BVH_INTERIOR) == WIDE_BVH_INTERIOR)
+            {
+                uint rank = meta & 0x1fu;
+                interior |= 1u << rank;
+                childDistances[rank] = distance;
+                continue;
+            }
+            uint first = node.primitiveBase + (meta & 0x1fu);
+            for (uint i = 0u; i < (meta >> 5); i++)
+                IntersectSphere(ray, int(PrimitiveData.indices[first + i]), bestHit);
+        }
+
+        // nearest interior child next, the others as one stack entry;
+        // leaves tested above may have culled some
+        uint remaining = 0u;
+        uint nearestRank = 0u;
+        float nearest = pos_infinity;
+        while (interior != 0u)
+        {
+            uint rank = uint(findLSB(interior));
+            interior &= interior - 1u;
+            if (childDistances[rank] > bestHit.distance)
+                continue;
+            if (remaining == 0u || childDistances[rank] < nearest)
+            {
+                nearest = childDistances[rank];
+                nearestRank = rank;
+            }
+            remaining |= 1u << rank;
+        }
+        if (remaining != 0u)
+        {
+            remaining &= ~(1u << nearestRank);
+            if (remaining != 0u)
+                stack[stackSize++] = (node.childBase << 8) | remaining;
+            nodeIndex = node.childBase + nearestRank;
+            continue;
+        }
+
+        if (stackSize == 0)
+            break;
+        uint entry = stack[--stackSize];
+        uint mask = entry & 0xffu;
+        uint rank = uint(findLSB(mask));
+        mask &= mask - 1u;
+        if (mask != 0u)
+            stack[stackSize++] = (entry & ~0xffu) | mask;
+        nodeIndex = (entry >> 8) + rank;
+    }
+}
+
+// Distance and index of the closest sphere along ray, sphereIndex -1 on a miss
+RayHit FindClosestHit(Ray ray)
+{
+    RayHit bestHit = CreateRayHit();
+    if (SceneData.sphereCount <= 0)
+        return bestHit;
+
+    if (SMALL_SCENE_COUNT > 0)
+    {
+        // The trip count is constant, so this loop unrolls. Spheres are
+        // tested in index order, which picks the same hit as the BVH.
+        for (int i = 0; i < SMALL_SCENE_COUNT; i++)
+            IntersectSphere(ray, i, bestHit);
+    }
+    else
+    {
+        TraverseBvh(ray, bestHit);
+    }
+    return bestHit;
+}
+
+// Fills in the rest of a hit FindClosestHit returned for ray
+RayHit CompleteHit(Ray ray, RayHit bestHit)
+{
+    if (bestHit.sphereIndex != -1)
+    {
+        Sphere sphere = SphereData.spheres[bestHit.sphereIndex];
+        bestHit.position = ray.origin + bestHit.distance * ray.direction;
+        bestHit.normal = normalize(bestHit.position - sphere.center);
+        bestHit.color = sphere.color;
+    }
+    return bestHit;
+}
+
+RayHit Trace(Ray ray)
+{
+    return CompleteHit(ray, FindClosestHit(ray));
+}
+
+// Shared exponent encoding of EXT_texture_shared_exponent. Mantissas are
+// rounded up with probability equal to the remainder, u in [0, 1), so the
+// stored mean stays unbiased however small a sample's step is.
+uint EncodeRgb9e5(vec3 rgb, vec3 u)
+{
+    vec3 c = clamp(rgb, 0.0, 65408.0);
+    float maxChannel = max(c.r, max(c.g, c.b));
+    int exponent = max(-16, int(floor(log2(max(maxChannel, 1e-30))))) + 16;
+    float scale = exp2(float(exponent - 24));
+    if (floor(maxChannel / scale + 0.5) >= 512.0) {
+        scale *= 2.0;
+        exponent++;
+    }
+    uvec3 mantissa = uvec3(min(floor(c / scale + u), vec3(511.0)));
+    return mantissa.r | (mantissa.g << 9) | (mantissa.b << 18) |
+           (uint(exponent) << 27);
+}
+
+vec3 DecodeRgb9e5(uint packed)
+{
+    uvec3 mantissa = uvec3(packed, packed >> 9, packed >> 18) & 511u;
+    return vec3(mantissa) * exp2(float(int(packed >> 27) - 24));
+}
+
+// Nudges v by up to half a half float step either way, so rounding to the
+// nearest half rounds up with probability equal to the remainder
+vec3 DitherHalf(vec3 v, vec3 u)
+{
+    vec3 c = clamp(v, 0.0, 65504.0);
+    vec3 halfStep = exp2(floor(log2(max(c, vec3(6.1035e-5)))) - 10.0);
+    return c + (u - 0.5) * halfStep;
+}
+
+// Adds light, the sum of count new samples, to pixel, which then has samples
+// of them. Returns their mean. seed is the pixel's position, as for its
+// paths. The formats are described at config::AccumulationFormat.
+vec3 Accumulate(uint pixel, vec2 seed, vec3 light, int count, int samples)
+{
+    if (ACCUMULATION_FORMAT == ACCUMULATION_RGB32F) {
+        uint base = pixel * 3u;
+        vec3 sum = light;
+        if (samples > count) {
+            sum += uintBitsToFloat(uvec3(Accumulation.words[base],
+                                         Accumulation.words[base + 1u],
+                                         Accumulation.words[base + 2u]));
+        }
+        Accumulation.words[base] = floatBitsToUint(sum.r);
+        Accumulation.words[base + 1u] = floatBitsToUint(sum.g);
+        Accumulation.words[base + 2u] = floatBitsToUint(sum.b);
+        return sum / float(samples);
+    }
+
+    // The compact formats keep the mean, which stays in the range of a
+    // single sample where a sum would outgrow their precision
+    vec3 mean = vec3(0.0);
+    // an index past every bounce, so it is not correlated with the path
+    vec3 u = rand_vec3(0.0, 1.0, seed, samples, MAX_DEPTH);
+    if (ACCUMULATION_FORMAT == ACCUMULATION_RGB16F) {
+        uint base = pixel * 2u;
+        if (samples > count) {
+            mean = vec3(unpackHalf2x16(Accumulation.words[base]),
+                        unpackHalf2x16(Accumulation.words[base + 1u]).x);
+        }
+        mean += (light - float(count) * mean) / float(samples);
+        vec3 dithered = DitherHalf(mean, u);
+        Accumulation.words[base] = packHalf2x16(dithered.rg);
+        Accumulation.words[base + 1u] = packHalf2x16(vec2(dithered.b, 0.0));
+    } else {
+        if (samples > count) mean = DecodeRgb9e5(Accumulation.words[pixel]);
+        mean += (light - float(count) * mean) / float(samples);
+        Accumulation.words[pixel] = EncodeRgb9e5(mean, u);
+    }
+    return mean;
+}
+
+// contribution a path starts with, its throughput is relative to this
+const float START_CONTRIBUTION = 0.15f;
+// a path survives Russian roulette with at least this chance, so its weight
+// stays bounded
+const float MIN_SURVIVAL = 0.05f;
+
+struct Material {
+    vec3 albedo;
+    float roughness;
+    // float metallic;
+    // float reflectivity;
+};
+
+// Bounce i of a path along ray, which found bestHit: adds what it picks up,
+// times weight, to light and turns ray into the next segment. False once
+// the path left the scene or Russian roulette ended it. The random numbers
+// are seeded with the pixel's position and frameCount.
+bool Bounce(RayHit bestHit, vec2 seed, int frameCount, int i, inout Ray ray,
+            inout vec3 contribution, inout float weight, inout vec3 light)
+{
+    if (bestHit.distance < 0.0f || bestHit.sphereIndex == -1)
+    {
+        vec3 sky_color = vec3(0.6f, 0.7f, 0.9f);
+        light += sky_color * contribution * weight;
+        return false;
+    }
+    Sphere sphere = SphereData.spheres[bestHit.sphereIndex];
+    // Material material = Material(sphere.color, rand(vec2(gl_GlobalInvocationID.xy), frameCount, i));
+    float roughness = 0.0f;
+    if (USE_ROUGHNESS)
+        roughness = rand_vec3(0.0f, 0.02f, seed, frameCount, i).x;
+    Material material = Material(sphere.color, roughness);
+    // Material material = Material(sphere.color, 0.02f);
+
+    contribution *= material.albedo;
+    if (USE_EMISSION && (bestHit.sphereIndex == 0 || bestHit.sphereIndex == 1 || bestHit.sphereIndex == 2)){
+        light += 2.0f * material.albedo * weight;
+    }
+    // Russian roulette: past rouletteDepth bounces the path goes on with a
+    // chance that follows its throughput, and what it picks up from then on
+    // counts 1 / that chance more, which leaves the expected radiance as it
+    // was. The index is past the bounces' and the accumulation's.
+    if (i + 1 >= int(SceneData.rouletteDepth)) {
+        float throughput = max(contribution.r,
+                               max(contribution.g, contribution.b)) /
+                           START_CONTRIBUTION;
+        float survival = clamp(throughput, MIN_SURVIVAL, 1.0f);
+        if (rand(seed, frameCount, MAX_DEPTH + 1 + i) >= survival)
+            return false;
+        weight /= survival;
+    }
+    // light += 2.0f * material.albedo;
+    // light += material.emission
+    ray.origin = bestHit.position + bestHit.normal * 0.0001f;
+    // ray.direction = normalize(bestHit.normal + normalize(rand_vec3(-1.0, 1.0, vec2(gl_GlobalInvocationID.xy + i))));
+
+    vec3 normal = bestHit.normal;
+    if (USE_ROUGHNESS)
+        normal += material.roughness * normalize(rand_vec3(-1.0, 1.0, seed, frameCount, i));
+    ray.direction = reflect(ray.direction, normal);
+    // ray.direction = normalize(random_hemisphere_vector(
+    //     bestHit.normal, 
+    //     vec2(gl_GlobalInvocationID.xy), 
+    //     frameCount, 
+    //     i
+    // ));
+    return true;
+}
+
+// Direction of the camera ray through screen_pos
+Ray CameraRay(ivec2 screen_pos, ivec2 screen_size)
+{
+    float horizontalCoefficient = ((float(screen_pos.x) * 2 - screen_size.x) / screen_size.x);
+    float verticalCoefficient = ((float(screen_pos.y) * 2 - screen_size.y) / screen_size.x);
+    Camera camera;
+    camera.position = Frame.camera_position;
+    camera.forwards = Frame.camera_forward;
+    camera.right = Frame.camera_right;
+    camera.up = Frame.camera_up;
+
+    Ray ray;
+    ray.origin = camera.position;
+    ray.direction = normalize(camera.forwards + horizontalCoefficient * camera.right + verticalCoefficient * camera.up);
+    return ray;
+}
+
+// Samples already accumulated before this frame, 0 when it clears
+int AccumulatedSamples()
+{
+    return Frame.clearAccumulation == 0u ? int(SceneData.accumulatedSamples) : 0;
+}
+
+ivec2 UnpackTile(uint tile)
+{
+    return ivec2(tile & 0xFFFFu, tile >> 16u);
+}
+
+// Tile of TILE_SIZE pixels this workgroup covers: its place in the grid,
+// or with ADAPTIVE the active tile it was dispatched for. The frame that
+// clears covers the whole grid.
+ivec2 WorkgroupTile()
+{
+    if (!ADAPTIVE || Frame.clearAccumulation != 0u)
+        return ivec2(gl_WorkGroupID.xy);
+    return UnpackTile(ActiveTiles.tiles[gl_WorkGroupID.x]);
+}
+
+// With ADAPTIVE, samples of pixel accumulated before this dispatch's, 0
+// when it clears
+int PixelSamples(uint pixel)
+{
+    if (Frame.clearAccumulation != 0u)
+        return 0;
+    return int(Variance.pixels[pixel].samples);
+}
+
+float Luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Merges the luminance mean and m2 of count new samples into pixel's,
+// which then has samples of them (Chan et al.'s parallel update)
+void AddVariance(uint pixel, float mean, float m2, int count, int samples)
+{
+    PixelVariance variance = PixelVariance(mean, m2, uint(samples));
+    int previous = samples - count;
+    if (previous > 0) {
+        PixelVariance old = Variance.pixels[pixel];
+        float delta = mean - old.mean;
+        variance.mean = old.mean + delta * float(count) / float(samples);
+        variance.m2 = old.m2 + m2 +
+            delta * delta * float(previous) * float(count) / float(samples);
+    }
+    Variance.pixels[pixel] = variance;
+}
+
+// Adds light, the sum of count new samples, to the pixel at screen_pos,
+// which then has samples of them, and writes the frame's radiance. m2 is
+// the new samples' sum of squared luminance differences, for ADAPTIVE.
+void FinishPixel(ivec2 screen_pos, ivec2 screen_size, vec3 light, int count,
+                 int samples, float m2)
+{
+    uint pixel = uint(screen_pos.y * screen_size.x + screen_pos.x);
+    vec3 mean = Accumulate(pixel, vec2(screen_pos), light, count, samples);
+    if (ADAPTIVE)
+        AddVariance(pixel, Luminance(light) / float(count), m2, count, samples);
+    vec3 finalColor = mean * float(samples) / float(samples + 1);
+    imageStore(outputImage, screen_pos, vec4(finalColor, 1.0));
+}
+
+// Adds to the frame's lane occupancy, once per workgroup. The add that
+// wraps a low word carries one into its high word. Atomics have to name the
+// buffer's members, a function parameter would only be a copy.
+void AddOccupancy(uint active, uint launched)
+{
+    if (atomicAdd(Occupancy.activeLow, active) + active < active)
+        atomicAdd(Occupancy.activeHigh, 1u);
+    if (atomicAdd(Occupancy.launchedLow, launched) + launched < launched)
+        atomicAdd(Occupancy.launchedHigh, 1u);
+}
@@ -2,10 +2,13 @@
 
 #include <sstream>
 
-Application::Application(uint32_t width, uint32_t height, const char* name) {
+Application::Application(uint32_t width, uint32_t height, const char* name,
+                         config::RenderBackend backend) {
     InitWindow(width, height, name);
     m_scene = Scene();
-    _engine = std::make_unique<Engine>(width, height, _window, m_scene);
+    _engine =
+        std::make_unique<Engine>(width, height, _window, m_scene, backend);
+    _engine->printStartupTimings();
 
     // Initialize camera forward vector
     m_scene.m_camera.camera_forward.x =
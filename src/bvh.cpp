@@ -0,0 +1,593 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+#include "scene.hpp"
+#include "tile_scheduler.hpp"
+
+namespace {
+using Clock = std::chrono::high_resolution_clock;
+
+double elapsedMs(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Relative cost of visiting an interior node against testing one sphere
+constexpr float kTraversalCost = 1.0f;
+// Primitives per task in the parallel LBVH passes
+constexpr uint32_t kLinearGrain = 16384;
+constexpr uint32_t kRadixBits = 11;
+constexpr uint32_t kRadixSize = 1 << kRadixBits;
+
+// Moves the low 21 bits of v to every third bit
+uint64_t spreadBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Sphere box padded a little so rounding in the box test never culls a
+// sphere the exact ray/sphere test would hit
+Aabb sphereBounds(const Sphere& sphere) {
+    glm::vec3 magnitude = glm::abs(sphere.center);
+    float padding =
+        1e-5f * (sphere.radius +
+                 std::max(magnitude.x, std::max(magnitude.y, magnitude.z)));
+    glm::vec3 extent(sphere.radius + padding);
+    return {sphere.center - extent, sphere.center + extent};
+}
+
+// v must not be zero
+int leadingZeros(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return 63 - static_cast<int>(index);
+#else
+    return __builtin_clzll(v);
+#endif
+}
+
+int widestAxis(const Aabb& bounds) {
+    glm::vec3 extent = bounds.max - bounds.min;
+    if (extent.x >= extent.y && extent.x >= extent.z) return 0;
+    return extent.y >= extent.z ? 1 : 2;
+}
+}  // namespace
+
+void Bvh::build(const std::vector<Sphere>& spheres, size_t count) {
+    auto start = Clock::now();
+    m_timings = {};
+    count = std::min(count, spheres.size());
+    m_primitiveIndices.resize(count);
+    std::iota(m_primitiveIndices.begin(), m_primitiveIndices.end(), 0u);
+    m_primitiveBounds.resize(count);
+    m_centroids.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        m_primitiveBounds[i] = sphereBounds(spheres[i]);
+        m_centroids[i] = spheres[i].center;
+    }
+    auto boundsEnd = Clock::now();
+    m_timings.bounds = elapsedMs(start, boundsEnd);
+
+    m_nodes.assign(std::max<size_t>(2 * count, 2), BvhNode{});
+    uint32_t nodesUsed = 2;
+    m_nodes[0].leftFirst = 0;
+    m_nodes[0].count = static_cast<uint32_t>(count);
+    updateBounds(m_nodes[0]);
+    m_depth = 1;
+
+    struct Task {
+        uint32_t node;
+        uint32_t depth;
+    };
+    std::vector<Task> stack = {{0, 1}};
+    while (!stack.empty()) {
+        Task task = stack.back();
+        stack.pop_back();
+        m_depth = std::max(m_depth, task.depth);
+        // m_nodes never reallocates during the build, so this stays valid
+        BvhNode& node = m_nodes[task.node];
+        if (node.count <= 1) continue;
+
+        uint32_t first = node.leftFirst;
+        uint32_t last = first + node.count;
+        Aabb centroidBounds;
+        for (uint32_t i = first; i < last; i++) {
+            centroidBounds.grow(m_centroids[m_primitiveIndices[i]]);
+        }
+
+        // Past half the stack depth fall back to median splits, which are
+        // balanced and keep the tree within kMaxDepth
+        bool median = task.depth >= kMaxDepth / 2;
+        uint32_t split = first;
+        if (!median) {
+            Split best = findBestSplit(node, centroidBounds);
+            Aabb nodeBounds = {node.aabbMin, node.aabbMax};
+            float leafCost = node.count * nodeBounds.area();
+            if (best.axis < 0 || best.cost >= leafCost) {
+                if (node.count <= kMaxLeafSize) continue;
+                median = true;
+            } else {
+                auto middle = std::partition(
+                    m_primitiveIndices.begin() + first,
+                    m_primitiveIndices.begin() + last, [&](uint32_t index) {
+                        return binIndex(m_centroids[index], best.axis,
+                                        centroidBounds) < best.bin;
+                    });
+                split = static_cast<uint32_t>(middle -
+                                              m_primitiveIndices.begin());
+                median = split == first || split == last;
+            }
+        }
+        if (median) {
+            int axis = widestAxis(centroidBounds);
+            split = first + node.count / 2;
+            std::nth_element(m_primitiveIndices.begin() + first,
+                             m_primitiveIndices.begin() + split,
+                             m_primitiveIndices.begin() + last,
+                             [&](uint32_t a, uint32_t b) {
+                                 return m_centroids[a][axis] <
+                                        m_centroids[b][axis];
+                             });
+        }
+
+        uint32_t left = nodesUsed;
+        nodesUsed += 2;
+        m_nodes[left].leftFirst = first;
+        m_nodes[left].count = split - first;
+        m_nodes[left + 1].leftFirst = split;
+        m_nodes[left + 1].count = last - split;
+        updateBounds(m_nodes[left]);
+        updateBounds(m_nodes[left + 1]);
+        node.leftFirst = left;
+        node.count = 0;
+
+        stack.push_back({left, task.depth + 1});
+        stack.push_back({left + 1, task.depth + 1});
+    }
+    m_nodes.resize(nodesUsed);
+    m_parents.resize(nodesUsed);
+    m_primitiveLeaves.resize(count);
+    finishBuild(count > 0 ? linkNodes(0, nodesUsed) : 0.0);
+
+    auto end = Clock::now();
+    m_timings.hierarchy = elapsedMs(boundsEnd, end);
+    m_timings.total = elapsedMs(start, end);
+}
+
+void Bvh::buildLinear(const std::vector<Sphere>& spheres, size_t count,
+                      TileScheduler& scheduler) {
+    count = std::min(count, spheres.size());
+    // The Karras emission needs at least one interior node
+    if (count < 2) {
+        build(spheres, count);
+        return;
+    }
+    auto start = Clock::now();
+    m_timings = {};
+    uint32_t n = static_cast<uint32_t>(count);
+
+    // Bounds of the sphere centres, reduced per worker
+    std::vector<Aabb> workerBounds(scheduler.threadCount());
+    scheduler.parallelFor(
+        n, kLinearGrain, [&](uint32_t begin, uint32_t end, unsigned worker) {
+            Aabb bounds = workerBounds[worker];
+            for (uint32_t i = begin; i < end; i++) {
+                bounds.grow(spheres[i].center);
+            }
+            workerBounds[worker] = bounds;
+        });
+    Aabb centroidBounds;
+    for (const Aabb& bounds : workerBounds) {
+        centroidBounds.grow(bounds);
+    }
+    auto boundsEnd = Clock::now();
+    m_timings.bounds = elapsedMs(start, boundsEnd);
+
+    // Morton codes of the centres quantised to their bounds
+    uint32_t axisBits = n <= kMorton30Limit ? 10 : 21;
+    float gridMax = static_cast<float>((1u << axisBits) - 1);
+    glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = extent[axis] > 0.0f ? gridMax / extent[axis] : 0.0f;
+    }
+    m_linear.codes.resize(n);
+    m_primitiveIndices.resize(n);
+    scheduler.parallelFor(
+        n, kLinearGrain, [&](uint32_t begin, uint32_t end, unsigned) {
+            for (uint32_t i = begin; i < end; i++) {
+                glm::vec3 cell = glm::clamp(
+                    (spheres[i].center - centroidBounds.min) * scale, 0.0f,
+                    gridMax);
+                m_linear.codes[i] =
+                    spreadBits(static_cast<uint64_t>(cell.x)) << 2 |
+                    spreadBits(static_cast<uint64_t>(cell.y)) << 1 |
+                    spreadBits(static_cast<uint64_t>(cell.z));
+                m_primitiveIndices[i] = i;
+            }
+        });
+    auto mortonEnd = Clock::now();
+    m_timings.morton = elapsedMs(boundsEnd, mortonEnd);
+
+    sortMortonCodes(scheduler, 3 * axisBits);
+    auto sortEnd = Clock::now();
+    m_timings.sort = elapsedMs(mortonEnd, sortEnd);
+
+    // Boxes in sorted order; a streaming gather keeps many cache misses in
+    // flight where gathering in emitHierarchy() would not
+    m_primitiveBounds.resize(n);
+    scheduler.parallelFor(
+        n, kLinearGrain, [&](uint32_t begin, uint32_t end, unsigned) {
+            for (uint32_t i = begin; i < end; i++) {
+                m_primitiveBounds[i] =
+                    sphereBounds(spheres[m_primitiveIndices[i]]);
+            }
+        });
+
+    // Interior node i owns the sibling pair 2 + 2i, 3 + 2i, the root is
+    // interior node 0 and lives in node 0
+    m_nodes.resize(2 * static_cast<size_t>(n));
+    m_nodes[0].leftFirst = 2;
+    m_nodes[0].count = 0;
+    m_nodes[1] = BvhNode{};
+    m_linear.internalNodes.resize(n - 1);
+    m_linear.heights.resize(n - 1);
+    m_linear.internalNodes[0] = 0;
+    if (m_linear.visitCapacity < n - 1) {
+        m_linear.visits.reset(new std::atomic<uint32_t>[n - 1]);
+        m_linear.visitCapacity = n - 1;
+    }
+    scheduler.parallelFor(
+        n - 1, kLinearGrain, [&](uint32_t begin, uint32_t end, unsigned) {
+            for (uint32_t i = begin; i < end; i++) {
+                emitHierarchy(i);
+            }
+        });
+    auto hierarchyEnd = Clock::now();
+    m_timings.hierarchy = elapsedMs(sortEnd, hierarchyEnd);
+
+    // Walk up from every node with two leaf children, the second child to
+    // arrive at a node merges both boxes and carries on
+    scheduler.parallelFor(
+        n - 1, kLinearGrain, [&](uint32_t begin, uint32_t end, unsigned) {
+            for (uint32_t i = begin; i < end; i++) {
+                if (m_nodes[2 + 2 * i].isLeaf() &&
+                    m_nodes[3 + 2 * i].isLeaf()) {
+                    refitUpwards(i);
+                }
+            }
+        });
+    m_depth = m_linear.heights[0];
+    // Many spheres packed into one Morton cell can make the tree deeper
+    // than the traversal stacks
+    if (m_depth > kMaxDepth) {
+        build(spheres, count);
+        return;
+    }
+
+    m_parents.resize(m_nodes.size());
+    m_primitiveLeaves.resize(n);
+    std::vector<double> workerCosts(scheduler.threadCount(), 0.0);
+    scheduler.parallelFor(
+        static_cast<uint32_t>(m_nodes.size()), kLinearGrain,
+        [&](uint32_t begin, uint32_t end, unsigned worker) {
+            workerCosts[worker] += linkNodes(begin, end);
+        });
+    finishBuild(std::accumulate(workerCosts.begin(), workerCosts.end(), 0.0));
+    auto end = Clock::now();
+    m_timings.refit = elapsedMs(hierarchyEnd, end);
+    m_timings.total = elapsedMs(start, end);
+}
+
+void Bvh::refit(const std::vector<Sphere>& spheres,
+                const std::vector<uint32_t>& primitives,
+                DirtyRanges& changedNodes) {
+    for (uint32_t primitive : primitives) {
+        if (primitive >= m_primitiveLeaves.size()) continue;
+        uint32_t index = m_primitiveLeaves[primitive];
+        while (true) {
+            BvhNode& node = m_nodes[index];
+            Aabb bounds;
+            if (node.isLeaf()) {
+                for (uint32_t i = node.leftFirst;
+                     i < node.leftFirst + node.count; i++) {
+                    bounds.grow(sphereBounds(spheres[m_primitiveIndices[i]]));
+                }
+            } else {
+                bounds.grow({m_nodes[node.leftFirst].aabbMin,
+                             m_nodes[node.leftFirst].aabbMax});
+                bounds.grow({m_nodes[node.leftFirst + 1].aabbMin,
+                             m_nodes[node.leftFirst + 1].aabbMax});
+            }
+            // Nothing above an unchanged box can change
+            if (bounds.min == node.aabbMin && bounds.max == node.aabbMax) {
+                break;
+            }
+            m_cost += nodeCost(node, bounds) -
+                      nodeCost(node, {node.aabbMin, node.aabbMax});
+            node.aabbMin = bounds.min;
+            node.aabbMax = bounds.max;
+            changedNodes.add(index);
+            if (index == 0) break;
+            index = m_parents[index];
+        }
+    }
+}
+
+float Bvh::sahCost() const {
+    return m_builtRootArea > 0.0f
+               ? static_cast<float>(m_cost / m_builtRootArea)
+               : 0.0f;
+}
+
+double Bvh::linkNodes(uint32_t begin, uint32_t end) {
+    double cost = 0.0;
+    for (uint32_t index = begin; index < end; index++) {
+        // Node 1 is the unused half of the root's cache line
+        if (index == 1) continue;
+        const BvhNode& node = m_nodes[index];
+        if (node.isLeaf()) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count;
+                 i++) {
+                m_primitiveLeaves[m_primitiveIndices[i]] = index;
+            }
+        } else {
+            m_parents[node.leftFirst] = index;
+            m_parents[node.leftFirst + 1] = index;
+        }
+        cost += nodeCost(node, {node.aabbMin, node.aabbMax});
+    }
+    return cost;
+}
+
+double Bvh::nodeCost(const BvhNode& node, const Aabb& bounds) const {
+    double weight = node.isLeaf() ? node.count : kTraversalCost;
+    return weight * bounds.area();
+}
+
+void Bvh::finishBuild(double cost) {
+    m_parents[0] = 0;
+    m_cost = cost;
+    m_builtRootArea = Aabb{m_nodes[0].aabbMin, m_nodes[0].aabbMax}.area();
+    m_builtSahCost = sahCost();
+}
+
+void Bvh::sortMortonCodes(TileScheduler& scheduler, uint32_t bits) {
+    // Stable LSD radix sort of (code, index) pairs. Each pass histograms
+    // fixed blocks in parallel, then every block scatters to its own
+    // offsets, which keeps the order within a digit.
+    uint32_t n = static_cast<uint32_t>(m_linear.codes.size());
+    uint32_t blockSize = std::max(
+        kLinearGrain, (n + 4 * scheduler.threadCount() - 1) /
+                          (4 * scheduler.threadCount()));
+    uint32_t blockCount = (n + blockSize - 1) / blockSize;
+    m_linear.histograms.resize(static_cast<size_t>(blockCount) * kRadixSize);
+    m_linear.sortedCodes.resize(n);
+    m_linear.sortedIndices.resize(n);
+
+    std::vector<uint64_t>* codes = &m_linear.codes;
+    std::vector<uint32_t>* indices = &m_primitiveIndices;
+    std::vector<uint64_t>* sortedCodes = &m_linear.sortedCodes;
+    std::vector<uint32_t>* sortedIndices = &m_linear.sortedIndices;
+    for (uint32_t shift = 0; shift < bits; shift += kRadixBits) {
+        scheduler.parallelFor(
+            blockCount, 1, [&](uint32_t begin, uint32_t end, unsigned) {
+                for (uint32_t block = begin; block < end; block++) {
+                    uint32_t* histogram =
+                        &m_linear.histograms[block * kRadixSize];
+                    std::fill(histogram, histogram + kRadixSize, 0u);
+                    uint32_t last = std::min(n, (block + 1) * blockSize);
+                    for (uint32_t i = block * blockSize; i < last; i++) {
+                        histogram[((*codes)[i] >> shift) & (kRadixSize - 1)]++;
+                    }
+                }
+            });
+
+        // Exclusive prefix over (digit, block); a digit shared by every
+        // code leaves the order as it is
+        bool uniform = false;
+        uint32_t offset = 0;
+        for (uint32_t digit = 0; digit < kRadixSize; digit++) {
+            uint32_t digitStart = offset;
+            for (uint32_t block = 0; block < blockCount; block++) {
+                uint32_t& bucket =
+                    m_linear.histograms[block * kRadixSize + digit];
+                uint32_t size = bucket;
+                bucket = offset;
+                offset += size;
+            }
+            if (offset - digitStart == n) uniform = true;
+        }
+        if (uniform) continue;
+
+        scheduler.parallelFor(
+            blockCount, 1, [&](uint32_t begin, uint32_t end, unsigned) {
+                for (uint32_t block = begin; block < end; block++) {
+                    uint32_t* histogram =
+                        &m_linear.histograms[block * kRadixSize];
+                    uint32_t last = std::min(n, (block + 1) * blockSize);
+                    for (uint32_t i = block * blockSize; i < last; i++) {
+                        uint64_t code = (*codes)[i];
+                        uint32_t position =
+                            histogram[(code >> shift) & (kRadixSize - 1)]++;
+                        (*sortedCodes)[position] = code;
+                        (*sortedIndices)[position] = (*indices)[i];
+                    }
+                }
+            });
+        std::swap(codes, sortedCodes);
+        std::swap(indices, sortedIndices);
+    }
+    // An odd number of scatters leaves the result in the scratch vectors
+    if (codes != &m_linear.codes) {
+        m_linear.codes.swap(m_linear.sortedCodes);
+        m_primitiveIndices.swap(m_linear.sortedIndices);
+    }
+}
+
+void Bvh::emitHierarchy(uint32_t internal) {
+    // Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees,
+    // and k-d Trees" (2012): find the range of sorted leaves under this
+    // node from the common prefix lengths of its neighbours, then split it
+    // where the prefix changes
+    const uint64_t* codes = m_linear.codes.data();
+    int64_t n = static_cast<int64_t>(m_linear.codes.size());
+    auto delta = [codes, n](int64_t a, int64_t b) {
+        if (b < 0 || b >= n) return -1;
+        uint64_t diff = codes[a] ^ codes[b];
+        // Equal codes are told apart by their position in the sorted order
+        if (diff == 0) {
+            return 64 + leadingZeros(static_cast<uint64_t>(a ^ b));
+        }
+        return leadingZeros(diff);
+    };
+
+    int64_t i = internal;
+    int64_t direction = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+    int minDelta = delta(i, i - direction);
+    int64_t maxLength = 2;
+    while (delta(i, i + maxLength * direction) > minDelta) maxLength *= 2;
+    int64_t length = 0;
+    for (int64_t step = maxLength / 2; step >= 1; step /= 2) {
+        if (delta(i, i + (length + step) * direction) > minDelta) {
+            length += step;
+        }
+    }
+    int64_t j = i + length * direction;
+
+    int nodeDelta = delta(i, j);
+    int64_t split = 0;
+    int64_t step = length;
+    do {
+        step = (step + 1) / 2;
+        if (delta(i, i + (split + step) * direction) > nodeDelta) {
+            split += step;
+        }
+    } while (step > 1);
+    int64_t gamma = i + split * direction + std::min<int64_t>(direction, 0);
+
+    // Leaves get their box here, the interior ones in refitUpwards()
+    uint32_t left = 2 + 2 * internal;
+    bool leaves[2] = {std::min(i, j) == gamma, std::max(i, j) == gamma + 1};
+    for (uint32_t c = 0; c < 2; c++) {
+        uint32_t child = static_cast<uint32_t>(gamma) + c;
+        BvhNode& node = m_nodes[left + c];
+        if (leaves[c]) {
+            node.aabbMin = m_primitiveBounds[child].min;
+            node.aabbMax = m_primitiveBounds[child].max;
+            node.leftFirst = child;
+            node.count = 1;
+        } else {
+            node.leftFirst = 2 + 2 * child;
+            node.count = 0;
+            m_linear.internalNodes[child] = left + c;
+        }
+    }
+    m_linear.visits[internal].store(0, std::memory_order_relaxed);
+}
+
+void Bvh::refitUpwards(uint32_t internal) {
+    auto height = [this](uint32_t child) {
+        const BvhNode& node = m_nodes[child];
+        return node.isLeaf() ? 1u : m_linear.heights[(node.leftFirst - 2) / 2];
+    };
+    while (true) {
+        uint32_t left = 2 + 2 * internal;
+        uint32_t node = m_linear.internalNodes[internal];
+        m_nodes[node].aabbMin =
+            glm::min(m_nodes[left].aabbMin, m_nodes[left + 1].aabbMin);
+        m_nodes[node].aabbMax =
+            glm::max(m_nodes[left].aabbMax, m_nodes[left + 1].aabbMax);
+        m_linear.heights[internal] =
+            1 + std::max(height(left), height(left + 1));
+        if (node == 0) return;
+
+        // The parent is done by whichever of its interior children gets
+        // there last; a leaf sibling is ready from emitHierarchy()
+        internal = (node - 2) / 2;
+        uint32_t sibling = node ^ 1;
+        if (!m_nodes[sibling].isLeaf() &&
+            m_linear.visits[internal].fetch_add(
+                1, std::memory_order_acq_rel) == 0) {
+            return;
+        }
+    }
+}
+
+Bvh::Split Bvh::findBestSplit(const BvhNode& node,
+                              const Aabb& centroidBounds) const {
+    Split best;
+    for (int axis = 0; axis < 3; axis++) {
+        if (centroidBounds.max[axis] <= centroidBounds.min[axis]) continue;
+
+        struct Bin {
+            Aabb bounds;
+            uint32_t count = 0;
+        };
+        Bin bins[kBinCount];
+        for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count;
+             i++) {
+            uint32_t primitive = m_primitiveIndices[i];
+            Bin& bin =
+                bins[binIndex(m_centroids[primitive], axis, centroidBounds)];
+            bin.count++;
+            bin.bounds.grow(m_primitiveBounds[primitive]);
+        }
+
+        // Sweep from both sides, split i puts bins [0, i) on the left
+        float leftArea[kBinCount];
+        uint32_t leftCount[kBinCount];
+        Aabb leftBounds;
+        uint32_t leftSum = 0;
+        for (uint32_t i = 1; i < kBinCount; i++) {
+            leftBounds.grow(bins[i - 1].bounds);
+            leftSum += bins[i - 1].count;
+            leftArea[i] = leftBounds.area();
+            leftCount[i] = leftSum;
+        }
+        Aabb rightBounds;
+        uint32_t rightSum = 0;
+        for (uint32_t i = kBinCount - 1; i >= 1; i--) {
+            rightBounds.grow(bins[i].bounds);
+            rightSum += bins[i].count;
+            if (leftCount[i] == 0 || rightSum == 0) continue;
+            float cost = leftCount[i] * leftArea[i] + rightSum * rightBounds.area();
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.bin = i;
+                best.cost = cost;
+            }
+        }
+    }
+    if (best.axis >= 0) {
+        Aabb nodeBounds = {node.aabbMin, node.aabbMax};
+        best.cost += kTraversalCost * nodeBounds.area();
+    }
+    return best;
+}
+
+uint32_t Bvh::binIndex(const glm::vec3& centroid, int axis,
+                       const Aabb& centroidBounds) const {
+    float scale = kBinCount / (centroidBounds.max[axis] -
+                               centroidBounds.min[axis]);
+    float bin = (centroid[axis] - centroidBounds.min[axis]) * scale;
+    return std::min(kBinCount - 1, static_cast<uint32_t>(std::max(bin, 0.0f)));
+}
+
+void Bvh::updateBounds(BvhNode& node) const {
+    Aabb bounds;
+    for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        bounds.grow(m_primitiveBounds[m_primitiveIndices[i]]);
+    }
+    node.aabbMin = bounds.min;
+    node.aabbMax = bounds.max;
+}
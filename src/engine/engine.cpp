@@ -1,5 +1,9 @@
 #include "engine.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
 #include "includes/compute_pipeline.hpp"
 #include "includes/config.hpp"
 #include "includes/device_structures.hpp"
@@ -7,113 +11,422 @@
 #include "includes/swap_chain.hpp"
 #include "includes/utils.hpp"
 
+namespace {
+// A semaphore a submission waits on, value 0 for a binary one
+struct SemaphoreWait {
+    VkSemaphore semaphore;
+    uint64_t value;
+};
+
+// Waits on every semaphore in waits at waitStage, and signals timeline with
+// signalValue and presentSemaphore when there is one
+void submitCommandBuffers(VkQueue queue,
+                          const std::vector<VkCommandBuffer>& commandBuffers,
+                          const std::vector<SemaphoreWait>& waits,
+                          VkPipelineStageFlags waitStage, VkSemaphore timeline,
+                          uint64_t signalValue, VkSemaphore presentSemaphore) {
+    // A binary semaphore's value is ignored, but timeline and binary
+    // semaphores are given together
+    VkSemaphore signalSemaphores[] = {timeline, presentSemaphore};
+    uint64_t signalValues[] = {signalValue, 0};
+    uint32_t signalCount = presentSemaphore != VK_NULL_HANDLE ? 2 : 1;
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<uint64_t> waitValues;
+    for (const SemaphoreWait& wait : waits) {
+        waitSemaphores.push_back(wait.semaphore);
+        waitValues.push_back(wait.value);
+    }
+    std::vector<VkPipelineStageFlags> waitStages(waits.size(), waitStage);
+    uint32_t waitCount = static_cast<uint32_t>(waits.size());
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = waitCount;
+    timelineInfo.pWaitSemaphoreValues = waitValues.data();
+    timelineInfo.signalSemaphoreValueCount = signalCount;
+    timelineInfo.pSignalSemaphoreValues = signalValues;
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.waitSemaphoreCount = waitCount;
+    submitInfo.pWaitSemaphores = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = waitStages.data();
+    submitInfo.commandBufferCount =
+        static_cast<uint32_t>(commandBuffers.size());
+    submitInfo.pCommandBuffers = commandBuffers.data();
+    submitInfo.signalSemaphoreCount = signalCount;
+    submitInfo.pSignalSemaphores = signalSemaphores;
+
+    if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit frame command buffers!");
+    }
+}
+}  // namespace
+
 Engine::Engine(uint32_t width, uint32_t height, GLFWwindow* window,
-               Scene& scene)
+               Scene& scene, config::RenderBackend backend)
     : m_window(window) {
-    initVulkan(scene);
+    auto start = std::chrono::high_resolution_clock::now();
+    initVulkan(scene, backend);
+    m_startupMs = std::chrono::duration<double, std::milli>(
+                      std::chrono::high_resolution_clock::now() - start)
+                      .count();
+}
+
+Engine::Engine(uint32_t width, uint32_t height, Scene& scene) {
+    auto start = std::chrono::high_resolution_clock::now();
+    initHeadless(width, height, scene);
+    m_startupMs = std::chrono::duration<double, std::milli>(
+                      std::chrono::high_resolution_clock::now() - start)
+                      .count();
 }
 
-void Engine::initVulkan(Scene& scene) {
+void Engine::printStartupTimings() const {
+    const PipelineCacheStats& cache = m_computePipeline->pipelineCacheStats();
+    const char* state = cache.loadedBytes > 0 ? "loaded"
+                        : cache.rejected     ? "stale, ignored"
+                                             : "cold";
+    printf("startup: %.1f ms, pipeline cache %s (%zu KiB in %.1f ms), "
+           "%u pipelines created in %.1f ms\n",
+           m_startupMs, state, cache.loadedBytes / 1024, cache.loadMs,
+           cache.pipelinesCreated, cache.createMs);
+
+    MemoryStats memory = m_device->allocator().stats();
+    printf("gpu memory: %u device allocations, %llu KiB in %u blocks and %u "
+           "dedicated",
+           memory.deviceAllocations,
+           static_cast<unsigned long long>(memory.reservedBytes / 1024),
+           memory.blockCount, memory.dedicatedCount);
+    for (size_t i = 0; i < MemoryStats::kCategoryCount; i++) {
+        if (memory.allocationCount[i] == 0) continue;
+        printf(", %s %llu KiB",
+               memoryCategoryName(static_cast<MemoryCategory>(i)),
+               static_cast<unsigned long long>(memory.usedBytes[i] / 1024));
+    }
+    printf("\n");
+    printf("queues: %s\n", m_device->asyncCompute()
+                                ? "graphics and async compute"
+                                : "single graphics and compute queue");
+}
+
+void Engine::initVulkan(Scene& scene, config::RenderBackend backend) {
     m_instance = std::make_unique<Instance>(m_window);
     m_device = std::make_unique<Device>(m_instance->getInstance(),
                                         m_instance->getSurface());
+    m_profiler = std::make_unique<GpuProfiler>(*m_device);
     createSyncObjects();
     m_swapChain = std::make_unique<SwapChain>(*m_device, m_window,
                                               m_instance->getSurface());
-    m_computePipeline =
-        std::make_unique<ComputePipeline>(*m_device, *m_swapChain, scene);
+    m_computePipeline = std::make_unique<ComputePipeline>(
+        *m_device, *m_swapChain, scene, *m_profiler);
     m_graphicsPipeline = std::make_unique<GraphicsPipeline>(
-        *m_device, *m_swapChain, *m_instance, m_window, scene);
+        *m_device, *m_swapChain, *m_instance, m_window, scene, *m_profiler,
+        m_computePipeline->resolvePass());
+    if (backend == config::RenderBackend::Cpu) {
+        m_cpuRenderer = std::make_unique<CpuRenderer>(
+            m_swapChain->extent().width, m_swapChain->extent().height, scene);
+    }
+}
+
+void Engine::initHeadless(uint32_t width, uint32_t height, Scene& scene) {
+    m_instance = std::make_unique<Instance>(nullptr);
+    m_device = std::make_unique<Device>(m_instance->getInstance(),
+                                        m_instance->getSurface());
+    m_profiler = std::make_unique<GpuProfiler>(*m_device);
+    createSyncObjects();
+    m_offscreenTarget =
+        std::make_unique<OffscreenTarget>(*m_device, width, height);
+    m_computePipeline = std::make_unique<ComputePipeline>(
+        *m_device, *m_offscreenTarget, scene, *m_profiler);
+}
+
+void Engine::createSyncObjects() {
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    if (!headless()) {
+        m_imageAvailableSemaphores.resize(config::MAX_FRAMES_IN_FLIGHT);
+        for (VkSemaphore& semaphore : m_imageAvailableSemaphores) {
+            if (vkCreateSemaphore(m_device->device(), &semaphoreInfo, nullptr,
+                                  &semaphore) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create semaphores!");
+            }
+        }
+    }
+
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+    semaphoreInfo.pNext = &typeInfo;
+    if (vkCreateSemaphore(m_device->device(), &semaphoreInfo, nullptr,
+                          &m_frameTimeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create frame timeline semaphore!");
+    }
+    if (m_device->asyncCompute() &&
+        vkCreateSemaphore(m_device->device(), &semaphoreInfo, nullptr,
+                          &m_traceTimeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create trace timeline semaphore!");
+    }
+}
+
+VkSemaphore Engine::renderFinishedSemaphore(uint32_t imageIndex) {
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    while (m_renderFinishedSemaphores.size() <= imageIndex) {
+        VkSemaphore semaphore;
+        if (vkCreateSemaphore(m_device->device(), &semaphoreInfo, nullptr,
+                              &semaphore) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create semaphores!");
+        }
+        m_renderFinishedSemaphores.push_back(semaphore);
+    }
+    return m_renderFinishedSemaphores[imageIndex];
 }
 
 void Engine::cleanup() {
     vkDeviceWaitIdle(m_device->device());
-    for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
-        vkDestroySemaphore(m_device->device(), m_renderFinishedSemaphores[i],
-                           nullptr);
-        vkDestroySemaphore(m_device->device(), m_imageAvailableSemaphores[i],
-                           nullptr);
-        vkDestroyFence(m_device->device(), m_inFlightFences[i], nullptr);
+    for (VkSemaphore semaphore : m_renderFinishedSemaphores) {
+        vkDestroySemaphore(m_device->device(), semaphore, nullptr);
+    }
+    for (VkSemaphore semaphore : m_imageAvailableSemaphores) {
+        vkDestroySemaphore(m_device->device(), semaphore, nullptr);
+    }
+    vkDestroySemaphore(m_device->device(), m_frameTimeline, nullptr);
+    if (m_traceTimeline != VK_NULL_HANDLE) {
+        vkDestroySemaphore(m_device->device(), m_traceTimeline, nullptr);
     }
 
     m_swapChain.reset();
     m_computePipeline.reset();
     m_graphicsPipeline.reset();
+    m_offscreenTarget.reset();
+    m_cpuRenderer.reset();
+    m_profiler.reset();
     m_device.reset();
-    glfwDestroyWindow(m_window);
-    glfwTerminate();
+    if (m_window != nullptr) {
+        glfwDestroyWindow(m_window);
+        glfwTerminate();
+    }
+}
+
+void Engine::saveOutput(const std::string& path) {
+    vkDeviceWaitIdle(m_device->device());
+    m_offscreenTarget->save(path);
+}
+
+void Engine::setFramesInFlight(uint32_t count) {
+    uint32_t limit = config::MAX_FRAMES_IN_FLIGHT;
+    // The UI pass never uploads into a vertex buffer another frame in
+    // flight draws from, and there is one per swap chain image
+    if (!headless()) limit = std::min(limit, m_swapChain->imageCount());
+    count = std::clamp(count, 1u, limit);
+    if (count != m_framesInFlight) {
+        // Slots are renumbered, so every frame they hold has to be read
+        // back first, oldest first
+        waitForFrames(m_frameNumber);
+        uint64_t first = m_frameNumber - std::min<uint64_t>(m_frameNumber,
+                                                            m_framesInFlight);
+        for (uint64_t frame = first; frame < m_frameNumber; frame++) {
+            uint32_t slot = static_cast<uint32_t>(frame % m_framesInFlight);
+            m_profiler->collect(slot);
+            m_computePipeline->frameCompleted(slot);
+        }
+        m_framesInFlight = count;
+    }
+    if (m_graphicsPipeline) m_graphicsPipeline->setFramesInFlight(count);
+}
+
+void Engine::setAccumulationFormat(config::AccumulationFormat format) {
+    m_computePipeline->setAccumulationFormat(format);
+}
+
+void Engine::setIntegrator(config::Integrator integrator) {
+    m_computePipeline->setIntegrator(integrator);
+}
+
+void Engine::setRouletteDepth(uint32_t depth) {
+    m_computePipeline->setRouletteDepth(depth);
+}
+
+void Engine::setNoiseThreshold(float threshold) {
+    m_computePipeline->setNoiseThreshold(threshold);
+}
+
+bool Engine::converged() const {
+    return !m_cpuRenderer && m_computePipeline->converged();
+}
+
+void Engine::setSampleBatch(uint32_t samplesPerPixel,
+                            uint32_t dispatchesPerFrame) {
+    m_computePipeline->setSampleBatch(samplesPerPixel, dispatchesPerFrame);
+}
+
+void Engine::waitForFrames(uint64_t frameCount) {
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_frameTimeline;
+    waitInfo.pValues = &frameCount;
+    if (vkWaitSemaphores(m_device->device(), &waitInfo, UINT64_MAX) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to wait for frame timeline!");
+    }
+}
+
+void Engine::waitForSlot() {
+    auto start = std::chrono::high_resolution_clock::now();
+    m_currentFrame = static_cast<uint32_t>(m_frameNumber % m_framesInFlight);
+    // the slot was last used m_framesInFlight frames ago
+    if (m_frameNumber >= m_framesInFlight) {
+        waitForFrames(m_frameNumber + 1 - m_framesInFlight);
+    }
+    m_waitMs = std::chrono::duration<double, std::milli>(
+                   std::chrono::high_resolution_clock::now() - start)
+                   .count();
+    m_profiler->collect(m_currentFrame);
+    m_computePipeline->frameCompleted(m_currentFrame);
+}
+
+void Engine::beginFrame(const VkExtent2D& extent) {
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(m_device->device(), m_frameTimeline,
+                               &completed);
+    m_profiler->recordPacing(m_waitMs, m_frameNumber - completed);
+    // frames between two traces only resolve, still ones may trace a batch
+    // over the tiles adaptive sampling has left
+    uint64_t paths = m_cpuRenderer
+                         ? static_cast<uint64_t>(extent.width) * extent.height
+                         : m_computePipeline->pathsDue();
+    m_profiler->beginFrame(m_currentFrame, paths);
+}
+
+void Engine::submitFrame(VkSemaphore imageAvailable,
+                         VkSemaphore presentSemaphore) {
+    const std::vector<VkCommandBuffer>& computeCommandBuffers =
+        m_computePipeline->commandBuffers(m_currentFrame);
+    uint64_t frameValue = m_frameNumber + 1;
+    // The image is first touched by the resolve's copy, everything before
+    // it overlaps the acquire
+    std::vector<SemaphoreWait> waits;
+    if (imageAvailable != VK_NULL_HANDLE) waits.push_back({imageAvailable, 0});
+    if (m_device->asyncCompute()) {
+        // The trace never touches the swap chain image, so it does not wait
+        // for the acquire, and the next frame's trace runs while this
+        // frame's copy, UI pass and present are still going
+        submitCommandBuffers(m_device->computeQueue(), computeCommandBuffers,
+                             {}, 0, m_traceTimeline, frameValue,
+                             VK_NULL_HANDLE);
+        waits.push_back({m_traceTimeline, frameValue});
+        m_submitCommandBuffers.assign(
+            1, *m_graphicsPipeline->getCurrentCommandBuffer(m_currentFrame));
+        submitCommandBuffers(m_device->graphicsQueue(), m_submitCommandBuffers,
+                             waits, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             m_frameTimeline, frameValue, presentSemaphore);
+    } else {
+        m_submitCommandBuffers = computeCommandBuffers;
+        if (m_graphicsPipeline) {
+            m_submitCommandBuffers.push_back(
+                *m_graphicsPipeline->getCurrentCommandBuffer(m_currentFrame));
+        }
+        submitCommandBuffers(m_device->graphicsQueue(), m_submitCommandBuffers,
+                             waits, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             m_frameTimeline, frameValue, presentSemaphore);
+    }
+    m_frameNumber++;
+}
+
+void Engine::renderOffscreen() {
+    // No acquire or present: the only pacing is the frames in flight limit
+    waitForSlot();
+    beginFrame(m_offscreenTarget->extent());
+
+    m_computePipeline->render(0, m_currentFrame);
+    submitFrame(VK_NULL_HANDLE, VK_NULL_HANDLE);
+}
+
+void Engine::recreateSwapChain() {
+    m_swapChain->recreateSwapChain();
+    // the compute descriptor sets and recorded command buffers reference
+    // the old images
+    m_computePipeline->windowResized();
+    // the new swap chain may have fewer images
+    setFramesInFlight(m_framesInFlight);
 }
 
 void Engine::render() {
-    vkWaitForFences(m_device->device(), 1, &m_inFlightFences[m_currentFrame],
-                    VK_TRUE, UINT64_MAX);
+    if (headless()) {
+        renderOffscreen();
+        return;
+    }
+
+    // frame count chosen in the UI during the previous frame
+    if (m_graphicsPipeline->framesInFlight() != m_framesInFlight) {
+        setFramesInFlight(m_graphicsPipeline->framesInFlight());
+    }
+    waitForSlot();
 
     uint32_t imageIndex;
+    auto acquireStart = std::chrono::high_resolution_clock::now();
     VkResult result = vkAcquireNextImageKHR(
         m_device->device(), m_swapChain->getSwapChain(), UINT64_MAX,
         m_imageAvailableSemaphores[m_currentFrame], VK_NULL_HANDLE,
         &imageIndex);
+    m_waitMs += std::chrono::duration<double, std::milli>(
+                    std::chrono::high_resolution_clock::now() - acquireStart)
+                    .count();
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-        m_swapChain->recreateSwapChain();
+        recreateSwapChain();
         return;
     } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
         throw std::runtime_error("failed to acquire swap chain image!");
     }
 
-    vkResetFences(m_device->device(), 1, &m_inFlightFences[m_currentFrame]);
+    // settings chosen in the UI during the previous frame
+    m_computePipeline->resolvePass().setTonemapSettings(
+        m_graphicsPipeline->tonemapSettings());
+    m_computePipeline->setTraceInterval(m_graphicsPipeline->traceInterval());
+    m_computePipeline->setSampleBatch(m_graphicsPipeline->samplesPerPixel(),
+                                      m_graphicsPipeline->dispatchesPerFrame());
+    m_computePipeline->setIntegrator(m_graphicsPipeline->integrator());
+    m_computePipeline->setRouletteDepth(m_graphicsPipeline->rouletteDepth());
+    if (m_cpuRenderer) {
+        m_cpuRenderer->setRouletteDepth(m_graphicsPipeline->rouletteDepth());
+    }
+    // A new format restarts accumulating, so it is applied before
+    // beginFrame() decides whether this frame traces
+    m_computePipeline->setAccumulationFormat(
+        m_graphicsPipeline->accumulationFormat());
+    m_computePipeline->setNoiseThreshold(m_graphicsPipeline->noiseThreshold());
+    const VkExtent2D& extent = m_swapChain->extent();
+    beginFrame(extent);
 
     // Record command buffers
-    m_computePipeline->render(imageIndex, m_currentFrame);
+    if (m_cpuRenderer) {
+        if (m_cpuRenderer->width() != extent.width ||
+            m_cpuRenderer->height() != extent.height) {
+            m_cpuRenderer->resize(extent.width, extent.height);
+        }
+        m_cpuRenderer->render();
+        m_computePipeline->renderHostImage(imageIndex, m_currentFrame,
+                                           m_cpuRenderer->pixels());
+    } else {
+        // preset chosen in the UI during the previous frame
+        m_computePipeline->setQualityPreset(
+            m_graphicsPipeline->qualityPreset());
+        m_computePipeline->render(imageIndex, m_currentFrame);
+    }
     m_graphicsPipeline->render(imageIndex, m_currentFrame);
 
-    // Submit compute work
-    VkSubmitInfo computeSubmitInfo{};
-    computeSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    computeSubmitInfo.waitSemaphoreCount = 1;
-    computeSubmitInfo.pWaitSemaphores =
-        &m_imageAvailableSemaphores[m_currentFrame];
-    VkPipelineStageFlags computeWaitStages[] = {
-        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT};
-    computeSubmitInfo.pWaitDstStageMask = computeWaitStages;
-    computeSubmitInfo.commandBufferCount = 1;
-    computeSubmitInfo.pCommandBuffers =
-        m_computePipeline->getCurrentCommandBuffer(m_currentFrame);
-    computeSubmitInfo.signalSemaphoreCount = 1;
-    computeSubmitInfo.pSignalSemaphores =
-        &m_renderFinishedSemaphores[m_currentFrame];
-
-    if (vkQueueSubmit(m_device->computeQueue(), 1, &computeSubmitInfo,
-                      VK_NULL_HANDLE) != VK_SUCCESS) {
-        throw std::runtime_error("failed to submit compute command buffer!");
-    }
-
-    // Submit graphics work
-    VkSubmitInfo graphicsSubmitInfo{};
-    graphicsSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    graphicsSubmitInfo.waitSemaphoreCount = 1;
-    graphicsSubmitInfo.pWaitSemaphores =
-        &m_renderFinishedSemaphores[m_currentFrame];
-    VkPipelineStageFlags graphicsWaitStages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    graphicsSubmitInfo.pWaitDstStageMask = graphicsWaitStages;
-    graphicsSubmitInfo.commandBufferCount = 1;
-    graphicsSubmitInfo.pCommandBuffers =
-        m_graphicsPipeline->getCurrentCommandBuffer(m_currentFrame);
-    graphicsSubmitInfo.signalSemaphoreCount = 1;
-    graphicsSubmitInfo.pSignalSemaphores =
-        &m_renderFinishedSemaphores[m_currentFrame];
-
-    if (vkQueueSubmit(m_device->graphicsQueue(), 1, &graphicsSubmitInfo,
-                      m_inFlightFences[m_currentFrame]) != VK_SUCCESS) {
-        throw std::runtime_error("failed to submit graphics command buffer!");
-    }
+    VkSemaphore renderFinished = renderFinishedSemaphore(imageIndex);
+    submitFrame(m_imageAvailableSemaphores[m_currentFrame], renderFinished);
 
     // Present
     VkPresentInfoKHR presentInfo{};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
     presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = &m_renderFinishedSemaphores[m_currentFrame];
+    presentInfo.pWaitSemaphores = &renderFinished;
     presentInfo.swapchainCount = 1;
     presentInfo.pSwapchains = &m_swapChain->getSwapChain();
     presentInfo.pImageIndices = &imageIndex;
@@ -123,11 +436,8 @@ void Engine::render() {
     if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
         m_framebufferResized) {
         m_framebufferResized = false;
-        m_swapChain->recreateSwapChain();
-        m_computePipeline->windowResized();
+        recreateSwapChain();
     } else if (result != VK_SUCCESS) {
         throw std::runtime_error("failed to present swap chain image!");
     }
-
-    m_currentFrame = (m_currentFrame + 1) % config::MAX_FRAMES_IN_FLIGHT;
-}
\ No newline at end of file
+}
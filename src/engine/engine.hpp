@@ -8,59 +8,103 @@
 
 #include "includes/compute_pipeline.hpp"
 #include "includes/config.hpp"
+#include "includes/cpu_renderer.hpp"
 #include "includes/device.hpp"
+#include "includes/gpu_profiler.hpp"
 #include "includes/graphics_pipeline.hpp"
 #include "includes/instance.hpp"
+#include "includes/offscreen_target.hpp"
 #include "includes/swap_chain.hpp"
 class Engine {
    public:
-    Engine(uint32_t width, uint32_t height, GLFWwindow* window, Scene& scene);
+    Engine(uint32_t width, uint32_t height, GLFWwindow* window, Scene& scene,
+           config::RenderBackend backend = config::RenderBackend::Gpu);
+    // Headless engine: traces into an offscreen image, no window or swap chain
+    Engine(uint32_t width, uint32_t height, Scene& scene);
     ~Engine() { cleanup(); };
     void render();
     void setFramebufferResized(bool resized) { m_framebufferResized = resized; }
+    bool headless() const { return m_window == nullptr; }
+    // Waits for outstanding frames and writes the offscreen image to disk
+    void saveOutput(const std::string& path);
+    // Time to set up Vulkan, how much of it went into pipelines, and the GPU
+    // memory allocated for each subsystem
+    void printStartupTimings() const;
+    // Per frame GPU timings, for the overlay and for benchmarks
+    const GpuProfiler& profiler() const { return *m_profiler; }
+    // 1 for the lowest latency up to MAX_FRAMES_IN_FLIGHT for throughput,
+    // and no more than the swap chain has images. Drains the queue first.
+    void setFramesInFlight(uint32_t count);
+    uint32_t framesInFlight() const { return m_framesInFlight; }
+    // Headless only, the window has a combo for it. Restarts accumulating.
+    void setAccumulationFormat(config::AccumulationFormat format);
+    // Headless only, the window has a combo for it
+    void setIntegrator(config::Integrator integrator);
+    // Headless only, the window has a slider for it
+    void setRouletteDepth(uint32_t depth);
+    // Headless only, the window has a slider for it. 0 traces every pixel
+    // every frame, above it adaptive sampling stops tracing converged tiles.
+    // Restarts accumulating.
+    void setNoiseThreshold(float threshold);
+    // Whether adaptive sampling has converged every tile, so frames only
+    // resolve until something resets the accumulation
+    bool converged() const;
+    // Headless only, the window has sliders for them. Each frame traces
+    // samplesPerPixel paths per pixel in each of dispatchesPerFrame
+    // dispatches, once the first frame has cleared the accumulation.
+    void setSampleBatch(uint32_t samplesPerPixel, uint32_t dispatchesPerFrame);
 
    private:
-    void initVulkan(Scene& scene);
+    void initVulkan(Scene& scene, config::RenderBackend backend);
+    void initHeadless(uint32_t width, uint32_t height, Scene& scene);
+    void renderOffscreen();
     void cleanup();
-    void createSyncObjects() {
-        m_imageAvailableSemaphores.resize(config::MAX_FRAMES_IN_FLIGHT);
-        m_renderFinishedSemaphores.resize(config::MAX_FRAMES_IN_FLIGHT);
-        m_inFlightFences.resize(config::MAX_FRAMES_IN_FLIGHT);
-
-        VkSemaphoreCreateInfo semaphoreInfo{};
-        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-        for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
-            if (vkCreateSemaphore(m_device->device(), &semaphoreInfo, nullptr,
-                                  &m_imageAvailableSemaphores[i]) !=
-                    VK_SUCCESS ||
-                vkCreateSemaphore(m_device->device(), &semaphoreInfo, nullptr,
-                                  &m_renderFinishedSemaphores[i]) !=
-                    VK_SUCCESS ||
-                vkCreateFence(m_device->device(), &fenceInfo, nullptr,
-                              &m_inFlightFences[i]) != VK_SUCCESS) {
-                throw std::runtime_error(
-                    "failed to create graphics synchronization objects for a"
-                    "frame!");
-            }
-        }
-    }
+    void createSyncObjects();
+    // Waits until the frame that last used the next slot has finished, then
+    // reads its timings. Sets m_currentFrame.
+    void waitForSlot();
+    // Records how the frame was paced and starts its profiler slot
+    void beginFrame(const VkExtent2D& extent);
+    // Blocks until frames [0, frameCount) are done on the GPU
+    void waitForFrames(uint64_t frameCount);
+    // Submits compute, then the UI pass when there is one, in one batch or
+    // one per queue with async compute. Waits for imageAvailable before the
+    // copy into the swap chain image, and signals the frame timeline and,
+    // when presenting, presentSemaphore.
+    void submitFrame(VkSemaphore imageAvailable, VkSemaphore presentSemaphore);
+    void recreateSwapChain();
+    // Present waits on a binary semaphore. There is one per swap chain
+    // image, free again once the image has been acquired again.
+    VkSemaphore renderFinishedSemaphore(uint32_t imageIndex);
 
    private:
-    GLFWwindow* m_window;
+    GLFWwindow* m_window = nullptr;
     std::unique_ptr<Instance> m_instance;
     std::unique_ptr<Device> m_device;
+    std::unique_ptr<GpuProfiler> m_profiler;
     std::unique_ptr<SwapChain> m_swapChain;
+    std::unique_ptr<OffscreenTarget> m_offscreenTarget;
     std::unique_ptr<GraphicsPipeline> m_graphicsPipeline;
     std::unique_ptr<ComputePipeline> m_computePipeline;
+    // only set for the CPU backend, frames are uploaded to the HDR image
+    std::unique_ptr<CpuRenderer> m_cpuRenderer;
 
+    double m_startupMs = 0.0;
     bool m_framebufferResized = false;
     std::vector<VkSemaphore> m_imageAvailableSemaphores;
     std::vector<VkSemaphore> m_renderFinishedSemaphores;
-    std::vector<VkFence> m_inFlightFences;
+    // Frame n signals n + 1 when its command buffers have finished, so the
+    // counter is the number of frames done
+    VkSemaphore m_frameTimeline = VK_NULL_HANDLE;
+    // Same values, signalled once the trace and resolve are done, when they
+    // have a queue of their own
+    VkSemaphore m_traceTimeline = VK_NULL_HANDLE;
+    // frames submitted so far
+    uint64_t m_frameNumber = 0;
+    uint32_t m_framesInFlight = config::DEFAULT_FRAMES_IN_FLIGHT;
+    // slot of the frame being recorded, m_frameNumber % m_framesInFlight
     uint32_t m_currentFrame = 0;
+    std::vector<VkCommandBuffer> m_submitCommandBuffers;
+    // time the CPU spent blocked on the GPU or the swap chain this frame
+    double m_waitMs = 0.0;
 };
@@ -2,60 +2,289 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <memory>
+
+#include "compute_variant.hpp"
+#include "config.hpp"
 #include "device.hpp"
+#include "gpu_profiler.hpp"
+#include "pipeline_cache.hpp"
+#include "render_target.hpp"
+#include "resolve_pass.hpp"
 #include "scene.hpp"
-#include "swap_chain.hpp"
+#include "wavefront_integrator.hpp"
+
 class ComputePipeline {
    public:
-    ComputePipeline(Device& device, SwapChain& swapChain, Scene& scene);
+    ComputePipeline(Device& device, RenderTarget& target, Scene& scene,
+                    GpuProfiler& profiler);
     ~ComputePipeline();
+    // Traces into the HDR image when a trace is due, then resolves it into
+    // the target image
     void render(uint32_t imageIndex, uint32_t currentFrame);
-    VkCommandBuffer* getCurrentCommandBuffer(uint32_t currentFrame) {
-        return &m_commandBuffers[currentFrame];
+    // Copies a frame traced on the host (CpuRenderer) into the HDR image
+    // instead of dispatching the compute shader, then resolves it
+    void renderHostImage(uint32_t imageIndex, uint32_t currentFrame,
+                         const std::vector<glm::vec4>& pixels);
+    // Command buffers to submit, in order, for the frame last recorded in
+    // currentFrame's slot
+    const std::vector<VkCommandBuffer>& commandBuffers(
+        uint32_t currentFrame) const {
+        return m_submitCommandBuffers[currentFrame];
     }
     void windowResized();
+    // Takes effect from the next render()
+    void setQualityPreset(config::QualityPreset preset) {
+        m_qualityPreset = preset;
+    }
+    // Takes effect from the next render(). Both integrators trace the same
+    // samples, so switching keeps the accumulation.
+    void setIntegrator(config::Integrator integrator) {
+        m_integrator = integrator;
+    }
+    // Reallocates the accumulation buffer and restarts accumulating when the
+    // format changes. Drains the queue first.
+    void setAccumulationFormat(config::AccumulationFormat format);
+    // Frames between two traces while the image accumulates, the ones in
+    // between only resolve it again. Camera moves and resets always trace.
+    void setTraceInterval(uint32_t interval) {
+        m_traceInterval = std::max(interval, 1u);
+    }
+    // Paths per pixel traced by each dispatch, and dispatches recorded into
+    // one frame, while the view is still. Camera moves and resets trace a
+    // single sample so the view keeps up. Takes effect from the next
+    // render().
+    void setSampleBatch(uint32_t samplesPerPixel, uint32_t dispatchesPerFrame) {
+        m_samplesPerPixel = std::max(samplesPerPixel, 1u);
+        m_dispatchesPerFrame = std::max(dispatchesPerFrame, 1u);
+    }
+    // Takes effect from the next render(). The expected image is the same,
+    // so the accumulation goes on.
+    void setRouletteDepth(uint32_t depth) {
+        m_rouletteDepth = std::max(depth, 1u);
+    }
+    // Relative standard error of a pixel's mean luminance at which adaptive
+    // sampling stops tracing its tile, 0 to trace every pixel every frame.
+    // Restarts accumulating, and switching it on or off reallocates the
+    // variance and tile buffers after draining the queue.
+    void setNoiseThreshold(float threshold);
+    // Reads what the slot's last frame left for the host, once it is done
+    void frameCompleted(uint32_t currentFrame);
+    // Whether adaptive sampling has no tile left to trace. Known a few
+    // frames late, as the tile count is read back.
+    bool converged() const;
+    // Whether the next render() traces
+    bool traceDue() const;
+    // Samples per pixel the next render() adds, for the profiler
+    uint32_t samplesDue() const;
+    // Paths the next render() traces, for the profiler
+    uint64_t pathsDue() const;
+    ResolvePass& resolvePass() { return m_resolvePass; }
+    const PipelineCacheStats& pipelineCacheStats() const {
+        return m_pipelineCache.stats();
+    }
 
    private:
+    // The dispatch is the same every frame, so it is recorded once per swap
+    // chain image and frame slot (index image * MAX_FRAMES_IN_FLIGHT +
+    // slot) and resubmitted until the extent changes or it is invalidated
+    struct DispatchCommandBuffer {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkExtent2D extent = {0, 0};
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        FramePushConstants pushConstants = {};
+        uint32_t dispatches = 0;
+        config::Integrator integrator = config::Integrator::Megakernel;
+        // the wavefront passes depend on it, the megakernel reads it from
+        // SceneSettings
+        uint32_t samplesPerPixel = 0;
+        bool valid = false;
+    };
+    struct CompiledVariant {
+        ComputeVariant variant;
+        VkPipeline pipeline;
+        // tiles.comp, only for adaptive variants
+        VkPipeline classifyPipeline;
+    };
+    // Side of an adaptive sampling tile in pixels, the megakernel's
+    // workgroup and TILE_SIZE in trace.glsl
+    static constexpr uint32_t kTileSize = 8;
+
     void createPipeline();
+    // Compiled pipelines of variant, compiling them the first time
+    const CompiledVariant& pipeline(const ComputeVariant& variant);
+    VkPipeline compilePipeline(VkShaderModule shaderModule,
+                               const ComputeVariant& variant);
+    void selectVariant();
     void createDescriptorSetLayout();
     void createCommandPool();
     void createCommandBuffers();
+    // (Re)allocates a dispatch per swap chain image and frame slot
+    void createDispatchCommandBuffers();
     void createDescriptorPool();
     void createDescriptorSets();
     void createUniformBuffers();
-    void createAccumulationImage();
+    // Sized for the target's extent in m_accumulationFormat
+    void createAccumulationBuffer();
+    // Sized for the target's extent while there is a noise threshold,
+    // minimal otherwise
+    void createAdaptiveBuffers();
+    void destroyAdaptiveBuffers();
+    // Tiles of kTileSize pixels covering the target
+    VkExtent2D tileGrid() const;
     void recordCommandBuffer(VkCommandBuffer commandBuffer,
                              uint32_t currentFrame, uint32_t imageIndex);
+    // The megakernel's dispatches, bound to frameSet
+    void recordDispatches(VkCommandBuffer commandBuffer,
+                          VkDescriptorSet frameSet, VkExtent2D extent,
+                          const VkMemoryBarrier& accumulationBarrier);
+    // Lists the tiles still above the noise threshold for the next frame
+    // and copies their count to the slot's readback buffer
+    void recordTileClassification(VkCommandBuffer commandBuffer,
+                                  uint32_t currentFrame,
+                                  VkDescriptorSet frameSet,
+                                  const VkMemoryBarrier& accumulationBarrier);
+    // Records the staged scene copies, returns false without recording
+    // anything when there are none
+    bool recordSceneCopies(VkCommandBuffer commandBuffer,
+                           uint32_t currentFrame);
+    void recordUploadCommandBuffer(VkCommandBuffer commandBuffer,
+                                   uint32_t currentFrame);
+    void writeHostImage(uint32_t currentFrame,
+                        const std::vector<glm::vec4>& pixels);
+    void destroyHostImageBuffer(uint32_t currentFrame);
     void updateScene(uint32_t currentImage);
-    void updateDescriptorSets(uint32_t imageIndex, uint32_t currentFrame);
+    // Marks every cached set stale, for when an image or buffer they
+    // reference is recreated. The device must be idle.
+    void invalidateDescriptorSets();
+    // Drops every recorded dispatch, for when anything they reference
+    // changes. The device must be idle.
+    void invalidateCommandBuffers();
+    VkCommandBuffer dispatchCommandBuffer(uint32_t imageIndex,
+                                          uint32_t currentFrame);
+    VkDescriptorSet descriptorSet(uint32_t imageIndex, uint32_t currentFrame);
+    void writeDescriptorSet(VkDescriptorSet descriptorSet,
+                            uint32_t currentFrame);
     VkCommandBuffer beginSingleTimeCommands();
     void endSingleTimeCommands(VkCommandBuffer commandBuffer);
 
    private:
     Device& m_device;
-    SwapChain& m_swapChain;
+    RenderTarget& m_target;
+    GpuProfiler& m_profiler;
+    PipelineCache m_pipelineCache;
+    // owns the HDR image the trace writes, built with m_pipelineCache
+    ResolvePass m_resolvePass;
     VkDescriptorSetLayout m_descriptorSetLayout;
     VkPipelineLayout m_pipelineLayout;
-    VkPipeline m_pipeline;
+    VkShaderModule m_shaderModule;
+    VkShaderModule m_tileShaderModule;
+    std::vector<CompiledVariant> m_pipelines;
+    // variant of the frame being recorded
+    config::QualityPreset m_qualityPreset = config::QualityPreset::Full;
+    ComputeVariant m_variant;
+    VkPipeline m_pipeline = VK_NULL_HANDLE;
+    VkPipeline m_classifyPipeline = VK_NULL_HANDLE;
+    config::Integrator m_integrator = config::Integrator::Megakernel;
+    // created the first time a frame is traced with it
+    std::unique_ptr<WavefrontIntegrator> m_wavefront;
+    uint32_t m_traceInterval = 1;
+    // resolve only frames since the last trace
+    uint32_t m_framesSinceTrace = 0;
+    uint32_t m_samplesPerPixel = 1;
+    uint32_t m_dispatchesPerFrame = 1;
+    uint32_t m_rouletteDepth = config::DEFAULT_ROULETTE_DEPTH;
+    // dispatches of the frame being recorded, 1 when the camera moved
+    uint32_t m_frameDispatches = 1;
+
+    // Radiance accumulated per pixel, packed in 32-bit words as the format
+    // says. Its sample count is the same for every pixel, so it is kept once
+    // in SceneSettings instead of next to each pixel, unless adaptive
+    // sampling keeps one per pixel in the variance buffer.
+    config::AccumulationFormat m_accumulationFormat =
+        config::AccumulationFormat::Rgb32f;
+    VkDeviceSize m_accumulationBufferSize = 0;
+    VkBuffer m_accumulationBuffer;
+    Allocation m_accumulationBufferMemory;
+    // samples in the accumulation once the last traced frame is done
+    uint32_t m_accumulatedSamples = 0;
 
-    // accumulation image
-    VkImage m_accumulationImage;
-    VkDeviceMemory m_accumulationImageMemory;
-    VkImageView m_accumulationImageView;
+    // Adaptive sampling, on while the threshold is above 0. Each pixel's
+    // sample count and luminance variance, the tiles the trace dispatches
+    // over and the list tiles.comp makes for the next frame, all device
+    // local and shared by the frames in flight like the accumulation.
+    float m_noiseThreshold = 0.0f;
+    VkDeviceSize m_varianceBufferSize = 0;
+    VkBuffer m_varianceBuffer;
+    Allocation m_varianceBufferMemory;
+    VkDeviceSize m_tileBufferSize = 0;
+    VkBuffer m_activeTileBuffer;
+    Allocation m_activeTileBufferMemory;
+    VkBuffer m_nextTileBuffer;
+    Allocation m_nextTileBufferMemory;
+    // Host visible, the length of the list each slot's last frame made, and
+    // whether that frame traced since the last reset and is still unread
+    std::vector<VkBuffer> m_tileCountBuffers;
+    std::vector<Allocation> m_tileCountBuffersMemory;
+    std::vector<bool> m_tileCountsPending;
+    // tiles left as of the last count read back
+    uint32_t m_activeTiles = 0;
 
-    // uniforms
+    // Sets per swap chain image and frame slot (index image *
+    // MAX_FRAMES_IN_FLIGHT + slot), each written on first use and then
+    // reused until invalidated
     std::vector<VkDescriptorSet> m_descriptorSets;
+    std::vector<bool> m_descriptorSetsWritten;
+    uint32_t m_descriptorImageCount = 0;
+
+    // camera and accumulation reset of the frame being recorded
+    FramePushConstants m_pushConstants = {};
+
+    // scene settings, only rewritten when they change
     std::vector<VkBuffer> m_uniformBuffers;
-    std::vector<VkDeviceMemory> m_uniformBuffersMemory;
+    std::vector<Allocation> m_uniformBuffersMemory;
     std::vector<void*> m_uniformBuffersMapped;
+    std::vector<SceneSettings> m_uniformSettings;
 
-    // sphere and scene buffer
-    std::vector<VkBuffer> m_sphereBuffers;
-    std::vector<VkDeviceMemory> m_sphereBuffersMemory;
-    std::vector<void*> m_sphereBuffersMapped;
+    // Scene buffers in device local memory, shared by the frames in flight.
+    // Only the changed ranges are copied in, at the start of a frame.
+    VkDeviceSize m_sphereBufferSize = 0;
+    VkBuffer m_sphereBuffer;
+    Allocation m_sphereBufferMemory;
     Scene& m_scene;
 
+    // scene BVH nodes and primitive indices, sized for every sphere
+    VkDeviceSize m_bvhNodeBufferSize = 0;
+    VkDeviceSize m_bvhIndexBufferSize = 0;
+    VkBuffer m_bvhNodeBuffer;
+    Allocation m_bvhNodeBufferMemory;
+    VkBuffer m_bvhIndexBuffer;
+    Allocation m_bvhIndexBufferMemory;
+
+    // Host visible staging ring with one slice per frame in flight, each
+    // large enough to reupload every scene buffer. A frame only writes its
+    // own slice, released by the slot's previous frame.
+    VkDeviceSize m_stagingSliceSize = 0;
+    VkBuffer m_stagingBuffer;
+    Allocation m_stagingBufferMemory;
+    void* m_stagingBufferMapped = nullptr;
+    // scene changes not uploaded yet, and the copies staged for this frame
+    SceneChanges m_pendingUpload;
+    std::vector<VkBufferCopy> m_sphereCopies;
+    std::vector<VkBufferCopy> m_bvhNodeCopies;
+    std::vector<VkBufferCopy> m_bvhIndexCopies;
+
+    // staging buffers for host traced frames, sized lazily per frame
+    std::vector<VkBuffer> m_hostImageBuffers;
+    std::vector<Allocation> m_hostImageBuffersMemory;
+    std::vector<void*> m_hostImageBuffersMapped;
+    std::vector<VkDeviceSize> m_hostImageBufferSizes;
+
     VkCommandPool m_commandPool;
+    // per frame slot, re-recorded with the scene copies or host frame
     std::vector<VkCommandBuffer> m_commandBuffers;
+    std::vector<std::vector<VkCommandBuffer>> m_submitCommandBuffers;
+    std::vector<DispatchCommandBuffer> m_dispatchCommandBuffers;
     VkDescriptorPool m_descriptorPool;
 };
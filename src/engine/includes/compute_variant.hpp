@@ -0,0 +1,58 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <cstddef>
+
+// Specialization constants shared by shader.comp, wavefront.comp and
+// tiles.comp, in constant_id order. Each distinct variant is compiled into
+// its own pipeline on first use.
+struct ComputeVariant {
+    // Scenes up to this many spheres test them all instead of the BVH
+    static constexpr uint32_t kSmallSceneLimit = 16;
+    static constexpr uint32_t kConstantCount = 8;
+
+    uint32_t workgroupWidth = 8;
+    uint32_t workgroupHeight = 8;
+    uint32_t maxDepth = 50;
+    VkBool32 emission = VK_TRUE;
+    VkBool32 roughness = VK_TRUE;
+    uint32_t smallSceneCount = 0;
+    // config::AccumulationFormat
+    uint32_t accumulationFormat = 0;
+    // adaptive sampling, on while there is a noise threshold
+    VkBool32 adaptive = VK_FALSE;
+
+    bool operator==(const ComputeVariant& other) const {
+        return workgroupWidth == other.workgroupWidth &&
+               workgroupHeight == other.workgroupHeight &&
+               maxDepth == other.maxDepth && emission == other.emission &&
+               roughness == other.roughness &&
+               smallSceneCount == other.smallSceneCount &&
+               accumulationFormat == other.accumulationFormat &&
+               adaptive == other.adaptive;
+    }
+
+    // Map entries of the fields above, for specialization data starting
+    // with a ComputeVariant
+    static std::array<VkSpecializationMapEntry, kConstantCount> mapEntries() {
+        std::array<VkSpecializationMapEntry, kConstantCount> entries{};
+        entries[0] = {0, offsetof(ComputeVariant, workgroupWidth),
+                      sizeof(uint32_t)};
+        entries[1] = {1, offsetof(ComputeVariant, workgroupHeight),
+                      sizeof(uint32_t)};
+        entries[2] = {2, offsetof(ComputeVariant, maxDepth),
+                      sizeof(uint32_t)};
+        entries[3] = {3, offsetof(ComputeVariant, emission),
+                      sizeof(VkBool32)};
+        entries[4] = {4, offsetof(ComputeVariant, roughness),
+                      sizeof(VkBool32)};
+        entries[5] = {5, offsetof(ComputeVariant, smallSceneCount),
+                      sizeof(uint32_t)};
+        entries[6] = {6, offsetof(ComputeVariant, accumulationFormat),
+                      sizeof(uint32_t)};
+        entries[7] = {7, offsetof(ComputeVariant, adaptive),
+                      sizeof(VkBool32)};
+        return entries;
+    }
+};
@@ -1,4 +1,6 @@
 #pragma once
+#include <vulkan/vulkan.h>
+
 #include <vector>
 
 namespace config {
@@ -8,8 +10,59 @@ constexpr bool enableValidationLayers = false;
 constexpr bool enableValidationLayers = true;
 #endif
 
+// Which renderer traces the image, selected at startup
+enum class RenderBackend { Gpu, Cpu };
+
+// Compute shader variant picked in the UI. Offline renders always use Full.
+enum class QualityPreset { Preview, Interactive, Full };
+
+// Curve ResolvePass maps the traced radiance to the display range with,
+// picked in the UI. Same values as TONEMAP_* in tonemap.comp.
+enum class Tonemapper { Clamp, Reinhard, Aces };
+
+// How the trace stores accumulated radiance per pixel. Same values as
+// ACCUMULATION_* in trace.glsl.
+// - Rgb32f: 12 bytes, an exact float sum. The reference the others are
+//   compared against.
+// - Rgb16f: 8 bytes, the running mean as halves, renormalised every sample
+//   so it cannot overflow. Rounded stochastically, so it stays unbiased,
+//   but once a sample moves the mean by less than a half's step the
+//   rounding noise sets a floor the image stops converging at.
+// - Rgb9e5: 4 bytes, the running mean with a 9-bit mantissa per channel
+//   and one shared exponent. Half the bandwidth again, with a coarser floor
+//   set by the mantissa step of the brightest channel.
+enum class AccumulationFormat { Rgb32f, Rgb16f, Rgb9e5 };
+
+// How the trace is scheduled on the GPU, picked in the UI. Both give the
+// same image, samples for samples.
+// - Megakernel: shader.comp, one invocation per pixel follows its path to
+//   the end. Lanes whose path ended early idle until the longest path of
+//   their workgroup is done.
+// - Wavefront: wavefront.comp, one dispatch per bounce over the paths still
+//   alive, compacted between bounces so every launched lane has work. Pays
+//   for it with path state round tripping through memory.
+enum class Integrator { Megakernel, Wavefront };
+
+// Bounces every path takes before Russian roulette may end it, by a chance
+// that follows its throughput. Picked in the UI, the GPU and CPU tracers
+// both use it. Expected radiance is the same at any depth, lower ones trade
+// shorter paths for more noise per sample.
+constexpr int DEFAULT_ROULETTE_DEPTH = 3;
+
+// Compiled pipelines kept between launches, in the working directory
+constexpr const char* pipelineCachePath = "pipeline_cache.bin";
+
+// Frame slots that per frame resources are created for. How many frames
+// are actually in flight is picked at runtime, up to this.
+constexpr int MAX_FRAMES_IN_FLIGHT = 3;
+constexpr int DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+// Trace on a compute only queue family when the GPU has one, so a frame's
+// tracing overlaps the previous frame's UI pass and present. Off, or
+// without such a family, everything goes through the graphics queue.
+constexpr bool useAsyncCompute = true;
+
 // Other shared constants
-constexpr int MAX_FRAMES_IN_FLIGHT = 2;
 static bool show_demo_window = false;
 
 // Validation layers
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <glm.hpp>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "scene.hpp"
+#include "sphere_kernels.hpp"
+#include "tile_scheduler.hpp"
+
+// CPU implementation of res/shaders/shader.comp. Traces the same paths with
+// the same random sequence and accumulation rules, so its output converges
+// to the GPU image. Used as a fallback on machines without a usable GPU and
+// as a performance baseline.
+class CpuRenderer {
+   public:
+    CpuRenderer(uint32_t width, uint32_t height, Scene& scene,
+                TileScheduler& scheduler = TileScheduler::global());
+    ~CpuRenderer();
+
+    CpuRenderer(const CpuRenderer&) = delete;
+    CpuRenderer& operator=(const CpuRenderer&) = delete;
+
+    // Traces one accumulation frame for the current scene camera
+    void render();
+    void resize(uint32_t width, uint32_t height);
+
+    uint32_t width() const { return m_width; }
+    uint32_t height() const { return m_height; }
+    unsigned threadCount() const { return m_scheduler.threadCount(); }
+    const TileScheduler& scheduler() const { return m_scheduler; }
+    SimdLevel simdLevel() const { return m_simdLevel; }
+    // Primary rays are traced as 8x8 packets unless disabled, the image is
+    // the same either way
+    void setPacketTracing(bool enabled) { m_packetTracing = enabled; }
+    bool packetTracing() const { return m_packetTracing; }
+    // Bounces every path takes before Russian roulette may end it, as
+    // SceneSettings::rouletteDepth on the GPU
+    void setRouletteDepth(uint32_t depth) {
+        m_rouletteDepth = std::max(depth, 1u);
+    }
+    // Bounces per path in the last frame
+    double averagePathLength() const;
+    // Final color of the last frame, row-major from the top-left pixel
+    const std::vector<glm::vec4>& pixels() const { return m_color; }
+    std::vector<uint8_t> readPixels() const;
+    void save(const std::string& path) const;
+
+   private:
+    struct Ray {
+        glm::vec3 origin;
+        glm::vec3 direction;
+    };
+
+    struct RayHit {
+        glm::vec3 position;
+        glm::vec3 normal;
+        float distance;
+        int sphereIndex;
+    };
+
+    void renderTile(const Tile& tile, const UniformBufferObject& camera);
+    void tracePrimaryPacket(const Tile& block,
+                            const UniformBufferObject& camera,
+                            std::vector<RayHit>& hits) const;
+    Ray primaryRay(uint32_t x, uint32_t y,
+                   const UniformBufferObject& camera) const;
+    // Follows the path of a primary ray from its first hit, adding the
+    // bounces it took to bounces
+    glm::vec3 tracePath(uint32_t x, uint32_t y,
+                        const UniformBufferObject& camera, Ray ray, RayHit hit,
+                        uint64_t& bounces) const;
+    RayHit trace(const Ray& ray) const;
+    RayHit resolveHit(const Ray& ray, const SphereHit& hit) const;
+
+   private:
+    Scene& m_scene;
+    TileScheduler& m_scheduler;
+    uint32_t m_width;
+    uint32_t m_height;
+
+    // rebuilt from the scene every frame, it is tiny next to the tracing
+    SphereSoA m_sphereSoA;
+    SimdLevel m_simdLevel;
+    IntersectSpheresFn m_intersectSpheres;
+    // the scene hierarchy matches m_sphereSoA and is worth traversing
+    bool m_useBvh = false;
+    bool m_packetTracing = true;
+    uint32_t m_rouletteDepth = config::DEFAULT_ROULETTE_DEPTH;
+    // summed once per tile
+    std::atomic<uint64_t> m_bounces{0};
+
+    std::vector<glm::vec4> m_accumulation;
+    std::vector<glm::vec4> m_color;
+};
@@ -1,14 +1,19 @@
 #pragma once
 #include <vulkan/vulkan.h>
 
+#include <memory>
 #include <optional>
 #include <vector>
 
+#include "memory_allocator.hpp"
+
 struct QueueFamilyIndices;
 struct SwapChainSupportDetails;
 
 class Device {
    public:
+    // A null surface selects a headless device: no swap chain extension and
+    // no present support is required, so software ICDs such as lavapipe work
     Device(const VkInstance& instance, const VkSurfaceKHR& surface);
     ~Device();
 
@@ -22,6 +27,13 @@ class Device {
     VkQueue graphicsQueue() const { return m_graphicsQueue; }
     VkQueue computeQueue() const { return m_computeQueue; }
     VkQueue presentQueue() const { return m_presentQueue; }
+    // Tracing is submitted to its own queue, see config::useAsyncCompute
+    bool asyncCompute() const { return m_computeQueue != m_graphicsQueue; }
+    bool headless() const { return m_surface == VK_NULL_HANDLE; }
+    MemoryAllocator& allocator() { return *m_allocator; }
+    const VkPhysicalDeviceFeatures& enabledFeatures() const {
+        return m_enabledFeatures;
+    }
 
     QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
     SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
@@ -30,17 +42,24 @@ class Device {
     void pickPhysicalDevice();
     void createLogicalDevice();
     bool isDeviceSuitable(VkPhysicalDevice device);
+    // Vulkan 1.2 with timeline semaphores, which the engine paces frames by
+    bool supportsTimelineSemaphores(VkPhysicalDevice device);
     bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+    const std::vector<const char*>& enabledExtensions() const;
 
    private:
     VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
     VkDevice m_device;
+    VkPhysicalDeviceFeatures m_enabledFeatures{};
 
     // Queue handles (these are tied to the logical device)
     VkQueue m_graphicsQueue;
     VkQueue m_computeQueue;
     VkQueue m_presentQueue;
 
+    // Freed before the device is destroyed
+    std::unique_ptr<MemoryAllocator> m_allocator;
+
     VkInstance m_instance;
     VkSurfaceKHR m_surface;
 };
\ No newline at end of file
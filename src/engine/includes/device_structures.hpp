@@ -7,11 +7,17 @@
 struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsAndComputeFamily;
     std::optional<uint32_t> presentFamily;
+    // compute without graphics, only looked for when presenting
+    std::optional<uint32_t> asyncComputeFamily;
 
     bool isComplete() {
         return graphicsAndComputeFamily.has_value() &&
                presentFamily.has_value();
     }
+    // Family the frame is traced on
+    uint32_t computeFamily() const {
+        return asyncComputeFamily.value_or(graphicsAndComputeFamily.value());
+    }
 };
 
 struct SwapChainSupportDetails {
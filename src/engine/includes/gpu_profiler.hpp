@@ -0,0 +1,146 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "device.hpp"
+#include "memory_allocator.hpp"
+
+// GPU work timed per frame, each by a pair of timestamps
+enum class GpuStage { Upload, Trace, Resolve, Interface, Count };
+
+// Everything the profiler keeps a history of
+enum class ProfilerMetric {
+    UploadMs,
+    TraceMs,
+    ResolveMs,
+    InterfaceMs,
+    // First timestamp of the frame to the last one on the queue that traces.
+    // Timestamps of different queues are not comparable, so a UI pass on a
+    // graphics queue of its own is left out.
+    GpuFrameMs,
+    // time between two frames on the CPU, what the frame rate comes from
+    FrameMs,
+    // camera rays traced per second of trace stage
+    Mrays,
+    // the same samples per second of wall time, at the frame rate
+    Msamples,
+    // CPU blocked on the frame timeline and the swap chain before a frame
+    CpuWaitMs,
+    // the same queue without work between the end of a frame and the next
+    // one's start
+    GpuIdleMs,
+    // frames submitted and not finished when a frame starts recording
+    FramesQueued,
+    // percentage of the trace's lanes that worked on a path bounce, per 64
+    // lane workgroup
+    LaneOccupancy,
+    // bounces per path traced, from the same counters
+    PathLength,
+    Count
+};
+
+// Same layout as the occupancy block of trace.glsl. The shaders add lane
+// counts with a carry into the high words, a frame at 4K can pass 2^32.
+struct OccupancyCounters {
+    uint32_t activeLow;
+    uint32_t activeHigh;
+    uint32_t launchedLow;
+    uint32_t launchedHigh;
+};
+
+const char* profilerMetricName(ProfilerMetric metric);
+
+// Last kLength values of a metric in a ring, as ImGui::PlotLines takes them
+struct ProfilerSeries {
+    static constexpr int kLength = 120;
+
+    std::vector<float> values = std::vector<float>(kLength, 0.0f);
+    // oldest value, and the next one written
+    int offset = 0;
+    int count = 0;
+
+    void push(float value);
+    float latest() const;
+    float average() const;
+};
+
+// Timestamp queries written by the command buffers of each frame slot and
+// read back once the slot's frame has finished, so nothing stalls.
+// Query indices only depend on the slot and stage, which keeps cached
+// recordings valid. Where the device supports pipeline statistics the trace
+// stage also counts compute shader invocations. Every call is a no-op on
+// queues without timestamps, except for the lane occupancy counters, which
+// are a host visible buffer per slot the trace writes itself.
+class GpuProfiler {
+   public:
+    explicit GpuProfiler(Device& device);
+    ~GpuProfiler();
+
+    GpuProfiler(const GpuProfiler&) = delete;
+    GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+    bool enabled() const { return m_timestampPool != VK_NULL_HANDLE; }
+    bool statisticsEnabled() const {
+        return m_statisticsPool != VK_NULL_HANDLE;
+    }
+
+    // Recorded at the start and end of a stage, outside any render pass
+    void beginStage(VkCommandBuffer commandBuffer, uint32_t slot,
+                    GpuStage stage);
+    void endStage(VkCommandBuffer commandBuffer, uint32_t slot,
+                  GpuStage stage);
+
+    // Lane occupancy counters of slot, bound to the trace's descriptor set
+    VkBuffer occupancyBuffer(uint32_t slot) const {
+        return m_occupancyBuffers[slot];
+    }
+    // Zeroes slot's counters, recorded before the trace adds to them
+    void resetOccupancy(VkCommandBuffer commandBuffer, uint32_t slot);
+
+    // Reads the frame last submitted from slot, once it has finished
+    void collect(uint32_t slot);
+    // Starts the next frame of slot, tracing samples camera rays
+    void beginFrame(uint32_t slot, uint64_t samples);
+    // The stage was part of the frame's submissions
+    void submitted(uint32_t slot, GpuStage stage);
+    // How long the frame about to start waited, and how far ahead the CPU is
+    void recordPacing(double cpuWaitMs, uint64_t framesQueued);
+
+    const ProfilerSeries& series(ProfilerMetric metric) const {
+        return m_series[static_cast<size_t>(metric)];
+    }
+    uint64_t shaderInvocations() const { return m_shaderInvocations; }
+
+   private:
+    using Clock = std::chrono::high_resolution_clock;
+
+    struct FrameSlot {
+        // bit per GpuStage
+        uint32_t stages = 0;
+        uint64_t samples = 0;
+    };
+
+    uint32_t timestampQuery(uint32_t slot, GpuStage stage) const;
+    void collectOccupancy(uint32_t slot);
+
+   private:
+    Device& m_device;
+    VkQueryPool m_timestampPool = VK_NULL_HANDLE;
+    VkQueryPool m_statisticsPool = VK_NULL_HANDLE;
+    // nanoseconds per tick, and the bits a timestamp actually has
+    double m_timestampPeriod = 1.0;
+    uint64_t m_timestampMask = ~0ull;
+    std::vector<VkBuffer> m_occupancyBuffers;
+    std::vector<Allocation> m_occupancyBuffersMemory;
+
+    std::vector<FrameSlot> m_slots;
+    Clock::time_point m_lastFrame;
+    // last timestamp of the previous frame collected, 0 before the first
+    uint64_t m_previousFrameEnd = 0;
+    bool m_started = false;
+    uint64_t m_shaderInvocations = 0;
+    ProfilerSeries m_series[static_cast<size_t>(ProfilerMetric::Count)];
+};
@@ -3,9 +3,12 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include "../includes/config.hpp"
 #include "../includes/device.hpp"
 #include "../includes/device_structures.hpp"
+#include "../includes/gpu_profiler.hpp"
 #include "../includes/instance.hpp"
+#include "../includes/resolve_pass.hpp"
 #include "../includes/swap_chain.hpp"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
@@ -14,20 +17,47 @@
 class GraphicsPipeline {
    public:
     GraphicsPipeline(Device& device, SwapChain& swapChain, Instance& instance,
-                     GLFWwindow* window, Scene& scene);
+                     GLFWwindow* window, Scene& scene, GpuProfiler& profiler,
+                     ResolvePass& resolvePass);
     ~GraphicsPipeline();
 
     void render(uint32_t imageIndex, uint32_t currentFrame);
     VkCommandBuffer* getCurrentCommandBuffer(uint32_t currentFrame) {
         return &m_commandBuffers[currentFrame];
     }
+    config::QualityPreset qualityPreset() const { return m_qualityPreset; }
+    config::AccumulationFormat accumulationFormat() const {
+        return m_accumulationFormat;
+    }
+    config::Integrator integrator() const { return m_integrator; }
+    const TonemapSettings& tonemapSettings() const { return m_tonemap; }
+    uint32_t traceInterval() const {
+        return static_cast<uint32_t>(m_traceInterval);
+    }
+    uint32_t samplesPerPixel() const {
+        return static_cast<uint32_t>(m_samplesPerPixel);
+    }
+    uint32_t dispatchesPerFrame() const {
+        return static_cast<uint32_t>(m_dispatchesPerFrame);
+    }
+    uint32_t rouletteDepth() const {
+        return static_cast<uint32_t>(m_rouletteDepth);
+    }
+    float noiseThreshold() const { return m_noiseThreshold; }
+    // Picked with a slider, the engine applies it before the next frame
+    uint32_t framesInFlight() const {
+        return static_cast<uint32_t>(m_framesInFlight);
+    }
+    // The engine has drained the queue and renumbered the frame slots
+    void setFramesInFlight(uint32_t count);
 
    private:
     void initImGui();
     void createCommandPool();
     void createCommandBuffers();
     void recordCommandBuffer(VkCommandBuffer commandBuffer,
-                             uint32_t imageIndex);
+                             uint32_t imageIndex, uint32_t currentFrame);
+    void showProfiler();
 
    private:
     Device& m_device;
@@ -36,7 +66,22 @@ class GraphicsPipeline {
     GLFWwindow* m_window;
 
     Scene& m_scene;
+    GpuProfiler& m_profiler;
+    // copies the frame into the swap chain image here with async compute
+    ResolvePass& m_resolvePass;
+    config::QualityPreset m_qualityPreset = config::QualityPreset::Full;
+    config::AccumulationFormat m_accumulationFormat =
+        config::AccumulationFormat::Rgb32f;
+    config::Integrator m_integrator = config::Integrator::Megakernel;
+    TonemapSettings m_tonemap;
+    int m_traceInterval = 1;
+    int m_samplesPerPixel = 1;
+    int m_dispatchesPerFrame = 1;
+    int m_rouletteDepth = config::DEFAULT_ROULETTE_DEPTH;
+    float m_noiseThreshold = 0.0f;
+    int m_framesInFlight = config::DEFAULT_FRAMES_IN_FLIGHT;
     VkDescriptorPool m_descriptorPool;
     VkCommandPool m_commandPool;
+    // UI pass of each frame slot, recorded again every frame
     std::vector<VkCommandBuffer> m_commandBuffers;
 };
\ No newline at end of file
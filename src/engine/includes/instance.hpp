@@ -41,6 +41,7 @@ debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 
 class Instance {
    public:
+    // A null window creates a headless instance without surface extensions
     Instance(GLFWwindow* window);
     ~Instance();
     void populateDebugMessengerCreateInfo(
@@ -60,6 +61,6 @@ class Instance {
     GLFWwindow* m_window;
 
     VkInstance m_instance;
-    VkDebugUtilsMessengerEXT m_debugMessenger;
-    VkSurfaceKHR m_surface;
+    VkDebugUtilsMessengerEXT m_debugMessenger = VK_NULL_HANDLE;
+    VkSurfaceKHR m_surface = VK_NULL_HANDLE;
 };
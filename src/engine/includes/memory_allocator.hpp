@@ -0,0 +1,117 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// What an allocation is for, so the statistics can be split per subsystem
+enum class MemoryCategory {
+    SceneBuffers,
+    Staging,
+    Uniforms,
+    Images,
+    // storage buffers the trace works in: accumulation, wavefront queues and
+    // adaptive sampling's variance and tile lists
+    TraceBuffers,
+    Readback,
+    Count
+};
+
+struct MemoryBlock;
+
+// Range of a VkDeviceMemory block. Resources are bound at offset, and
+// mapped points at offset when the memory is host visible.
+struct Allocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr;
+    MemoryCategory category = MemoryCategory::SceneBuffers;
+    MemoryBlock* block = nullptr;
+};
+
+struct MemoryStats {
+    static constexpr size_t kCategoryCount =
+        static_cast<size_t>(MemoryCategory::Count);
+
+    // vkAllocateMemory calls made since startup, and what is still held
+    uint32_t deviceAllocations = 0;
+    uint32_t blockCount = 0;
+    uint32_t dedicatedCount = 0;
+    VkDeviceSize reservedBytes = 0;
+    VkDeviceSize usedBytes[kCategoryCount] = {};
+    uint32_t allocationCount[kCategoryCount] = {};
+    // Free space inside the shared blocks. The largest range against the
+    // total is what a compaction pass would go by.
+    VkDeviceSize freeBytes = 0;
+    VkDeviceSize largestFreeRange = 0;
+};
+
+// Live range of a shared block. A compaction pass moves it by copying the
+// resource into a new allocation and binding it there.
+struct MovableAllocation {
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    MemoryCategory category = MemoryCategory::SceneBuffers;
+};
+
+// A shared block with its free space split into more than one range
+struct FragmentedBlock {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    VkDeviceSize freeBytes = 0;
+    VkDeviceSize largestFreeRange = 0;
+    // sorted by offset
+    std::vector<MovableAllocation> allocations;
+};
+
+const char* memoryCategoryName(MemoryCategory category);
+
+// Sub-allocates buffers and images from large blocks, one pool of blocks per
+// memory type and per linear or optimal tiling, so buffers and images never
+// share a block and bufferImageGranularity never applies. Free ranges are
+// kept sorted by size for best fit and by offset for merging neighbours.
+// Host visible blocks are mapped once for their whole lifetime. Not thread
+// safe, resources are only created from the render thread.
+class MemoryAllocator {
+   public:
+    MemoryAllocator(VkDevice device, VkPhysicalDevice physicalDevice);
+    ~MemoryAllocator();
+
+    MemoryAllocator(const MemoryAllocator&) = delete;
+    MemoryAllocator& operator=(const MemoryAllocator&) = delete;
+
+    // Allocates memory for the resource and binds it
+    Allocation allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties,
+                              MemoryCategory category);
+    Allocation allocateImage(VkImage image, VkMemoryPropertyFlags properties,
+                             MemoryCategory category);
+    Allocation allocate(const VkMemoryRequirements& requirements,
+                        VkMemoryPropertyFlags properties,
+                        MemoryCategory category, bool linear);
+    // Resets allocation, the resource bound to it must be destroyed first
+    void free(Allocation& allocation);
+
+    uint32_t findMemoryType(uint32_t typeFilter,
+                            VkMemoryPropertyFlags properties) const;
+    MemoryStats stats() const;
+    // The blocks a compaction pass would start from, most free bytes
+    // first. Dedicated blocks hold a single resource and are never listed.
+    std::vector<FragmentedBlock> fragmentedBlocks() const;
+
+   private:
+    VkDeviceSize blockSize(uint32_t memoryType) const;
+    MemoryBlock* createBlock(uint32_t memoryType, VkDeviceSize size,
+                             bool linear, bool dedicated);
+    void destroyBlock(MemoryBlock* block);
+
+   private:
+    VkDevice m_device;
+    VkPhysicalDeviceMemoryProperties m_memoryProperties;
+    std::vector<std::unique_ptr<MemoryBlock>> m_blocks;
+
+    uint32_t m_deviceAllocations = 0;
+    VkDeviceSize m_usedBytes[MemoryStats::kCategoryCount] = {};
+    uint32_t m_allocationCount[MemoryStats::kCategoryCount] = {};
+};
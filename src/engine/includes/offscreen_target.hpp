@@ -0,0 +1,42 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <string>
+#include <vector>
+
+#include "device.hpp"
+#include "render_target.hpp"
+
+// Single RGBA8 image used instead of a swap chain when the engine runs
+// without a window. Holds the tonemapped, sRGB encoded frame.
+class OffscreenTarget : public RenderTarget {
+   public:
+    OffscreenTarget(Device& device, uint32_t width, uint32_t height);
+    ~OffscreenTarget();
+
+    OffscreenTarget(const OffscreenTarget&) = delete;
+    OffscreenTarget& operator=(const OffscreenTarget&) = delete;
+
+    const std::vector<VkImage>& images() const override { return m_images; }
+    const std::vector<VkImageView>& imageViews() const override {
+        return m_imageViews;
+    }
+    const VkExtent2D& extent() const override { return m_extent; }
+    VkFormat imageFormat() const override { return VK_FORMAT_R8G8B8A8_UNORM; }
+    uint32_t imageCount() const override { return 1; }
+
+    std::vector<uint8_t> readPixels();
+    void save(const std::string& path);
+
+   private:
+    void createImage();
+    void createCommandPool();
+
+   private:
+    Device& m_device;
+    VkExtent2D m_extent;
+    std::vector<VkImage> m_images;
+    std::vector<VkImageView> m_imageViews;
+    Allocation m_imageMemory;
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include "device.hpp"
+
+// What the cache saved on the last startup, for the startup timings
+struct PipelineCacheStats {
+    // bytes handed to the driver, 0 on a cold start
+    size_t loadedBytes = 0;
+    // a file was found but written by another device or driver version
+    bool rejected = false;
+    double loadMs = 0.0;
+    uint32_t pipelinesCreated = 0;
+    double createMs = 0.0;
+};
+
+// VkPipelineCache kept in a file between launches. The file starts with the
+// vendor, device ID, driver version and pipeline cache UUID it was written
+// with; data from any other device or driver is dropped instead of being
+// passed to the driver. Writes go to a temporary file renamed over the old
+// one, so a crash never leaves a truncated cache behind.
+class PipelineCache {
+   public:
+    PipelineCache(Device& device, std::string path);
+    // Saves the pipelines created since the last save
+    ~PipelineCache();
+
+    PipelineCache(const PipelineCache&) = delete;
+    PipelineCache& operator=(const PipelineCache&) = delete;
+
+    VkPipelineCache handle() const { return m_cache; }
+    const PipelineCacheStats& stats() const { return m_stats; }
+
+    // Creates the pipeline through the cache, saved by the next
+    // saveIfChanged()
+    VkPipeline createComputePipeline(const VkComputePipelineCreateInfo& info);
+    void save();
+    // Saves in the background if pipelines were created since the last save.
+    // Called once per frame, so a batch of new pipelines is written once.
+    void saveIfChanged();
+
+   private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+    };
+
+    std::vector<char> load();
+    FileHeader deviceHeader() const;
+    // Header and cache data as written to the file
+    std::vector<char> serialise();
+    void waitForSave();
+
+   private:
+    Device& m_device;
+    std::string m_path;
+    VkPipelineCache m_cache = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties m_properties;
+    PipelineCacheStats m_stats;
+
+    // pipelines were created since the data was last serialised
+    bool m_dirty = false;
+    std::future<void> m_pendingSave;
+};
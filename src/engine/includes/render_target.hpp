@@ -0,0 +1,16 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+// Images ResolvePass copies each frame into. Implemented by the swap chain for
+// windowed rendering and by OffscreenTarget for headless rendering.
+class RenderTarget {
+   public:
+    virtual ~RenderTarget() = default;
+    virtual const std::vector<VkImage>& images() const = 0;
+    virtual const std::vector<VkImageView>& imageViews() const = 0;
+    virtual const VkExtent2D& extent() const = 0;
+    virtual VkFormat imageFormat() const = 0;
+    virtual uint32_t imageCount() const = 0;
+};
@@ -0,0 +1,117 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+#include "config.hpp"
+#include "device.hpp"
+#include "gpu_profiler.hpp"
+#include "pipeline_cache.hpp"
+#include "render_target.hpp"
+
+// Exposure and curve of the display image, picked in the UI
+struct TonemapSettings {
+    float exposure = 1.0f;
+    config::Tonemapper tonemapper = config::Tonemapper::Aces;
+
+    bool operator==(const TonemapSettings& other) const {
+        return exposure == other.exposure && tonemapper == other.tonemapper;
+    }
+};
+
+// Same layout as the push_constant block of tonemap.comp
+struct ResolvePushConstants {
+    float exposure;
+    uint32_t tonemapper;
+    uint32_t swapRedBlue;
+};
+static_assert(sizeof(ResolvePushConstants) == 12,
+              "ResolvePushConstants must match the push_constant block");
+
+// Turns the HDR image a frame is traced into into the target's pixels.
+// tonemap.comp writes an 8-bit display image per frame slot, which is then
+// copied into the target image, or blitted when the target is not 8-bit
+// RGBA. The swap chain only needs transfer and attachment usage, and the
+// trace never touches it. With async compute the display image is released
+// to the graphics queue, and the copy is part of the UI pass.
+class ResolvePass {
+   public:
+    ResolvePass(Device& device, RenderTarget& target, GpuProfiler& profiler,
+                PipelineCache& pipelineCache);
+    ~ResolvePass();
+
+    ResolvePass(const ResolvePass&) = delete;
+    ResolvePass& operator=(const ResolvePass&) = delete;
+
+    // Written by the trace or a host frame upload, always in GENERAL
+    VkImage hdrImage() const { return m_hdrImage; }
+    VkImageView hdrImageView() const { return m_hdrImageView; }
+    // Recreates the images at the target's extent
+    void windowResized();
+    // Takes effect from the next commandBuffer()
+    void setTonemapSettings(const TonemapSettings& settings) {
+        m_settings = settings;
+    }
+    // Compute queue work resolving the HDR image into currentFrame's display
+    // image, and copying it into the target image without async compute.
+    // Submitted after everything that writes the HDR image.
+    VkCommandBuffer commandBuffer(uint32_t imageIndex, uint32_t currentFrame);
+    // Records the graphics queue's side with async compute: acquires the
+    // display image and copies it into the target image, which is left in
+    // COLOR_ATTACHMENT_OPTIMAL. The submission waits for the resolve at
+    // the transfer stage.
+    void recordGraphicsCopy(VkCommandBuffer commandBuffer,
+                            uint32_t imageIndex, uint32_t currentFrame);
+
+   private:
+    // Recorded per target image and frame slot (index image *
+    // MAX_FRAMES_IN_FLIGHT + slot), like the trace's dispatch
+    struct ResolveCommandBuffer {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkExtent2D extent = {0, 0};
+        TonemapSettings settings;
+        bool valid = false;
+    };
+
+    void createDescriptorSetLayout();
+    void createPipeline();
+    void createCommandPool();
+    void createImages();
+    void destroyImages();
+    void createDescriptorSets();
+    void writeDescriptorSets();
+    void createCommandBuffers();
+    void recordCommandBuffer(VkCommandBuffer commandBuffer,
+                             uint32_t imageIndex, uint32_t currentFrame);
+    // Copies the display image, in TRANSFER_SRC_OPTIMAL, into the target
+    // image and moves that to the UI pass's layout
+    void recordTargetCopy(VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                          uint32_t currentFrame);
+    ResolvePushConstants pushConstants() const;
+
+   private:
+    Device& m_device;
+    RenderTarget& m_target;
+    GpuProfiler& m_profiler;
+    PipelineCache& m_pipelineCache;
+    TonemapSettings m_settings;
+
+    VkDescriptorSetLayout m_descriptorSetLayout;
+    VkPipelineLayout m_pipelineLayout;
+    VkPipeline m_pipeline;
+    VkDescriptorPool m_descriptorPool;
+    // per frame slot, only the display image differs
+    std::vector<VkDescriptorSet> m_descriptorSets;
+
+    VkImage m_hdrImage = VK_NULL_HANDLE;
+    Allocation m_hdrImageMemory;
+    VkImageView m_hdrImageView = VK_NULL_HANDLE;
+    // Per frame slot, so with async compute a frame resolves while the
+    // previous one is still copied from on the graphics queue
+    std::vector<VkImage> m_displayImages;
+    std::vector<Allocation> m_displayImagesMemory;
+    std::vector<VkImageView> m_displayImageViews;
+
+    VkCommandPool m_commandPool;
+    std::vector<ResolveCommandBuffer> m_commandBuffers;
+};
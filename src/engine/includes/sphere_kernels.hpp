@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <glm.hpp>
+#include <vector>
+
+#include "aligned_allocator.hpp"
+#include "bvh.hpp"
+#include "scene.hpp"
+#include "wide_bvh.hpp"
+
+using AlignedFloats = std::vector<float, AlignedAllocator<float>>;
+
+// Structure-of-arrays copy of the traced spheres. The std430 Sphere layout
+// suits the GPU but scatters one component per 32 bytes; here each component
+// is contiguous so 8 or 16 spheres load with one instruction. Lanes are
+// padded to a multiple of kLaneMultiple with NaN spheres that never hit.
+class SphereSoA {
+   public:
+    static constexpr size_t kLaneMultiple = 16;
+
+    void build(const std::vector<Sphere>& spheres, size_t count);
+
+    size_t size() const { return m_size; }
+    size_t paddedSize() const { return m_cx.size(); }
+    const float* cx() const { return m_cx.data(); }
+    const float* cy() const { return m_cy.data(); }
+    const float* cz() const { return m_cz.data(); }
+    const float* radiusSquared() const { return m_r2.data(); }
+
+   private:
+    size_t m_size = 0;
+    AlignedFloats m_cx;
+    AlignedFloats m_cy;
+    AlignedFloats m_cz;
+    AlignedFloats m_r2;
+};
+
+struct SphereHit {
+    float distance;
+    int index;  // -1 on a miss
+};
+
+// Closest hit of one ray against every sphere in the store, with the same
+// arithmetic as Trace() in trace.glsl: only the near root counts and it
+// must be in (0, tMax). Ties resolve to the lowest sphere index.
+using IntersectSpheresFn = SphereHit (*)(const SphereSoA& spheres,
+                                         const glm::vec3& origin,
+                                         const glm::vec3& direction,
+                                         float tMax);
+
+enum class SimdLevel { Scalar, Avx2, Avx512 };
+
+// Highest level supported by both the CPU and the OS. RT_SIMD=scalar|avx2
+// in the environment caps it, for comparisons.
+SimdLevel detectSimdLevel();
+const char* simdLevelName(SimdLevel level);
+IntersectSpheresFn selectIntersectKernel(SimdLevel level);
+
+SphereHit intersectSpheresScalar(const SphereSoA& spheres,
+                                 const glm::vec3& origin,
+                                 const glm::vec3& direction, float tMax);
+
+// Work done by traversals, summed over rays. bytesFetched counts the node,
+// primitive index and sphere data read, not what the caches filtered out.
+struct TraversalStats {
+    uint64_t rays = 0;
+    uint64_t nodeVisits = 0;
+    uint64_t sphereTests = 0;
+    uint64_t bytesFetched = 0;
+};
+
+// Same result as the linear kernels in O(log n), through a bvh built over
+// the spheres of the store
+SphereHit intersectBvh(const Bvh& bvh, const SphereSoA& spheres,
+                       const glm::vec3& origin, const glm::vec3& direction,
+                       float tMax, TraversalStats* stats = nullptr);
+
+// Same result again through a collapsed tree, testing every child box of a
+// node at once with the kernel for level. Implemented for Width 4 and 8.
+template <uint32_t Width>
+SphereHit intersectWideBvh(const WideBvh<Width>& bvh, const SphereSoA& spheres,
+                           const glm::vec3& origin, const glm::vec3& direction,
+                           float tMax, SimdLevel level,
+                           TraversalStats* stats = nullptr);
+
+// Up to kMaxRays normalised rays from one origin laid out as a width x height
+// grid in row-major order, such as the primary rays of an 8x8 tile. Every ray
+// must lie inside the cone spanned by the four corner rays.
+struct RayPacket {
+    static constexpr uint32_t kMaxRays = 64;
+
+    glm::vec3 origin;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    alignas(64) float dx[kMaxRays];
+    alignas(64) float dy[kMaxRays];
+    alignas(64) float dz[kMaxRays];
+    // closest hit of each ray, written by intersectPacket
+    alignas(64) float distance[kMaxRays];
+    alignas(64) int32_t index[kMaxRays];
+
+    uint32_t size() const { return width * height; }
+};
+
+// Closest hits for a coherent packet, identical to running an
+// IntersectSpheresFn on each ray. Spheres outside the packet frustum are
+// culled, through the hierarchy when a bvh over the same spheres is given,
+// and the rest are visited nearest first, so a ray retires as soon as no
+// remaining sphere can beat its hit and the survivors are compacted into
+// full SIMD lanes.
+void intersectPacket(const SphereSoA& spheres, RayPacket& packet, float tMax,
+                     SimdLevel level, const Bvh* bvh = nullptr);
@@ -1,23 +1,26 @@
 #pragma once
 
 #include "device.hpp"
+#include "render_target.hpp"
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
-class SwapChain {
+class SwapChain : public RenderTarget {
    public:
     SwapChain(Device& device, GLFWwindow* window, VkSurfaceKHR surface);
     ~SwapChain();
-    VkFormat imageFormat() const { return m_imageFormat; }
-    const std::vector<VkImageView>& imageViews() const { return m_imageViews; }
-    const std::vector<VkImage>& images() const { return m_images; }
-    const VkExtent2D& extent() const { return m_extent; }
+    VkFormat imageFormat() const override { return m_imageFormat; }
+    const std::vector<VkImageView>& imageViews() const override {
+        return m_imageViews;
+    }
+    const std::vector<VkImage>& images() const override { return m_images; }
+    const VkExtent2D& extent() const override { return m_extent; }
     const VkSwapchainKHR& getSwapChain() const { return m_swapChain; }
     const VkRenderPass& getRenderPass() const { return m_renderPass; }
     const std::vector<VkFramebuffer>& getFramebuffers() const {
         return m_framebuffers;
     }
 
-    uint32_t imageCount() const { return m_imageCount; }
+    uint32_t imageCount() const override { return m_imageCount; }
     void recreateSwapChain();
 
    private:
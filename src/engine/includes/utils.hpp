@@ -22,10 +22,13 @@ static std::vector<char> readFile(const std::string& filename) {
     return buffer;
 }
 
+// Creates the buffer and binds it to memory from the device's allocator
 void createBuffer(Device& device, VkDeviceSize size, VkBufferUsageFlags usage,
-                  VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                  VkDeviceMemory& bufferMemory);
+                  VkMemoryPropertyFlags properties, MemoryCategory category,
+                  VkBuffer& buffer, Allocation& allocation);
+void destroyBuffer(Device& device, VkBuffer& buffer, Allocation& allocation);
 VkShaderModule createShaderModule(VkDevice device,
                                   const std::vector<char>& code);
-uint32_t findMemoryType(Device& device, uint32_t typeFilter,
-                        VkMemoryPropertyFlags properties);
+// Writes tightly packed RGBA8 pixels as a binary PPM, dropping alpha
+void writeImagePPM(const std::string& path, uint32_t width, uint32_t height,
+                   const uint8_t* rgba);
@@ -0,0 +1,84 @@
+#pragma once
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <vector>
+
+#include "compute_variant.hpp"
+#include "device.hpp"
+#include "pipeline_cache.hpp"
+#include "scene.hpp"
+
+// Traces with wavefront.comp, config::Integrator::Wavefront. A pass starts a
+// path for every pixel of a batch, then runs an extend, shade, compact and
+// args kernel per bounce, the first three dispatched indirectly over just
+// the paths still alive. Owns the path state, descriptor set 1 and the
+// pipelines of each variant.
+class WavefrontIntegrator {
+   public:
+    // Paths in flight at once, larger images are traced in batches
+    static constexpr uint32_t kPathCapacity = 1u << 20;
+    // Lanes of every kernel's workgroup, a single row
+    static constexpr uint32_t kGroupSize = 64;
+
+    // sceneLayout is set 0, the one shader.comp uses
+    WavefrontIntegrator(Device& device, PipelineCache& pipelineCache,
+                        VkDescriptorSetLayout sceneLayout);
+    ~WavefrontIntegrator();
+
+    WavefrontIntegrator(const WavefrontIntegrator&) = delete;
+    WavefrontIntegrator& operator=(const WavefrontIntegrator&) = delete;
+
+    // Records passes samples per pixel, numbered like the megakernel's:
+    // pass i pushes pushConstants with dispatchIndex i, and only the first
+    // one keeps clearAccumulation. A pass starts at most paths paths, one
+    // per pixel, or per lane of the active tiles for adaptive variants. The
+    // workgroup size of variant is replaced with kGroupSize.
+    void record(VkCommandBuffer commandBuffer, const ComputeVariant& variant,
+                VkDescriptorSet sceneSet,
+                const FramePushConstants& pushConstants, uint32_t passes,
+                uint32_t paths);
+
+   private:
+    // Same values as STAGE_* in wavefront.comp
+    enum Stage : uint32_t { Generate, Extend, Shade, Compact, Args, kStages };
+    // Specialization data of a stage's pipeline
+    struct StageConstants {
+        ComputeVariant variant;
+        uint32_t stage;
+    };
+    struct CompiledVariant {
+        ComputeVariant variant;
+        std::array<VkPipeline, kStages> pipelines;
+    };
+
+    void createDescriptorSetLayout();
+    void createPipelineLayout(VkDescriptorSetLayout sceneLayout);
+    void createBuffers();
+    void createDescriptorSet();
+    // Compiled pipelines of variant's stages, compiling them the first time
+    const std::array<VkPipeline, kStages>& pipelines(
+        const ComputeVariant& variant);
+
+    Device& m_device;
+    PipelineCache& m_pipelineCache;
+    VkShaderModule m_shaderModule;
+    VkDescriptorSetLayout m_descriptorSetLayout;
+    VkPipelineLayout m_pipelineLayout;
+    VkDescriptorPool m_descriptorPool;
+    VkDescriptorSet m_descriptorSet;
+    std::vector<CompiledVariant> m_pipelines;
+
+    // Device local, read and written only by the kernels. Frames in flight
+    // share them like the accumulation buffer, ordered on the queue.
+    VkBuffer m_pathBuffer;
+    Allocation m_pathBufferMemory;
+    VkBuffer m_hitBuffer;
+    Allocation m_hitBufferMemory;
+    // two queues of kPathCapacity path indices
+    VkBuffer m_queueBuffer;
+    Allocation m_queueBufferMemory;
+    // queue lengths, then a VkDispatchIndirectCommand per queue
+    VkBuffer m_counterBuffer;
+    Allocation m_counterBufferMemory;
+};
@@ -1,6 +1,8 @@
 #include "../includes/compute_pipeline.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
 #include <iostream>
 
 #include "../includes/config.hpp"
@@ -8,41 +10,121 @@
 #include "../includes/scene.hpp"
 #include "../includes/utils.hpp"
 
-ComputePipeline::ComputePipeline(Device& device, SwapChain& swapChain,
-                                 Scene& scene)
-    : m_device(device), m_swapChain(swapChain), m_scene(scene) {
+namespace {
+// Writes the elements of source in ranges to the staging memory at offset
+// and adds a copy of each into a buffer holding up to capacity bytes
+template <typename T>
+void stageRanges(void* staging, VkDeviceSize& offset, VkDeviceSize capacity,
+                 const T* source, size_t count, DirtyRanges& ranges,
+                 std::vector<VkBufferCopy>& copies) {
+    size_t limit = std::min<size_t>(count, capacity / sizeof(T));
+    auto stage = [&](size_t begin, size_t end) {
+        end = std::min(end, limit);
+        if (begin >= end) return;
+        VkDeviceSize size = (end - begin) * sizeof(T);
+        memcpy(static_cast<char*>(staging) + offset, source + begin, size);
+        copies.push_back({offset, begin * sizeof(T), size});
+        offset += size;
+    };
+    if (ranges.all()) {
+        stage(0, limit);
+        return;
+    }
+    for (const DirtyRanges::Range& range : ranges.ranges()) {
+        stage(range.first, range.second);
+    }
+}
+
+bool samePushConstants(const FramePushConstants& a,
+                       const FramePushConstants& b) {
+    return a.cameraForward == b.cameraForward &&
+           a.cameraRight == b.cameraRight && a.cameraUp == b.cameraUp &&
+           a.cameraPosition == b.cameraPosition &&
+           a.clearAccumulation == b.clearAccumulation;
+}
+
+// Size of a pixel in the accumulation buffer, see config::AccumulationFormat
+VkDeviceSize accumulationBytesPerPixel(config::AccumulationFormat format) {
+    switch (format) {
+        case config::AccumulationFormat::Rgb32f:
+            return 12;
+        case config::AccumulationFormat::Rgb16f:
+            return 8;
+        case config::AccumulationFormat::Rgb9e5:
+            return 4;
+    }
+    return 12;
+}
+
+// Full is the shader as written, the others drop bounces and rough
+// reflections to keep the preview interactive
+ComputeVariant presetVariant(config::QualityPreset preset) {
+    ComputeVariant variant;
+    switch (preset) {
+        case config::QualityPreset::Preview:
+            variant.maxDepth = 3;
+            variant.roughness = VK_FALSE;
+            break;
+        case config::QualityPreset::Interactive:
+            variant.maxDepth = 8;
+            break;
+        case config::QualityPreset::Full:
+            break;
+    }
+    return variant;
+}
+}  // namespace
+
+ComputePipeline::ComputePipeline(Device& device, RenderTarget& target,
+                                 Scene& scene, GpuProfiler& profiler)
+    : m_device(device),
+      m_target(target),
+      m_profiler(profiler),
+      m_pipelineCache(device, config::pipelineCachePath),
+      m_resolvePass(device, target, profiler, m_pipelineCache),
+      m_scene(scene) {
     createDescriptorSetLayout();
     createPipeline();
     createCommandPool();
-    createAccumulationImage();
+    createAccumulationBuffer();
+    createAdaptiveBuffers();
     createUniformBuffers();
     createDescriptorPool();
     createDescriptorSets();
     createCommandBuffers();
+    createDispatchCommandBuffers();
+    // the default variant is compiled now, as part of startup
+    selectVariant();
 }
 
 ComputePipeline::~ComputePipeline() {
+    m_wavefront.reset();
     vkDestroyDescriptorSetLayout(m_device.device(), m_descriptorSetLayout,
                                  nullptr);
-    // Cleanup accumulation resources
-    if (m_accumulationImageView != VK_NULL_HANDLE) {
-        vkDestroyImageView(m_device.device(), m_accumulationImageView, nullptr);
-    }
-    if (m_accumulationImage != VK_NULL_HANDLE) {
-        vkDestroyImage(m_device.device(), m_accumulationImage, nullptr);
-    }
-    if (m_accumulationImageMemory != VK_NULL_HANDLE) {
-        vkFreeMemory(m_device.device(), m_accumulationImageMemory, nullptr);
-    }
+    destroyBuffer(m_device, m_accumulationBuffer, m_accumulationBufferMemory);
+    destroyAdaptiveBuffers();
     // Add cleanup for uniform and sphere buffers
     for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
-        vkDestroyBuffer(m_device.device(), m_uniformBuffers[i], nullptr);
-        vkFreeMemory(m_device.device(), m_uniformBuffersMemory[i], nullptr);
-        vkDestroyBuffer(m_device.device(), m_sphereBuffers[i], nullptr);
-        vkFreeMemory(m_device.device(), m_sphereBuffersMemory[i], nullptr);
+        destroyBuffer(m_device, m_uniformBuffers[i], m_uniformBuffersMemory[i]);
+    }
+    destroyBuffer(m_device, m_sphereBuffer, m_sphereBufferMemory);
+    destroyBuffer(m_device, m_bvhNodeBuffer, m_bvhNodeBufferMemory);
+    destroyBuffer(m_device, m_bvhIndexBuffer, m_bvhIndexBufferMemory);
+    destroyBuffer(m_device, m_stagingBuffer, m_stagingBufferMemory);
+
+    for (uint32_t i = 0; i < m_hostImageBuffers.size(); i++) {
+        destroyHostImageBuffer(i);
     }
 
-    vkDestroyPipeline(m_device.device(), m_pipeline, nullptr);
+    for (const CompiledVariant& compiled : m_pipelines) {
+        vkDestroyPipeline(m_device.device(), compiled.pipeline, nullptr);
+        if (compiled.classifyPipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(m_device.device(), compiled.classifyPipeline,
+                              nullptr);
+        }
+    }
+    vkDestroyShaderModule(m_device.device(), m_shaderModule, nullptr);
+    vkDestroyShaderModule(m_device.device(), m_tileShaderModule, nullptr);
     vkDestroyPipelineLayout(m_device.device(), m_pipelineLayout, nullptr);
     vkDestroyDescriptorPool(m_device.device(), m_descriptorPool, nullptr);
 
@@ -51,112 +133,123 @@ ComputePipeline::~ComputePipeline() {
 
 void ComputePipeline::windowResized() {
     vkDeviceWaitIdle(m_device.device());
-    if (m_accumulationImageView != VK_NULL_HANDLE) {
-        vkDestroyImageView(m_device.device(), m_accumulationImageView, nullptr);
-    }
-    if (m_accumulationImage != VK_NULL_HANDLE) {
-        vkDestroyImage(m_device.device(), m_accumulationImage, nullptr);
-    }
-    if (m_accumulationImageMemory != VK_NULL_HANDLE) {
-        vkFreeMemory(m_device.device(), m_accumulationImageMemory, nullptr);
-    }
-    createAccumulationImage();
+    destroyBuffer(m_device, m_accumulationBuffer, m_accumulationBufferMemory);
+    createAccumulationBuffer();
+    destroyAdaptiveBuffers();
+    createAdaptiveBuffers();
+    m_resolvePass.windowResized();
+    // The HDR view and the per pixel buffers are new, and the recorded
+    // dispatches cover the old extent
+    invalidateDescriptorSets();
     m_scene.resetFrameCount();
 }
 
-void ComputePipeline::createPipeline() {
-    // make shader
-    auto computeShaderCode = readFile("../res/shaders/comp.spv");
+void ComputePipeline::setAccumulationFormat(config::AccumulationFormat format) {
+    if (format == m_accumulationFormat) return;
+    vkDeviceWaitIdle(m_device.device());
+    m_accumulationFormat = format;
+    destroyBuffer(m_device, m_accumulationBuffer, m_accumulationBufferMemory);
+    createAccumulationBuffer();
+    // selectVariant() picks the pipeline reading the new format
+    invalidateDescriptorSets();
+    m_scene.resetFrameCount();
+}
 
-    VkShaderModule computeShaderModule =
-        createShaderModule(m_device.device(), computeShaderCode);
+void ComputePipeline::setNoiseThreshold(float threshold) {
+    threshold = std::max(threshold, 0.0f);
+    if (threshold == m_noiseThreshold) return;
+    // Tiles that converged under the old threshold are only traced again
+    // after a reset
+    m_scene.resetFrameCount();
+    bool resize = (threshold > 0.0f) != (m_noiseThreshold > 0.0f);
+    m_noiseThreshold = threshold;
+    if (!resize) return;
+    vkDeviceWaitIdle(m_device.device());
+    destroyAdaptiveBuffers();
+    createAdaptiveBuffers();
+    // selectVariant() picks the adaptive pipelines or the plain ones
+    invalidateDescriptorSets();
+}
 
-    VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
-    computeShaderStageInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    computeShaderStageInfo.module = computeShaderModule;
-    computeShaderStageInfo.pName = "main";
-    //
+void ComputePipeline::createPipeline() {
+    // The modules are kept to compile the variants from as they are used
+    auto computeShaderCode = readFile("../res/shaders/comp.spv");
+    m_shaderModule = createShaderModule(m_device.device(), computeShaderCode);
+    auto tileShaderCode = readFile("../res/shaders/tiles.spv");
+    m_tileShaderModule = createShaderModule(m_device.device(), tileShaderCode);
 
     // make pipeline layout
     VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = 1;
     pipelineLayoutInfo.pSetLayouts = &m_descriptorSetLayout;
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(FramePushConstants);
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
     if (vkCreatePipelineLayout(m_device.device(), &pipelineLayoutInfo, nullptr,
                                &m_pipelineLayout) != VK_SUCCESS) {
         throw std::runtime_error("failed to create compute pipeline layout!");
     }
-    //
+}
+
+const ComputePipeline::CompiledVariant& ComputePipeline::pipeline(
+    const ComputeVariant& variant) {
+    for (const CompiledVariant& compiled : m_pipelines) {
+        if (compiled.variant == variant) return compiled;
+    }
+
+    CompiledVariant compiled{variant, compilePipeline(m_shaderModule, variant),
+                             VK_NULL_HANDLE};
+    if (variant.adaptive) {
+        compiled.classifyPipeline =
+            compilePipeline(m_tileShaderModule, variant);
+    }
+    m_pipelines.push_back(compiled);
+    return m_pipelines.back();
+}
+
+VkPipeline ComputePipeline::compilePipeline(VkShaderModule shaderModule,
+                                            const ComputeVariant& variant) {
+    std::array<VkSpecializationMapEntry, ComputeVariant::kConstantCount>
+        entries = ComputeVariant::mapEntries();
+    VkSpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = static_cast<uint32_t>(entries.size());
+    specializationInfo.pMapEntries = entries.data();
+    specializationInfo.dataSize = sizeof(ComputeVariant);
+    specializationInfo.pData = &variant;
+
+    VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
+    computeShaderStageInfo.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    computeShaderStageInfo.module = shaderModule;
+    computeShaderStageInfo.pName = "main";
+    computeShaderStageInfo.pSpecializationInfo = &specializationInfo;
 
-    // make pipeline
     VkComputePipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipelineInfo.layout = m_pipelineLayout;
     pipelineInfo.stage = computeShaderStageInfo;
 
-    if (vkCreateComputePipelines(m_device.device(), VK_NULL_HANDLE, 1,
-                                 &pipelineInfo, nullptr,
-                                 &m_pipeline) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create compute pipeline!");
-    }
-
-    // make input assembly
-    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-    inputAssembly.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssembly.primitiveRestartEnable = VK_FALSE;
-
-    // make rasterizer
-    VkPipelineRasterizationStateCreateInfo rasterizer{};
-    rasterizer.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-
-    // make multisampling
-    VkPipelineMultisampleStateCreateInfo multisampling{};
-    multisampling.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    vkDestroyShaderModule(m_device.device(), computeShaderModule, nullptr);
-
-    // make color blending
-    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask =
-        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-        VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-    colorBlendAttachment.dstColorBlendFactor =
-        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-    colorBlendAttachment.srcAlphaBlendFactor =
-        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-
-    VkPipelineColorBlendStateCreateInfo colorBlending{};
-    colorBlending.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY;
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
-    colorBlending.blendConstants[0] = 0.0f;
-    colorBlending.blendConstants[1] = 0.0f;
-    colorBlending.blendConstants[2] = 0.0f;
-    colorBlending.blendConstants[3] = 0.0f;
+    return m_pipelineCache.createComputePipeline(pipelineInfo);
+}
+
+void ComputePipeline::selectVariant() {
+    m_variant = presetVariant(m_qualityPreset);
+    size_t sphereCount = m_scene.wideBvh().primitiveCount();
+    if (sphereCount <= ComputeVariant::kSmallSceneLimit) {
+        m_variant.smallSceneCount = static_cast<uint32_t>(sphereCount);
+    }
+    m_variant.accumulationFormat =
+        static_cast<uint32_t>(m_accumulationFormat);
+    m_variant.adaptive = m_noiseThreshold > 0.0f ? VK_TRUE : VK_FALSE;
+    const CompiledVariant& compiled = pipeline(m_variant);
+    m_pipeline = compiled.pipeline;
+    m_classifyPipeline = compiled.classifyPipeline;
 }
 
 void ComputePipeline::createCommandPool() {
@@ -166,8 +259,7 @@ void ComputePipeline::createCommandPool() {
     VkCommandPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    poolInfo.queueFamilyIndex =
-        queueFamilyIndices.graphicsAndComputeFamily.value();
+    poolInfo.queueFamilyIndex = queueFamilyIndices.computeFamily();
 
     if (vkCreateCommandPool(m_device.device(), &poolInfo, nullptr,
                             &m_commandPool) != VK_SUCCESS) {
@@ -175,97 +267,82 @@ void ComputePipeline::createCommandPool() {
     }
 }
 
-void ComputePipeline::createAccumulationImage() {
-    VkImageCreateInfo imageInfo{};
-    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.format =
-        VK_FORMAT_R32G32B32A32_SFLOAT;  // Use float for HDR accumulation
-    imageInfo.extent.width = m_swapChain.extent().width;
-    imageInfo.extent.height = m_swapChain.extent().height;
-    imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
-    imageInfo.arrayLayers = 1;
-    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageInfo.usage =
-        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-
-    if (vkCreateImage(m_device.device(), &imageInfo, nullptr,
-                      &m_accumulationImage) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create accumulation image!");
-    }
-
-    // Allocate memory for the image
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(m_device.device(), m_accumulationImage,
-                                 &memRequirements);
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex =
-        findMemoryType(m_device, memRequirements.memoryTypeBits,
-                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    if (vkAllocateMemory(m_device.device(), &allocInfo, nullptr,
-                         &m_accumulationImageMemory) != VK_SUCCESS) {
-        throw std::runtime_error(
-            "failed to allocate accumulation image memory!");
-    }
-
-    vkBindImageMemory(m_device.device(), m_accumulationImage,
-                      m_accumulationImageMemory, 0);
-
-    // Create image view
-    VkImageViewCreateInfo viewInfo{};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.image = m_accumulationImage;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = VK_FORMAT_R32G32B32A32_SFLOAT;
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
+void ComputePipeline::createAccumulationBuffer() {
+    // Never read before a clearing frame has written it, so it is left as
+    // allocated
+    VkExtent2D extent = m_target.extent();
+    m_accumulationBufferSize = static_cast<VkDeviceSize>(extent.width) *
+                               extent.height *
+                               accumulationBytesPerPixel(m_accumulationFormat);
+    createBuffer(m_device, m_accumulationBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_accumulationBuffer, m_accumulationBufferMemory);
+}
 
-    if (vkCreateImageView(m_device.device(), &viewInfo, nullptr,
-                          &m_accumulationImageView) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create accumulation image view!");
+void ComputePipeline::createAdaptiveBuffers() {
+    // Like the accumulation, never read before a clearing frame has written
+    // them. While off, the set layout still binds a buffer of each.
+    bool adaptive = m_noiseThreshold > 0.0f;
+    VkExtent2D extent = m_target.extent();
+    VkExtent2D grid = tileGrid();
+    VkDeviceSize pixels =
+        adaptive ? static_cast<VkDeviceSize>(extent.width) * extent.height : 1;
+    VkDeviceSize tiles =
+        adaptive ? static_cast<VkDeviceSize>(grid.width) * grid.height : 1;
+    // a mean, an m2 and a sample count per pixel, as PixelVariance
+    m_varianceBufferSize = 3 * sizeof(uint32_t) * pixels;
+    // the indirect dispatch padded to 16 bytes, then a word per tile
+    m_tileBufferSize = 4 * sizeof(uint32_t) + sizeof(uint32_t) * tiles;
+    createBuffer(m_device, m_varianceBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_varianceBuffer, m_varianceBufferMemory);
+    createBuffer(m_device, m_tileBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_activeTileBuffer, m_activeTileBufferMemory);
+    createBuffer(m_device, m_tileBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_nextTileBuffer, m_nextTileBufferMemory);
+
+    m_tileCountBuffers.resize(config::MAX_FRAMES_IN_FLIGHT);
+    m_tileCountBuffersMemory.resize(config::MAX_FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
+        createBuffer(m_device, sizeof(uint32_t),
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     MemoryCategory::Readback, m_tileCountBuffers[i],
+                     m_tileCountBuffersMemory[i]);
     }
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = m_accumulationImage;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-
-    VkPipelineStageFlags sourceStage;
-    VkPipelineStageFlags destinationStage;
-
-    if (VK_IMAGE_LAYOUT_UNDEFINED == VK_IMAGE_LAYOUT_UNDEFINED &&
-        VK_IMAGE_LAYOUT_GENERAL == VK_IMAGE_LAYOUT_GENERAL) {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask =
-            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    m_tileCountsPending.assign(config::MAX_FRAMES_IN_FLIGHT, false);
+    m_activeTiles = static_cast<uint32_t>(tiles);
+}
 
-        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destinationStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+void ComputePipeline::destroyAdaptiveBuffers() {
+    destroyBuffer(m_device, m_varianceBuffer, m_varianceBufferMemory);
+    destroyBuffer(m_device, m_activeTileBuffer, m_activeTileBufferMemory);
+    destroyBuffer(m_device, m_nextTileBuffer, m_nextTileBufferMemory);
+    for (size_t i = 0; i < m_tileCountBuffers.size(); i++) {
+        destroyBuffer(m_device, m_tileCountBuffers[i],
+                      m_tileCountBuffersMemory[i]);
     }
+}
 
-    vkCmdPipelineBarrier(commandBuffer, sourceStage, destinationStage, 0, 0,
-                         nullptr, 0, nullptr, 1, &barrier);
-
-    endSingleTimeCommands(commandBuffer);
+VkExtent2D ComputePipeline::tileGrid() const {
+    VkExtent2D extent = m_target.extent();
+    return {(extent.width + kTileSize - 1) / kTileSize,
+            (extent.height + kTileSize - 1) / kTileSize};
 }
 
 VkCommandBuffer ComputePipeline::beginSingleTimeCommands() {
@@ -295,35 +372,37 @@ void ComputePipeline::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &commandBuffer;
 
-    vkQueueSubmit(m_device.graphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(m_device.graphicsQueue());
+    vkQueueSubmit(m_device.computeQueue(), 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(m_device.computeQueue());
 
     vkFreeCommandBuffers(m_device.device(), m_commandPool, 1, &commandBuffer);
 }
 
 void ComputePipeline::createDescriptorPool() {
+    // One set per swap chain image and frame slot
+    m_descriptorImageCount = m_target.imageCount();
+    uint32_t setCount = static_cast<uint32_t>(m_descriptorImageCount *
+                                              config::MAX_FRAMES_IN_FLIGHT);
     std::array<VkDescriptorPoolSize, 3> poolSizes{};
 
-    // Storage Images (for both color and accumulation)
+    // Storage Image (HDR output)
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    poolSizes[0].descriptorCount = static_cast<uint32_t>(
-        config::MAX_FRAMES_IN_FLIGHT);  // Two storage images per frame
+    poolSizes[0].descriptorCount = setCount;
 
-    // Storage Buffer (for spheres)
+    // Storage Buffers (accumulation, spheres, BVH nodes, primitive indices,
+    // occupancy counters, variance and both tile lists)
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSizes[1].descriptorCount =
-        static_cast<uint32_t>(config::MAX_FRAMES_IN_FLIGHT);
+    poolSizes[1].descriptorCount = 8 * setCount;
 
     // Uniform Buffer (for scene data)
     poolSizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    poolSizes[2].descriptorCount =
-        static_cast<uint32_t>(config::MAX_FRAMES_IN_FLIGHT);
+    poolSizes[2].descriptorCount = setCount;
 
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
-    poolInfo.maxSets = static_cast<uint32_t>(config::MAX_FRAMES_IN_FLIGHT);
+    poolInfo.maxSets = setCount;
     poolInfo.flags = 0;
 
     if (vkCreateDescriptorPool(m_device.device(), &poolInfo, nullptr,
@@ -344,21 +423,51 @@ void ComputePipeline::createCommandBuffers() {
                                  m_commandBuffers.data()) != VK_SUCCESS) {
         throw std::runtime_error("failed to allocate compute command buffers!");
     }
+    m_submitCommandBuffers.resize(config::MAX_FRAMES_IN_FLIGHT);
+}
+
+void ComputePipeline::createDispatchCommandBuffers() {
+    if (!m_dispatchCommandBuffers.empty()) {
+        std::vector<VkCommandBuffer> previous;
+        for (const DispatchCommandBuffer& dispatch : m_dispatchCommandBuffers) {
+            previous.push_back(dispatch.commandBuffer);
+        }
+        vkFreeCommandBuffers(m_device.device(), m_commandPool,
+                             static_cast<uint32_t>(previous.size()),
+                             previous.data());
+    }
+
+    std::vector<VkCommandBuffer> commandBuffers(
+        static_cast<size_t>(m_target.imageCount()) *
+        config::MAX_FRAMES_IN_FLIGHT);
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = m_commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+    if (vkAllocateCommandBuffers(m_device.device(), &allocInfo,
+                                 commandBuffers.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate compute command buffers!");
+    }
+    m_dispatchCommandBuffers.assign(commandBuffers.size(), {});
+    for (size_t i = 0; i < commandBuffers.size(); i++) {
+        m_dispatchCommandBuffers[i].commandBuffer = commandBuffers[i];
+    }
 }
 
 void ComputePipeline::createDescriptorSetLayout() {
-    std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings{};
+    std::array<VkDescriptorSetLayoutBinding, 10> layoutBindings{};
 
-    // Binding 0: Output image (colorBuffer)
+    // Binding 0: HDR output image (outputImage)
     layoutBindings[0].binding = 0;
     layoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     layoutBindings[0].descriptorCount = 1;
     layoutBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     layoutBindings[0].pImmutableSamplers = nullptr;
 
-    // Binding 1: Accumulation image
+    // Binding 1: Accumulation buffer
     layoutBindings[1].binding = 1;
-    layoutBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    layoutBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
     layoutBindings[1].descriptorCount = 1;
     layoutBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     layoutBindings[1].pImmutableSamplers = nullptr;
@@ -377,6 +486,48 @@ void ComputePipeline::createDescriptorSetLayout() {
     layoutBindings[3].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     layoutBindings[3].pImmutableSamplers = nullptr;
 
+    // Binding 4: BVH8 nodes (BvhData)
+    layoutBindings[4].binding = 4;
+    layoutBindings[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutBindings[4].descriptorCount = 1;
+    layoutBindings[4].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layoutBindings[4].pImmutableSamplers = nullptr;
+
+    // Binding 5: BVH primitive indices (PrimitiveData)
+    layoutBindings[5].binding = 5;
+    layoutBindings[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutBindings[5].descriptorCount = 1;
+    layoutBindings[5].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layoutBindings[5].pImmutableSamplers = nullptr;
+
+    // Binding 6: Lane occupancy counters (Occupancy)
+    layoutBindings[6].binding = 6;
+    layoutBindings[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutBindings[6].descriptorCount = 1;
+    layoutBindings[6].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layoutBindings[6].pImmutableSamplers = nullptr;
+
+    // Binding 7: Per pixel luminance variance (Variance)
+    layoutBindings[7].binding = 7;
+    layoutBindings[7].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutBindings[7].descriptorCount = 1;
+    layoutBindings[7].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layoutBindings[7].pImmutableSamplers = nullptr;
+
+    // Binding 8: Tiles this frame traces (ActiveTiles)
+    layoutBindings[8].binding = 8;
+    layoutBindings[8].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutBindings[8].descriptorCount = 1;
+    layoutBindings[8].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layoutBindings[8].pImmutableSamplers = nullptr;
+
+    // Binding 9: Tiles the next frame traces (NextTiles)
+    layoutBindings[9].binding = 9;
+    layoutBindings[9].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutBindings[9].descriptorCount = 1;
+    layoutBindings[9].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layoutBindings[9].pImmutableSamplers = nullptr;
+
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
@@ -399,209 +550,436 @@ void ComputePipeline::recordCommandBuffer(VkCommandBuffer commandBuffer,
         throw std::runtime_error("failed to begin recording command buffer!");
     }
 
-    // 1. Transition swapchain image from PRESENT_SRC to GENERAL
-    VkImageMemoryBarrier presentToCompute{};
-    presentToCompute.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    presentToCompute.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    presentToCompute.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    presentToCompute.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    presentToCompute.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    presentToCompute.image = m_swapChain.images()[imageIndex];
-    presentToCompute.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    presentToCompute.subresourceRange.baseMipLevel = 0;
-    presentToCompute.subresourceRange.levelCount = 1;
-    presentToCompute.subresourceRange.baseArrayLayer = 0;
-    presentToCompute.subresourceRange.layerCount = 1;
-    presentToCompute.srcAccessMask = 0;
-    presentToCompute.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-
-    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0,
-                         nullptr, 1, &presentToCompute);
-
-    // Bind pipeline and descriptor set
+    m_profiler.resetOccupancy(commandBuffer, currentFrame);
+
+    // Frames in flight share the accumulation buffer and HDR image, order them
+    // on the queue, after the previous frame's resolve read the HDR image
+    VkMemoryBarrier accumulationBarrier{};
+    accumulationBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    accumulationBarrier.srcAccessMask =
+        VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    accumulationBarrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    // and the tile list the previous frame copied in, dispatched over
+    VkMemoryBarrier frameBarrier = accumulationBarrier;
+    frameBarrier.dstAccessMask |= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+        0, 1, &frameBarrier, 0, nullptr, 0, nullptr);
+
+    m_profiler.beginStage(commandBuffer, currentFrame, GpuStage::Trace);
+    VkDescriptorSet frameSet = descriptorSet(imageIndex, currentFrame);
+    VkExtent2D extent = m_target.extent();
+    if (m_integrator == config::Integrator::Wavefront) {
+        if (!m_wavefront) {
+            m_wavefront = std::make_unique<WavefrontIntegrator>(
+                m_device, m_pipelineCache, m_descriptorSetLayout);
+        }
+        // a pass per sample, the megakernel traces samplesPerPixel in each
+        // dispatch
+        uint32_t passes =
+            m_uniformSettings[currentFrame].samplesPerPixel * m_frameDispatches;
+        // Adaptive passes start a path per lane of the active tiles, as many
+        // as the whole grid has at most
+        VkExtent2D grid = tileGrid();
+        uint32_t paths = m_variant.adaptive
+                             ? grid.width * grid.height * kTileSize * kTileSize
+                             : extent.width * extent.height;
+        m_wavefront->record(commandBuffer, m_variant, frameSet,
+                            m_pushConstants, passes, paths);
+    } else {
+        recordDispatches(commandBuffer, frameSet, extent,
+                         accumulationBarrier);
+    }
+    if (m_variant.adaptive) {
+        recordTileClassification(commandBuffer, currentFrame, frameSet,
+                                 accumulationBarrier);
+    }
+    m_profiler.endStage(commandBuffer, currentFrame, GpuStage::Trace);
+
+    // The profiler reads the occupancy counters on the host, and adaptive
+    // sampling its tile count
+    VkMemoryBarrier hostBarrier{};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask =
+        VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0,
+        nullptr);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+    }
+}
+
+void ComputePipeline::recordDispatches(
+    VkCommandBuffer commandBuffer, VkDescriptorSet frameSet, VkExtent2D extent,
+    const VkMemoryBarrier& accumulationBarrier) {
     vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
                       m_pipeline);
     vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                            m_pipelineLayout, 0, 1,
-                            &m_descriptorSets[currentFrame], 0, nullptr);
-
-    // Dispatch compute shader
-    vkCmdDispatch(commandBuffer,
-                  static_cast<uint32_t>(m_swapChain.extent().width / 8),
-                  static_cast<uint32_t>(m_swapChain.extent().height / 8), 1);
-
-    // 2. Transition swapchain image to COLOR_ATTACHMENT_OPTIMAL for UI
-    // rendering
-    VkImageMemoryBarrier computeToGraphics{};
-    computeToGraphics.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    computeToGraphics.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-    computeToGraphics.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    computeToGraphics.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    computeToGraphics.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    computeToGraphics.image = m_swapChain.images()[imageIndex];
-    computeToGraphics.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    computeToGraphics.subresourceRange.baseMipLevel = 0;
-    computeToGraphics.subresourceRange.levelCount = 1;
-    computeToGraphics.subresourceRange.baseArrayLayer = 0;
-    computeToGraphics.subresourceRange.layerCount = 1;
-    computeToGraphics.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-    computeToGraphics.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
-    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0,
-                         nullptr, 0, nullptr, 1, &computeToGraphics);
+                            m_pipelineLayout, 0, 1, &frameSet, 0, nullptr);
+
+    // Each dispatch adds its samples to what the previous one accumulated,
+    // all in one submission
+    for (uint32_t i = 0; i < m_frameDispatches; i++) {
+        FramePushConstants pushConstants = m_pushConstants;
+        pushConstants.dispatchIndex = i;
+        if (i > 0) {
+            // only the first one starts the accumulation over
+            pushConstants.clearAccumulation = 0;
+            vkCmdPipelineBarrier(
+                commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                &accumulationBarrier, 0, nullptr, 0, nullptr);
+        }
+        vkCmdPushConstants(commandBuffer, m_pipelineLayout,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                           sizeof(FramePushConstants), &pushConstants);
+        // Adaptive dispatches cover the tiles left, after the clearing frame
+        // has covered them all
+        if (m_variant.adaptive && pushConstants.clearAccumulation == 0) {
+            vkCmdDispatchIndirect(commandBuffer, m_activeTileBuffer, 0);
+            continue;
+        }
+        vkCmdDispatch(commandBuffer,
+                      (extent.width + m_variant.workgroupWidth - 1) /
+                          m_variant.workgroupWidth,
+                      (extent.height + m_variant.workgroupHeight - 1) /
+                          m_variant.workgroupHeight,
+                      1);
+    }
+}
 
-    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-        throw std::runtime_error("failed to record command buffer!");
+void ComputePipeline::recordTileClassification(
+    VkCommandBuffer commandBuffer, uint32_t currentFrame,
+    VkDescriptorSet frameSet, const VkMemoryBarrier& accumulationBarrier) {
+    // The previous frame copied from the next list
+    VkMemoryBarrier clearBarrier{};
+    clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    clearBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &clearBarrier,
+                         0, nullptr, 0, nullptr);
+    // An empty list, a dispatch of 0 x 1 x 1 groups until tiles are added
+    vkCmdFillBuffer(commandBuffer, m_nextTileBuffer, 0, sizeof(uint32_t), 0);
+    vkCmdFillBuffer(commandBuffer, m_nextTileBuffer, sizeof(uint32_t),
+                    2 * sizeof(uint32_t), 1);
+    // and the variance the trace wrote
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &accumulationBarrier, 0,
+        nullptr, 0, nullptr);
+
+    // A workgroup per tile the trace covered, the wavefront integrator may
+    // have bound its own layout
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      m_classifyPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            m_pipelineLayout, 0, 1, &frameSet, 0, nullptr);
+    vkCmdPushConstants(commandBuffer, m_pipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(FramePushConstants), &m_pushConstants);
+    if (m_pushConstants.clearAccumulation != 0) {
+        VkExtent2D grid = tileGrid();
+        vkCmdDispatch(commandBuffer, grid.width, grid.height, 1);
+    } else {
+        vkCmdDispatchIndirect(commandBuffer, m_activeTileBuffer, 0);
     }
+
+    // The next frame dispatches over the new list, and the host reads its
+    // length once this frame is done
+    VkMemoryBarrier listBarrier{};
+    listBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    listBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    listBarrier.dstAccessMask =
+        VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &listBarrier, 0,
+                         nullptr, 0, nullptr);
+    VkBufferCopy list{0, 0, m_tileBufferSize};
+    vkCmdCopyBuffer(commandBuffer, m_nextTileBuffer, m_activeTileBuffer, 1,
+                    &list);
+    VkBufferCopy count{0, 0, sizeof(uint32_t)};
+    vkCmdCopyBuffer(commandBuffer, m_nextTileBuffer,
+                    m_tileCountBuffers[currentFrame], 1, &count);
 }
 
 // TODO: make generic
 void ComputePipeline::createUniformBuffers() {
-    VkDeviceSize sphereBufferSize = sizeof(Sphere) * m_scene.spheres().size();
-    m_sphereBuffers.resize(config::MAX_FRAMES_IN_FLIGHT);
-    m_sphereBuffersMemory.resize(config::MAX_FRAMES_IN_FLIGHT);
-    m_sphereBuffersMapped.resize(config::MAX_FRAMES_IN_FLIGHT);
-
-    for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
-        createBuffer(m_device, sphereBufferSize,
-                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     m_sphereBuffers[i], m_sphereBuffersMemory[i]);
-        vkMapMemory(m_device.device(), m_sphereBuffersMemory[i], 0,
-                    sphereBufferSize, 0, &m_sphereBuffersMapped[i]);
-    }
-    VkDeviceSize bufferSize = sizeof(UniformBufferObject);
+    m_sphereBufferSize = sizeof(Sphere) * m_scene.spheres().size();
+    // Every wide node is collapsed from a different interior node of the
+    // binary tree, so n spheres need at most n of them
+    size_t sphereCount = std::max<size_t>(m_scene.spheres().size(), 1);
+    m_bvhNodeBufferSize = sizeof(WideBvhNode<8>) * sphereCount;
+    m_bvhIndexBufferSize = sizeof(uint32_t) * sphereCount;
+    createBuffer(m_device, m_sphereBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::SceneBuffers, m_sphereBuffer,
+                 m_sphereBufferMemory);
+    createBuffer(m_device, m_bvhNodeBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::SceneBuffers, m_bvhNodeBuffer,
+                 m_bvhNodeBufferMemory);
+    createBuffer(m_device, m_bvhIndexBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::SceneBuffers, m_bvhIndexBuffer,
+                 m_bvhIndexBufferMemory);
+
+    m_stagingSliceSize =
+        m_sphereBufferSize + m_bvhNodeBufferSize + m_bvhIndexBufferSize;
+    VkDeviceSize stagingSize = m_stagingSliceSize * config::MAX_FRAMES_IN_FLIGHT;
+    createBuffer(m_device, stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 MemoryCategory::Staging, m_stagingBuffer,
+                 m_stagingBufferMemory);
+    m_stagingBufferMapped = m_stagingBufferMemory.mapped;
+    m_pendingUpload.addAll();
+
+    VkDeviceSize bufferSize = sizeof(SceneSettings);
+    SceneSettings settings = {m_scene.camera().sphereCount, 0, 1,
+                              m_rouletteDepth, m_noiseThreshold};
 
     m_uniformBuffers.resize(config::MAX_FRAMES_IN_FLIGHT);
     m_uniformBuffersMemory.resize(config::MAX_FRAMES_IN_FLIGHT);
     m_uniformBuffersMapped.resize(config::MAX_FRAMES_IN_FLIGHT);
+    m_uniformSettings.assign(config::MAX_FRAMES_IN_FLIGHT, settings);
     for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
         createBuffer(m_device, bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     m_uniformBuffers[i], m_uniformBuffersMemory[i]);
-        vkMapMemory(m_device.device(), m_uniformBuffersMemory[i], 0, bufferSize,
-                    0, &m_uniformBuffersMapped[i]);
+                     MemoryCategory::Uniforms, m_uniformBuffers[i],
+                     m_uniformBuffersMemory[i]);
+        m_uniformBuffersMapped[i] = m_uniformBuffersMemory[i].mapped;
+        memcpy(m_uniformBuffersMapped[i], &settings, sizeof(settings));
     }
 }
 
 void ComputePipeline::updateScene(uint32_t currentImage) {
-    memcpy(m_uniformBuffersMapped[currentImage], &m_scene.camera(),
-           sizeof(m_scene.camera()));
-    memcpy(m_sphereBuffersMapped[currentImage], m_scene.spheres().data(),
-           m_scene.spheres().size() * sizeof(Sphere));
+    const UniformBufferObject& camera = m_scene.camera();
+    m_pushConstants.cameraForward = camera.camera_forward;
+    m_pushConstants.cameraRight = camera.camera_right;
+    m_pushConstants.cameraUp = camera.camera_up;
+    m_pushConstants.cameraPosition = camera.camera_position;
+    // Scene::update() passes through 1 after every reset
+    m_pushConstants.clearAccumulation = camera.frameCount <= 1 ? 1 : 0;
+
+    // Every traced frame adds a sample, so while accumulating this is
+    // rewritten each frame, a few bytes of coherent memory rather than a
+    // push constant that would re-record the dispatch
+    bool reset = m_pushConstants.clearAccumulation != 0;
+    uint32_t samples = reset ? 0 : m_accumulatedSamples;
+    // Camera moves and resets trace a single sample so the view keeps up
+    uint32_t samplesPerPixel = reset ? 1 : m_samplesPerPixel;
+    m_frameDispatches = reset ? 1 : m_dispatchesPerFrame;
+    SceneSettings& settings = m_uniformSettings[currentImage];
+    if (settings.sphereCount != camera.sphereCount ||
+        settings.accumulatedSamples != samples ||
+        settings.samplesPerPixel != samplesPerPixel ||
+        settings.rouletteDepth != m_rouletteDepth ||
+        settings.noiseThreshold != m_noiseThreshold) {
+        settings.sphereCount = camera.sphereCount;
+        settings.accumulatedSamples = samples;
+        settings.samplesPerPixel = samplesPerPixel;
+        settings.rouletteDepth = m_rouletteDepth;
+        settings.noiseThreshold = m_noiseThreshold;
+        memcpy(m_uniformBuffersMapped[currentImage], &settings,
+               sizeof(SceneSettings));
+    }
+
+    // Everything pending fits the slice, so the scene buffers are current
+    // once this frame's copies run
+    m_pendingUpload.merge(m_scene.takeChanges());
+    m_sphereCopies.clear();
+    m_bvhNodeCopies.clear();
+    m_bvhIndexCopies.clear();
+    VkDeviceSize offset = m_stagingSliceSize * currentImage;
+    stageRanges(m_stagingBufferMapped, offset, m_sphereBufferSize,
+                m_scene.spheres().data(), m_scene.spheres().size(),
+                m_pendingUpload.spheres, m_sphereCopies);
+
+    const WideBvh<8>& bvh = m_scene.wideBvh();
+    stageRanges(m_stagingBufferMapped, offset, m_bvhNodeBufferSize,
+                bvh.nodes().data(), bvh.nodes().size(),
+                m_pendingUpload.bvhNodes, m_bvhNodeCopies);
+    if (m_pendingUpload.bvhIndices) {
+        DirtyRanges indices;
+        indices.addAll();
+        stageRanges(m_stagingBufferMapped, offset, m_bvhIndexBufferSize,
+                    bvh.primitiveIndices().data(), bvh.primitiveCount(),
+                    indices, m_bvhIndexCopies);
+    }
+    m_pendingUpload = SceneChanges();
+}
+
+bool ComputePipeline::recordSceneCopies(VkCommandBuffer commandBuffer,
+                                        uint32_t currentFrame) {
+    if (m_sphereCopies.empty() && m_bvhNodeCopies.empty() &&
+        m_bvhIndexCopies.empty()) {
+        return false;
+    }
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+    }
+    m_profiler.beginStage(commandBuffer, currentFrame, GpuStage::Upload);
+
+    // Earlier frames may still be tracing from the buffers being written
+    VkMemoryBarrier readBarrier{};
+    readBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    readBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    readBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &readBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    auto copy = [&](VkBuffer buffer, const std::vector<VkBufferCopy>& copies) {
+        if (copies.empty()) return;
+        vkCmdCopyBuffer(commandBuffer, m_stagingBuffer, buffer,
+                        static_cast<uint32_t>(copies.size()), copies.data());
+    };
+    copy(m_sphereBuffer, m_sphereCopies);
+    copy(m_bvhNodeBuffer, m_bvhNodeCopies);
+    copy(m_bvhIndexBuffer, m_bvhIndexCopies);
+
+    VkMemoryBarrier writeBarrier{};
+    writeBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    writeBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    writeBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &writeBarrier, 0, nullptr, 0, nullptr);
+    m_profiler.endStage(commandBuffer, currentFrame, GpuStage::Upload);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+    }
+    return true;
 }
 
 void ComputePipeline::createDescriptorSets() {
-    std::vector<VkDescriptorSetLayout> layouts(config::MAX_FRAMES_IN_FLIGHT,
+    size_t setCount = m_descriptorImageCount * config::MAX_FRAMES_IN_FLIGHT;
+    std::vector<VkDescriptorSetLayout> layouts(setCount,
                                                m_descriptorSetLayout);
     VkDescriptorSetAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocInfo.descriptorPool = m_descriptorPool;
-    allocInfo.descriptorSetCount =
-        static_cast<uint32_t>(config::MAX_FRAMES_IN_FLIGHT);
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(setCount);
     allocInfo.pSetLayouts = layouts.data();
-    m_descriptorSets.resize(config::MAX_FRAMES_IN_FLIGHT);
+    m_descriptorSets.resize(setCount);
     if (vkAllocateDescriptorSets(m_device.device(), &allocInfo,
                                  m_descriptorSets.data()) != VK_SUCCESS) {
         throw std::runtime_error("failed to allocate descriptor sets!");
     }
+    m_descriptorSetsWritten.assign(setCount, false);
+}
 
-    for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
-        // Storage Image descriptor (binding = 0)
-        VkDescriptorImageInfo imageInfo{};
-        imageInfo.imageView = m_swapChain.imageViews()[i];
-        imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageInfo.sampler = nullptr;
-
-        // Accumulation buffer (binding = 1)
-        VkDescriptorImageInfo accumImageInfo{};
-        accumImageInfo.imageView = m_accumulationImageView;
-        accumImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-
-        // Storage Buffer descriptor for spheres (binding = 1)
-        VkDescriptorBufferInfo sphereBufferInfo{};
-        sphereBufferInfo.buffer = m_sphereBuffers[i];
-        sphereBufferInfo.offset = 0;
-        sphereBufferInfo.range = sizeof(Sphere) * m_scene.spheres().size();
-
-        // Uniform Buffer descriptor (binding = 2)
-        VkDescriptorBufferInfo uniformBufferInfo{};
-        uniformBufferInfo.buffer = m_uniformBuffers[i];
-        uniformBufferInfo.offset = 0;
-        uniformBufferInfo.range = sizeof(UniformBufferObject);
-
-        std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
-
-        // Storage Image (binding = 0)
-        descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[0].dstSet = m_descriptorSets[i];
-        descriptorWrites[0].dstBinding = 0;
-        descriptorWrites[0].dstArrayElement = 0;
-        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-        descriptorWrites[0].descriptorCount = 1;
-        descriptorWrites[0].pImageInfo = &imageInfo;
-
-        // Accumulation buffer (binding = 1)
-
-        descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[1].dstSet = m_descriptorSets[i];
-        descriptorWrites[1].dstBinding = 1;
-        descriptorWrites[1].dstArrayElement = 0;
-        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-        descriptorWrites[1].descriptorCount = 1;
-        descriptorWrites[1].pImageInfo = &accumImageInfo;
-
-        // Sphere Storage Buffer (binding = 1)
-        descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[2].dstSet = m_descriptorSets[i];
-        descriptorWrites[2].dstBinding = 2;
-        descriptorWrites[2].dstArrayElement = 0;
-        descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorWrites[2].descriptorCount = 1;
-        descriptorWrites[2].pBufferInfo = &sphereBufferInfo;
-
-        // Uniform Buffer (binding = 2)
-        descriptorWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[3].dstSet = m_descriptorSets[i];
-        descriptorWrites[3].dstBinding = 3;
-        descriptorWrites[3].dstArrayElement = 0;
-        descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        descriptorWrites[3].descriptorCount = 1;
-        descriptorWrites[3].pBufferInfo = &uniformBufferInfo;
-
-        try {
-            vkUpdateDescriptorSets(
-                m_device.device(),
-                static_cast<uint32_t>(descriptorWrites.size()),
-                descriptorWrites.data(), 0, nullptr);
-        } catch (const std::exception& e) {
-            std::cerr << "Error updating descriptor sets: " << e.what()
-                      << std::endl;
-            throw std::runtime_error("failed to update descriptor sets!");
-        }
+void ComputePipeline::invalidateDescriptorSets() {
+    // Rewriting a bound set invalidates the command buffers recorded with it
+    invalidateCommandBuffers();
+    if (m_target.imageCount() != m_descriptorImageCount) {
+        // Destroying the pool frees its sets
+        vkDestroyDescriptorPool(m_device.device(), m_descriptorPool, nullptr);
+        createDescriptorPool();
+        createDescriptorSets();
+        return;
+    }
+    m_descriptorSetsWritten.assign(m_descriptorSets.size(), false);
+}
+
+void ComputePipeline::invalidateCommandBuffers() {
+    if (m_dispatchCommandBuffers.size() !=
+        static_cast<size_t>(m_target.imageCount()) *
+            config::MAX_FRAMES_IN_FLIGHT) {
+        createDispatchCommandBuffers();
+        return;
+    }
+    for (DispatchCommandBuffer& dispatch : m_dispatchCommandBuffers) {
+        dispatch.valid = false;
     }
 }
 
-void ComputePipeline::updateDescriptorSets(uint32_t imageIndex,
-                                           uint32_t currentFrame) {
-    // Image descriptors for the color buffer
-    VkDescriptorImageInfo colorImageInfo{};
-    colorImageInfo.imageView = m_swapChain.imageViews()[imageIndex];
-    colorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-    colorImageInfo.sampler = nullptr;
+VkCommandBuffer ComputePipeline::dispatchCommandBuffer(uint32_t imageIndex,
+                                                       uint32_t currentFrame) {
+    DispatchCommandBuffer& dispatch =
+        m_dispatchCommandBuffers[static_cast<size_t>(imageIndex) *
+                                     config::MAX_FRAMES_IN_FLIGHT +
+                                 currentFrame];
+    // The slot's previous frame has finished, the only one that could still
+    // have been running this recording
+    VkExtent2D extent = m_target.extent();
+    if (!dispatch.valid || dispatch.extent.width != extent.width ||
+        dispatch.extent.height != extent.height ||
+        dispatch.pipeline != m_pipeline ||
+        dispatch.dispatches != m_frameDispatches ||
+        dispatch.integrator != m_integrator ||
+        dispatch.samplesPerPixel !=
+            m_uniformSettings[currentFrame].samplesPerPixel ||
+        !samePushConstants(dispatch.pushConstants, m_pushConstants)) {
+        vkResetCommandBuffer(dispatch.commandBuffer, 0);
+        recordCommandBuffer(dispatch.commandBuffer, currentFrame, imageIndex);
+        dispatch.extent = extent;
+        dispatch.pipeline = m_pipeline;
+        dispatch.pushConstants = m_pushConstants;
+        dispatch.dispatches = m_frameDispatches;
+        dispatch.integrator = m_integrator;
+        dispatch.samplesPerPixel =
+            m_uniformSettings[currentFrame].samplesPerPixel;
+        dispatch.valid = true;
+    }
+    return dispatch.commandBuffer;
+}
+
+VkDescriptorSet ComputePipeline::descriptorSet(uint32_t imageIndex,
+                                               uint32_t currentFrame) {
+    size_t index = static_cast<size_t>(imageIndex) *
+                       config::MAX_FRAMES_IN_FLIGHT +
+                   currentFrame;
+    if (!m_descriptorSetsWritten[index]) {
+        writeDescriptorSet(m_descriptorSets[index], currentFrame);
+        m_descriptorSetsWritten[index] = true;
+    }
+    return m_descriptorSets[index];
+}
 
-    // Image descriptors for the accumulation buffer
-    VkDescriptorImageInfo accumImageInfo{};
-    accumImageInfo.imageView = m_accumulationImageView;
-    accumImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+void ComputePipeline::writeDescriptorSet(VkDescriptorSet descriptorSet,
+                                         uint32_t currentFrame) {
+    // Image descriptors for the HDR output, resolved by m_resolvePass
+    VkDescriptorImageInfo outputImageInfo{};
+    outputImageInfo.imageView = m_resolvePass.hdrImageView();
+    outputImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    outputImageInfo.sampler = nullptr;
+
+    // Buffer descriptor for the accumulation
+    VkDescriptorBufferInfo accumulationBufferInfo{};
+    accumulationBufferInfo.buffer = m_accumulationBuffer;
+    accumulationBufferInfo.offset = 0;
+    accumulationBufferInfo.range = m_accumulationBufferSize;
 
     // Buffer descriptor for the sphere data
     VkDescriptorBufferInfo sphereBufferInfo{};
-    sphereBufferInfo.buffer = m_sphereBuffers[currentFrame];
+    sphereBufferInfo.buffer = m_sphereBuffer;
     sphereBufferInfo.offset = 0;
     sphereBufferInfo.range = sizeof(Sphere) * m_scene.spheres().size();
 
@@ -609,31 +987,61 @@ void ComputePipeline::updateDescriptorSets(uint32_t imageIndex,
     VkDescriptorBufferInfo uniformBufferInfo{};
     uniformBufferInfo.buffer = m_uniformBuffers[currentFrame];
     uniformBufferInfo.offset = 0;
-    uniformBufferInfo.range = sizeof(UniformBufferObject);
-
-    std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
-
-    // Binding 0: Color buffer
+    uniformBufferInfo.range = sizeof(SceneSettings);
+
+    // Buffer descriptors for the BVH
+    VkDescriptorBufferInfo bvhNodeBufferInfo{};
+    bvhNodeBufferInfo.buffer = m_bvhNodeBuffer;
+    bvhNodeBufferInfo.offset = 0;
+    bvhNodeBufferInfo.range = m_bvhNodeBufferSize;
+    VkDescriptorBufferInfo bvhIndexBufferInfo{};
+    bvhIndexBufferInfo.buffer = m_bvhIndexBuffer;
+    bvhIndexBufferInfo.offset = 0;
+    bvhIndexBufferInfo.range = m_bvhIndexBufferSize;
+
+    // Buffer descriptor for the slot's occupancy counters
+    VkDescriptorBufferInfo occupancyBufferInfo{};
+    occupancyBufferInfo.buffer = m_profiler.occupancyBuffer(currentFrame);
+    occupancyBufferInfo.offset = 0;
+    occupancyBufferInfo.range = sizeof(OccupancyCounters);
+
+    // Buffer descriptors for adaptive sampling
+    VkDescriptorBufferInfo varianceBufferInfo{};
+    varianceBufferInfo.buffer = m_varianceBuffer;
+    varianceBufferInfo.offset = 0;
+    varianceBufferInfo.range = m_varianceBufferSize;
+    VkDescriptorBufferInfo activeTileBufferInfo{};
+    activeTileBufferInfo.buffer = m_activeTileBuffer;
+    activeTileBufferInfo.offset = 0;
+    activeTileBufferInfo.range = m_tileBufferSize;
+    VkDescriptorBufferInfo nextTileBufferInfo{};
+    nextTileBufferInfo.buffer = m_nextTileBuffer;
+    nextTileBufferInfo.offset = 0;
+    nextTileBufferInfo.range = m_tileBufferSize;
+
+    std::array<VkWriteDescriptorSet, 10> descriptorWrites{};
+
+    // Binding 0: HDR output image
     descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrites[0].dstSet = m_descriptorSets[currentFrame];
+    descriptorWrites[0].dstSet = descriptorSet;
     descriptorWrites[0].dstBinding = 0;
     descriptorWrites[0].dstArrayElement = 0;
     descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     descriptorWrites[0].descriptorCount = 1;
-    descriptorWrites[0].pImageInfo = &colorImageInfo;
+    descriptorWrites[0].pImageInfo = &outputImageInfo;
 
     // Binding 1: Accumulation buffer
     descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrites[1].dstSet = m_descriptorSets[currentFrame];
+    descriptorWrites[1].dstSet = descriptorSet;
     descriptorWrites[1].dstBinding = 1;
     descriptorWrites[1].dstArrayElement = 0;
-    descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
     descriptorWrites[1].descriptorCount = 1;
-    descriptorWrites[1].pImageInfo = &accumImageInfo;
+    descriptorWrites[1].pBufferInfo = &accumulationBufferInfo;
 
     // Binding 2: Sphere buffer
     descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrites[2].dstSet = m_descriptorSets[currentFrame];
+    descriptorWrites[2].dstSet = descriptorSet;
     descriptorWrites[2].dstBinding = 2;
     descriptorWrites[2].dstArrayElement = 0;
     descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
@@ -642,22 +1050,243 @@ void ComputePipeline::updateDescriptorSets(uint32_t imageIndex,
 
     // Binding 3: Uniform buffer
     descriptorWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrites[3].dstSet = m_descriptorSets[currentFrame];
+    descriptorWrites[3].dstSet = descriptorSet;
     descriptorWrites[3].dstBinding = 3;
     descriptorWrites[3].dstArrayElement = 0;
     descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     descriptorWrites[3].descriptorCount = 1;
     descriptorWrites[3].pBufferInfo = &uniformBufferInfo;
 
+    // Binding 4: BVH nodes
+    descriptorWrites[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[4].dstSet = descriptorSet;
+    descriptorWrites[4].dstBinding = 4;
+    descriptorWrites[4].dstArrayElement = 0;
+    descriptorWrites[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[4].descriptorCount = 1;
+    descriptorWrites[4].pBufferInfo = &bvhNodeBufferInfo;
+
+    // Binding 5: BVH primitive indices
+    descriptorWrites[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[5].dstSet = descriptorSet;
+    descriptorWrites[5].dstBinding = 5;
+    descriptorWrites[5].dstArrayElement = 0;
+    descriptorWrites[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[5].descriptorCount = 1;
+    descriptorWrites[5].pBufferInfo = &bvhIndexBufferInfo;
+
+    // Binding 6: Lane occupancy counters
+    descriptorWrites[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[6].dstSet = descriptorSet;
+    descriptorWrites[6].dstBinding = 6;
+    descriptorWrites[6].dstArrayElement = 0;
+    descriptorWrites[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[6].descriptorCount = 1;
+    descriptorWrites[6].pBufferInfo = &occupancyBufferInfo;
+
+    // Binding 7: Per pixel luminance variance
+    descriptorWrites[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[7].dstSet = descriptorSet;
+    descriptorWrites[7].dstBinding = 7;
+    descriptorWrites[7].dstArrayElement = 0;
+    descriptorWrites[7].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[7].descriptorCount = 1;
+    descriptorWrites[7].pBufferInfo = &varianceBufferInfo;
+
+    // Binding 8: Tiles this frame traces
+    descriptorWrites[8].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[8].dstSet = descriptorSet;
+    descriptorWrites[8].dstBinding = 8;
+    descriptorWrites[8].dstArrayElement = 0;
+    descriptorWrites[8].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[8].descriptorCount = 1;
+    descriptorWrites[8].pBufferInfo = &activeTileBufferInfo;
+
+    // Binding 9: Tiles the next frame traces
+    descriptorWrites[9].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[9].dstSet = descriptorSet;
+    descriptorWrites[9].dstBinding = 9;
+    descriptorWrites[9].dstArrayElement = 0;
+    descriptorWrites[9].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[9].descriptorCount = 1;
+    descriptorWrites[9].pBufferInfo = &nextTileBufferInfo;
+
     vkUpdateDescriptorSets(m_device.device(),
                            static_cast<uint32_t>(descriptorWrites.size()),
                            descriptorWrites.data(), 0, nullptr);
 }
 
+void ComputePipeline::frameCompleted(uint32_t currentFrame) {
+    if (!m_tileCountsPending[currentFrame]) return;
+    // Frames finish in order, so this is the latest count
+    memcpy(&m_activeTiles, m_tileCountBuffersMemory[currentFrame].mapped,
+           sizeof(uint32_t));
+    m_tileCountsPending[currentFrame] = false;
+}
+
+bool ComputePipeline::converged() const {
+    // a reset traces every tile again
+    return m_noiseThreshold > 0.0f && m_activeTiles == 0 &&
+           m_scene.camera().frameCount > 1;
+}
+
+bool ComputePipeline::traceDue() const {
+    // Scene::update() passes through 1 after every reset, which has to clear
+    // the accumulation
+    if (m_scene.camera().frameCount <= 1) return true;
+    // the frames after convergence only resolve
+    if (converged()) return false;
+    return m_framesSinceTrace + 1 >= m_traceInterval;
+}
+
+uint32_t ComputePipeline::samplesDue() const {
+    if (!traceDue()) return 0;
+    // same rule as updateScene()
+    if (m_scene.camera().frameCount <= 1) return 1;
+    return m_samplesPerPixel * m_dispatchesPerFrame;
+}
+
+uint64_t ComputePipeline::pathsDue() const {
+    VkExtent2D extent = m_target.extent();
+    uint64_t pixels = static_cast<uint64_t>(extent.width) * extent.height;
+    // as of the last count read back, adaptive sampling traces fewer
+    if (m_noiseThreshold > 0.0f && m_scene.camera().frameCount > 1) {
+        pixels = std::min<uint64_t>(
+            pixels, static_cast<uint64_t>(m_activeTiles) * kTileSize *
+                        kTileSize);
+    }
+    return pixels * samplesDue();
+}
+
 void ComputePipeline::render(uint32_t imageIndex, uint32_t currentFrame) {
+    // Edited spheres change the image like a camera move does, so they clear
+    // the accumulation and trace every tile again, converged or not
+    if (m_scene.spheresChanged()) m_scene.resetFrameCount();
+    bool trace = traceDue();
     updateScene(currentFrame);
-    updateDescriptorSets(imageIndex, currentFrame);
+    selectVariant();
+    // Only the scene copies are recorded per frame, ahead of the cached
+    // dispatch and resolve
+    std::vector<VkCommandBuffer>& submit = m_submitCommandBuffers[currentFrame];
+    submit.clear();
     vkResetCommandBuffer(m_commandBuffers[currentFrame], 0);
-    recordCommandBuffer(m_commandBuffers[currentFrame], currentFrame,
-                        imageIndex);
+    if (recordSceneCopies(m_commandBuffers[currentFrame], currentFrame)) {
+        submit.push_back(m_commandBuffers[currentFrame]);
+        m_profiler.submitted(currentFrame, GpuStage::Upload);
+    }
+    if (trace) {
+        submit.push_back(dispatchCommandBuffer(imageIndex, currentFrame));
+        m_profiler.submitted(currentFrame, GpuStage::Trace);
+        const SceneSettings& settings = m_uniformSettings[currentFrame];
+        m_accumulatedSamples = settings.accumulatedSamples +
+                               settings.samplesPerPixel * m_frameDispatches;
+        m_framesSinceTrace = 0;
+        if (m_pushConstants.clearAccumulation != 0) {
+            // the counts of frames before the reset no longer apply
+            VkExtent2D grid = tileGrid();
+            m_tileCountsPending.assign(m_tileCountsPending.size(), false);
+            m_activeTiles = grid.width * grid.height;
+        }
+    } else {
+        m_framesSinceTrace++;
+    }
+    m_tileCountsPending[currentFrame] = trace && m_variant.adaptive;
+    submit.push_back(m_resolvePass.commandBuffer(imageIndex, currentFrame));
+    // every pipeline this frame compiled, in one write
+    m_pipelineCache.saveIfChanged();
+}
+
+void ComputePipeline::renderHostImage(uint32_t imageIndex,
+                                      uint32_t currentFrame,
+                                      const std::vector<glm::vec4>& pixels) {
+    writeHostImage(currentFrame, pixels);
+    vkResetCommandBuffer(m_commandBuffers[currentFrame], 0);
+    recordUploadCommandBuffer(m_commandBuffers[currentFrame], currentFrame);
+    m_submitCommandBuffers[currentFrame] = {
+        m_commandBuffers[currentFrame],
+        m_resolvePass.commandBuffer(imageIndex, currentFrame)};
+    m_profiler.submitted(currentFrame, GpuStage::Upload);
+}
+
+void ComputePipeline::destroyHostImageBuffer(uint32_t currentFrame) {
+    if (m_hostImageBuffers[currentFrame] == VK_NULL_HANDLE) return;
+    destroyBuffer(m_device, m_hostImageBuffers[currentFrame],
+                  m_hostImageBuffersMemory[currentFrame]);
+    m_hostImageBuffersMapped[currentFrame] = nullptr;
+    m_hostImageBufferSizes[currentFrame] = 0;
+}
+
+void ComputePipeline::writeHostImage(uint32_t currentFrame,
+                                     const std::vector<glm::vec4>& pixels) {
+    const VkExtent2D& extent = m_target.extent();
+    size_t pixelCount = static_cast<size_t>(extent.width) * extent.height;
+    if (pixels.size() != pixelCount) {
+        throw std::runtime_error("host image does not match target extent!");
+    }
+    // Same texels as the HDR image, the resolve tonemaps them
+    VkDeviceSize size = sizeof(glm::vec4) * pixelCount;
+
+    if (m_hostImageBuffers.empty()) {
+        m_hostImageBuffers.resize(config::MAX_FRAMES_IN_FLIGHT,
+                                  VK_NULL_HANDLE);
+        m_hostImageBuffersMemory.resize(config::MAX_FRAMES_IN_FLIGHT);
+        m_hostImageBuffersMapped.resize(config::MAX_FRAMES_IN_FLIGHT, nullptr);
+        m_hostImageBufferSizes.resize(config::MAX_FRAMES_IN_FLIGHT, 0);
+    }
+    // The slot's last frame has finished, so its buffer is free to replace
+    if (m_hostImageBufferSizes[currentFrame] != size) {
+        destroyHostImageBuffer(currentFrame);
+        createBuffer(m_device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     MemoryCategory::Staging, m_hostImageBuffers[currentFrame],
+                     m_hostImageBuffersMemory[currentFrame]);
+        m_hostImageBuffersMapped[currentFrame] =
+            m_hostImageBuffersMemory[currentFrame].mapped;
+        m_hostImageBufferSizes[currentFrame] = size;
+    }
+    memcpy(m_hostImageBuffersMapped[currentFrame], pixels.data(),
+           static_cast<size_t>(size));
+}
+
+void ComputePipeline::recordUploadCommandBuffer(VkCommandBuffer commandBuffer,
+                                                uint32_t currentFrame) {
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+    }
+
+    m_profiler.beginStage(commandBuffer, currentFrame, GpuStage::Upload);
+
+    // The previous frame's resolve may still be reading the HDR image
+    VkMemoryBarrier readBarrier{};
+    readBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    readBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    readBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &readBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {m_target.extent().width, m_target.extent().height,
+                          1};
+
+    vkCmdCopyBufferToImage(commandBuffer, m_hostImageBuffers[currentFrame],
+                           m_resolvePass.hdrImage(), VK_IMAGE_LAYOUT_GENERAL,
+                           1, &region);
+    m_profiler.endStage(commandBuffer, currentFrame, GpuStage::Upload);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+    }
 }
@@ -0,0 +1,292 @@
+#include "../includes/cpu_renderer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../includes/utils.hpp"
+
+namespace {
+constexpr float kPosInfinity = 3.402823466e+38f;
+constexpr int kMaxBounces = 50;
+// START_CONTRIBUTION and MIN_SURVIVAL in trace.glsl
+constexpr float kStartContribution = 0.15f;
+constexpr float kMinSurvival = 0.05f;
+// Matches the 8x8 compute workgroups, split down to 4x4 at the end of a frame
+constexpr uint32_t kTileSize = 8;
+constexpr uint32_t kMinTileSize = 4;
+// Primary rays per packet side, 8x8 fills RayPacket
+constexpr uint32_t kPacketSize = 8;
+constexpr size_t kLinearSphereLimit = 512;
+
+// Default resolve of tonemap.comp: ACES at exposure 1, then sRGB encoding
+float resolveChannel(float value) {
+    value = std::max(value, 0.0f);
+    value = std::clamp((value * (2.51f * value + 0.03f)) /
+                           (value * (2.43f * value + 0.59f) + 0.14f),
+                       0.0f, 1.0f);
+    return value <= 0.0031308f
+               ? value * 12.92f
+               : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+}
+
+// Same hash and seed layout as rand() in def.glsl
+uint32_t wangHash(uint32_t seed) {
+    seed = (seed ^ 61u) ^ (seed >> 16u);
+    seed *= 9u;
+    seed = seed ^ (seed >> 4u);
+    seed *= 0x27d4eb2du;
+    seed = seed ^ (seed >> 15u);
+    return seed;
+}
+
+float rand(glm::vec2 pixelCoord, int frameNumber, int sampleIndex) {
+    uint32_t seed = uint32_t(pixelCoord.x) + 1920u * uint32_t(pixelCoord.y) +
+                    uint32_t(frameNumber) * 1920u * 1080u +
+                    uint32_t(sampleIndex) * 1920u * 1080u * 256u;
+    return float(wangHash(seed)) / 4294967296.0f;
+}
+
+glm::vec3 randVec3(float min, float max, glm::vec2 pixelCoord,
+                   int frameNumber, int sampleIndex) {
+    return glm::vec3(
+        rand(pixelCoord, frameNumber, sampleIndex) * (max - min) + min,
+        rand(pixelCoord + glm::vec2(1.0f, 0.0f), frameNumber, sampleIndex) *
+                (max - min) +
+            min,
+        rand(pixelCoord + glm::vec2(0.0f, 1.0f), frameNumber, sampleIndex) *
+                (max - min) +
+            min);
+}
+}  // namespace
+
+CpuRenderer::CpuRenderer(uint32_t width, uint32_t height, Scene& scene,
+                         TileScheduler& scheduler)
+    : m_scene(scene),
+      m_scheduler(scheduler),
+      m_width(0),
+      m_height(0),
+      m_simdLevel(detectSimdLevel()),
+      m_intersectSpheres(selectIntersectKernel(m_simdLevel)) {
+    resize(width, height);
+}
+
+CpuRenderer::~CpuRenderer() {}
+
+void CpuRenderer::resize(uint32_t width, uint32_t height) {
+    m_width = width;
+    m_height = height;
+    m_accumulation.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+    m_color.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+    m_scene.resetFrameCount();
+}
+
+void CpuRenderer::render() {
+    const UniformBufferObject camera = m_scene.camera();
+    m_sphereSoA.build(m_scene.spheres(),
+                      static_cast<size_t>(std::max(camera.sphereCount, 0)));
+    // A few hundred spheres are as fast to test linearly with SIMD
+    m_useBvh = m_sphereSoA.size() > kLinearSphereLimit &&
+               m_scene.bvh().primitiveCount() == m_sphereSoA.size() &&
+               m_scene.wideBvh().primitiveCount() == m_sphereSoA.size();
+
+    // Sky pixels are far cheaper than pixels on reflective spheres, so the
+    // frame is balanced by stealing tiles rather than splitting it up front
+    m_bounces = 0;
+    m_scheduler.parallelTiles(
+        m_width, m_height, kTileSize,
+        [&](const Tile& tile, unsigned) { renderTile(tile, camera); },
+        kMinTileSize);
+}
+
+double CpuRenderer::averagePathLength() const {
+    size_t pixels = static_cast<size_t>(m_width) * m_height;
+    return pixels > 0 ? double(m_bounces) / double(pixels) : 0.0;
+}
+
+void CpuRenderer::renderTile(const Tile& tile,
+                             const UniformBufferObject& camera) {
+    thread_local std::vector<RayHit> primaryHits;
+    uint64_t bounces = 0;
+    for (uint32_t by = tile.y0; by < tile.y1; by += kPacketSize) {
+        for (uint32_t bx = tile.x0; bx < tile.x1; bx += kPacketSize) {
+            Tile block = {bx, by, std::min(tile.x1, bx + kPacketSize),
+                          std::min(tile.y1, by + kPacketSize)};
+            tracePrimaryPacket(block, camera, primaryHits);
+
+            for (uint32_t y = block.y0; y < block.y1; y++) {
+                for (uint32_t x = block.x0; x < block.x1; x++) {
+                    size_t index = static_cast<size_t>(y) * m_width + x;
+                    // clear accumulate buffer when frame count is 1
+                    if (camera.frameCount == 1) {
+                        m_accumulation[index] = glm::vec4(0.0f);
+                    }
+                    const RayHit& hit =
+                        primaryHits[(y - block.y0) * block.width() +
+                                    (x - block.x0)];
+                    glm::vec3 light = tracePath(
+                        x, y, camera, primaryRay(x, y, camera), hit, bounces);
+                    m_accumulation[index] += glm::vec4(light, 1.0f);
+                    glm::vec3 finalColor = glm::vec3(m_accumulation[index]) /
+                                           float(int(camera.frameCount) + 1);
+                    m_color[index] = glm::vec4(finalColor, 1.0f);
+                }
+            }
+        }
+    }
+    m_bounces.fetch_add(bounces, std::memory_order_relaxed);
+}
+
+void CpuRenderer::tracePrimaryPacket(const Tile& block,
+                                     const UniformBufferObject& camera,
+                                     std::vector<RayHit>& hits) const {
+    hits.resize(block.width() * block.height());
+    if (!m_packetTracing) {
+        for (uint32_t y = block.y0; y < block.y1; y++) {
+            for (uint32_t x = block.x0; x < block.x1; x++) {
+                hits[(y - block.y0) * block.width() + (x - block.x0)] =
+                    trace(primaryRay(x, y, camera));
+            }
+        }
+        return;
+    }
+
+    // The pinhole camera has no jitter, so the primary rays of a block share
+    // their origin and fan out inside the cone of the corner rays
+    RayPacket packet;
+    packet.origin = camera.camera_position;
+    packet.width = block.width();
+    packet.height = block.height();
+    for (uint32_t y = block.y0; y < block.y1; y++) {
+        for (uint32_t x = block.x0; x < block.x1; x++) {
+            uint32_t i = (y - block.y0) * block.width() + (x - block.x0);
+            glm::vec3 direction = primaryRay(x, y, camera).direction;
+            packet.dx[i] = direction.x;
+            packet.dy[i] = direction.y;
+            packet.dz[i] = direction.z;
+        }
+    }
+    intersectPacket(m_sphereSoA, packet, kPosInfinity, m_simdLevel,
+                    m_useBvh ? &m_scene.bvh() : nullptr);
+
+    for (uint32_t y = block.y0; y < block.y1; y++) {
+        for (uint32_t x = block.x0; x < block.x1; x++) {
+            uint32_t i = (y - block.y0) * block.width() + (x - block.x0);
+            hits[i] = resolveHit(primaryRay(x, y, camera),
+                                 {packet.distance[i], packet.index[i]});
+        }
+    }
+}
+
+CpuRenderer::Ray CpuRenderer::primaryRay(
+    uint32_t x, uint32_t y, const UniformBufferObject& camera) const {
+    float horizontalCoefficient =
+        (float(x) * 2 - float(m_width)) / float(m_width);
+    float verticalCoefficient =
+        (float(y) * 2 - float(m_height)) / float(m_width);
+
+    Ray ray;
+    ray.origin = camera.camera_position;
+    ray.direction = glm::normalize(camera.camera_forward +
+                                   horizontalCoefficient * camera.camera_right +
+                                   verticalCoefficient * camera.camera_up);
+    return ray;
+}
+
+glm::vec3 CpuRenderer::tracePath(uint32_t x, uint32_t y,
+                                 const UniformBufferObject& camera, Ray ray,
+                                 RayHit hit, uint64_t& bounces) const {
+    glm::vec2 pixelCoord = glm::vec2(float(x), float(y));
+    int frameCount = int(camera.frameCount);
+
+    // Every bounce is rough, so only the primary hit comes from a packet
+    const std::vector<Sphere>& spheres = m_scene.spheres();
+    glm::vec3 light(0.0f);
+    glm::vec3 contribution(kStartContribution);
+    float weight = 1.0f;
+    for (int i = 0; i < kMaxBounces; i++) {
+        bounces++;
+        if (i > 0) hit = trace(ray);
+        if (hit.distance < 0.0f || hit.sphereIndex == -1) {
+            glm::vec3 skyColor(0.6f, 0.7f, 0.9f);
+            light += skyColor * contribution * weight;
+            break;
+        }
+        const glm::vec3& albedo = spheres[hit.sphereIndex].color;
+        float roughness = randVec3(0.0f, 0.02f, pixelCoord, frameCount, i).x;
+
+        contribution *= albedo;
+        if (hit.sphereIndex == 0 || hit.sphereIndex == 1 ||
+            hit.sphereIndex == 2) {
+            light += 2.0f * albedo * weight;
+        }
+        // Russian roulette, as Bounce() in trace.glsl
+        if (i + 1 >= int(m_rouletteDepth)) {
+            float throughput =
+                std::max(contribution.r,
+                         std::max(contribution.g, contribution.b)) /
+                kStartContribution;
+            float survival = std::clamp(throughput, kMinSurvival, 1.0f);
+            if (rand(pixelCoord, frameCount, kMaxBounces + 1 + i) >= survival) {
+                break;
+            }
+            weight /= survival;
+        }
+        ray.origin = hit.position + hit.normal * 0.0001f;
+        ray.direction = glm::reflect(
+            ray.direction,
+            hit.normal +
+                roughness * glm::normalize(randVec3(-1.0f, 1.0f, pixelCoord,
+                                                    frameCount, i)));
+    }
+    return light;
+}
+
+CpuRenderer::RayHit CpuRenderer::trace(const Ray& ray) const {
+    if (m_useBvh) {
+        // Bounces go every which way, the eight wide tree takes the fewest
+        // steps for them; packets stay on the binary tree for its culling
+        return resolveHit(
+            ray, intersectWideBvh(m_scene.wideBvh(), m_sphereSoA, ray.origin,
+                                  ray.direction, kPosInfinity, m_simdLevel));
+    }
+    return resolveHit(ray, m_intersectSpheres(m_sphereSoA, ray.origin,
+                                              ray.direction, kPosInfinity));
+}
+
+CpuRenderer::RayHit CpuRenderer::resolveHit(const Ray& ray,
+                                            const SphereHit& hit) const {
+    RayHit bestHit;
+    bestHit.position = glm::vec3(0.0f);
+    bestHit.normal = glm::vec3(0.0f);
+    bestHit.distance = hit.distance;
+    bestHit.sphereIndex = hit.index;
+    if (bestHit.sphereIndex != -1) {
+        const Sphere& sphere = m_scene.spheres()[bestHit.sphereIndex];
+        bestHit.position = ray.origin + bestHit.distance * ray.direction;
+        bestHit.normal = glm::normalize(bestHit.position - sphere.center);
+    }
+    return bestHit;
+}
+
+std::vector<uint8_t> CpuRenderer::readPixels() const {
+    // Same bytes as the GPU's display image, which headless runs save
+    std::vector<uint8_t> rgba(m_color.size() * 4);
+    m_scheduler.parallelFor(
+        static_cast<uint32_t>(m_color.size()), 16384,
+        [&](uint32_t begin, uint32_t end, unsigned) {
+            for (uint32_t i = begin; i < end; i++) {
+                for (int c = 0; c < 3; c++) {
+                    float value = resolveChannel(m_color[i][c]);
+                    rgba[size_t(i) * 4 + c] =
+                        static_cast<uint8_t>(value * 255.0f + 0.5f);
+                }
+                rgba[size_t(i) * 4 + 3] = 255;
+            }
+        });
+    return rgba;
+}
+
+void CpuRenderer::save(const std::string& path) const {
+    std::vector<uint8_t> rgba = readPixels();
+    writeImagePPM(path, m_width, m_height, rgba.data());
+}
@@ -11,9 +11,11 @@ Device::Device(const VkInstance& instance, const VkSurfaceKHR& surface)
     : m_instance(instance), m_surface(surface) {
     pickPhysicalDevice();
     createLogicalDevice();
+    m_allocator = std::make_unique<MemoryAllocator>(m_device, m_physicalDevice);
 }
 
 Device::~Device() {
+    m_allocator.reset();
     if (m_device != VK_NULL_HANDLE) {
         vkDestroyDevice(m_device, nullptr);
     }
@@ -24,15 +26,31 @@ bool Device::isDeviceSuitable(VkPhysicalDevice device) {
 
     bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = headless();
+    if (extensionsSupported && !headless()) {
         SwapChainSupportDetails swapChainSupport =
             querySwapChainSupport(device);
         swapChainAdequate = !swapChainSupport.formats.empty() &&
                             !swapChainSupport.presentModes.empty();
     }
 
-    return indices.isComplete() && extensionsSupported && swapChainAdequate;
+    return indices.isComplete() && extensionsSupported && swapChainAdequate &&
+           supportsTimelineSemaphores(device);
+}
+
+bool Device::supportsTimelineSemaphores(VkPhysicalDevice device) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (properties.apiVersion < VK_API_VERSION_1_2) return false;
+
+    VkPhysicalDeviceVulkan12Features vulkan12Features{};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &vulkan12Features;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+    return vulkan12Features.timelineSemaphore == VK_TRUE;
 }
 
 bool Device::checkDeviceExtensionSupport(VkPhysicalDevice device) {
@@ -44,8 +62,8 @@ bool Device::checkDeviceExtensionSupport(VkPhysicalDevice device) {
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
                                          availableExtensions.data());
 
-    std::set<std::string> requiredExtensions(config::deviceExtensions.begin(),
-                                             config::deviceExtensions.end());
+    std::set<std::string> requiredExtensions(enabledExtensions().begin(),
+                                             enabledExtensions().end());
 
     for (const auto& extension : availableExtensions) {
         requiredExtensions.erase(extension.extensionName);
@@ -54,6 +72,11 @@ bool Device::checkDeviceExtensionSupport(VkPhysicalDevice device) {
     return requiredExtensions.empty();
 }
 
+const std::vector<const char*>& Device::enabledExtensions() const {
+    static const std::vector<const char*> headlessExtensions;
+    return headless() ? headlessExtensions : config::deviceExtensions;
+}
+
 void Device::pickPhysicalDevice() {
     uint32_t deviceCount = 0;
     vkEnumeratePhysicalDevices(m_instance, &deviceCount, nullptr);
@@ -83,7 +106,7 @@ void Device::createLogicalDevice() {
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
     std::set<uint32_t> uniqueQueueFamilies = {
         indices.graphicsAndComputeFamily.value(),
-        indices.presentFamily.value()};
+        indices.presentFamily.value(), indices.computeFamily()};
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -95,7 +118,13 @@ void Device::createLogicalDevice() {
         queueCreateInfos.push_back(queueCreateInfo);
     }
 
+    // Pipeline statistics are only wanted by the profiler, so only enabled
+    // where they exist
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(m_physicalDevice, &supportedFeatures);
     VkPhysicalDeviceFeatures deviceFeatures{};
+    deviceFeatures.pipelineStatisticsQuery =
+        supportedFeatures.pipelineStatisticsQuery;
 
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -106,9 +135,15 @@ void Device::createLogicalDevice() {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
+    VkPhysicalDeviceVulkan12Features vulkan12Features{};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan12Features.timelineSemaphore = VK_TRUE;
+    createInfo.pNext = &vulkan12Features;
+
     createInfo.enabledExtensionCount =
-        static_cast<uint32_t>(config::deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = config::deviceExtensions.data();
+        static_cast<uint32_t>(enabledExtensions().size());
+    createInfo.ppEnabledExtensionNames = enabledExtensions().data();
 
     if (config::enableValidationLayers) {
         createInfo.enabledLayerCount =
@@ -122,11 +157,11 @@ void Device::createLogicalDevice() {
         VK_SUCCESS) {
         throw std::runtime_error("failed to create logical device!");
     }
+    m_enabledFeatures = deviceFeatures;
 
     vkGetDeviceQueue(m_device, indices.graphicsAndComputeFamily.value(), 0,
                      &m_graphicsQueue);
-    vkGetDeviceQueue(m_device, indices.graphicsAndComputeFamily.value(), 0,
-                     &m_computeQueue);
+    vkGetDeviceQueue(m_device, indices.computeFamily(), 0, &m_computeQueue);
     vkGetDeviceQueue(m_device, indices.presentFamily.value(), 0,
                      &m_presentQueue);
 }
@@ -150,8 +185,13 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device) {
         }
 
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, m_surface,
-                                             &presentSupport);
+        if (!headless()) {
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, m_surface,
+                                                 &presentSupport);
+        } else {
+            // Nothing is presented, the compute family stands in for present
+            presentSupport = indices.graphicsAndComputeFamily.has_value();
+        }
 
         if (presentSupport) {
             indices.presentFamily = i;
@@ -164,6 +204,19 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device) {
         i++;
     }
 
+    // Compute only families are usually separate hardware queues that run
+    // alongside graphics. Headless renders have no UI pass to overlap.
+    if (config::useAsyncCompute && !headless()) {
+        for (uint32_t family = 0; family < queueFamilyCount; family++) {
+            VkQueueFlags flags = queueFamilies[family].queueFlags;
+            if ((flags & VK_QUEUE_COMPUTE_BIT) &&
+                !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+                indices.asyncComputeFamily = family;
+                break;
+            }
+        }
+    }
+
     return indices;
 }
 
@@ -0,0 +1,295 @@
+#include "../includes/gpu_profiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include "../includes/config.hpp"
+#include "../includes/device_structures.hpp"
+#include "../includes/utils.hpp"
+
+namespace {
+constexpr uint32_t kStageCount = static_cast<uint32_t>(GpuStage::Count);
+
+static_assert(static_cast<int>(ProfilerMetric::UploadMs) == 0 &&
+                  static_cast<int>(ProfilerMetric::TraceMs) == 1 &&
+                  static_cast<int>(ProfilerMetric::ResolveMs) == 2 &&
+                  static_cast<int>(ProfilerMetric::InterfaceMs) == 3,
+              "stage metrics come first, in GpuStage order");
+
+uint32_t stageBit(GpuStage stage) {
+    return 1u << static_cast<uint32_t>(stage);
+}
+
+double millisecondsSince(std::chrono::high_resolution_clock::time_point start,
+                         std::chrono::high_resolution_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+}  // namespace
+
+const char* profilerMetricName(ProfilerMetric metric) {
+    switch (metric) {
+        case ProfilerMetric::UploadMs:
+            return "upload ms";
+        case ProfilerMetric::TraceMs:
+            return "trace ms";
+        case ProfilerMetric::ResolveMs:
+            return "resolve ms";
+        case ProfilerMetric::InterfaceMs:
+            return "ui ms";
+        case ProfilerMetric::GpuFrameMs:
+            return "gpu frame ms";
+        case ProfilerMetric::FrameMs:
+            return "frame ms";
+        case ProfilerMetric::Mrays:
+            return "Mrays/s";
+        case ProfilerMetric::Msamples:
+            return "Msamples/s";
+        case ProfilerMetric::CpuWaitMs:
+            return "cpu wait ms";
+        case ProfilerMetric::GpuIdleMs:
+            return "gpu idle ms";
+        case ProfilerMetric::FramesQueued:
+            return "frames queued";
+        case ProfilerMetric::LaneOccupancy:
+            return "lane occupancy %";
+        case ProfilerMetric::PathLength:
+            return "path length";
+        case ProfilerMetric::Count:
+            break;
+    }
+    return "unknown";
+}
+
+void ProfilerSeries::push(float value) {
+    values[offset] = value;
+    offset = (offset + 1) % kLength;
+    count = std::min(count + 1, kLength);
+}
+
+float ProfilerSeries::latest() const {
+    return values[(offset + kLength - 1) % kLength];
+}
+
+float ProfilerSeries::average() const {
+    if (count == 0) return 0.0f;
+    // the unwritten values are zero
+    return std::accumulate(values.begin(), values.end(), 0.0f) / count;
+}
+
+GpuProfiler::GpuProfiler(Device& device)
+    : m_device(device), m_slots(config::MAX_FRAMES_IN_FLIGHT) {
+    m_occupancyBuffers.resize(config::MAX_FRAMES_IN_FLIGHT);
+    m_occupancyBuffersMemory.resize(config::MAX_FRAMES_IN_FLIGHT);
+    for (uint32_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
+        createBuffer(m_device, sizeof(OccupancyCounters),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     MemoryCategory::Readback, m_occupancyBuffers[i],
+                     m_occupancyBuffersMemory[i]);
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(m_device.physicalDevice(), &properties);
+    QueueFamilyIndices indices =
+        m_device.findQueueFamilies(m_device.physicalDevice());
+    uint32_t familyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(m_device.physicalDevice(),
+                                             &familyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> families(familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(m_device.physicalDevice(),
+                                             &familyCount, families.data());
+    // Stages are written from the graphics and the compute family
+    uint32_t validBits = std::min(
+        families[indices.graphicsAndComputeFamily.value()].timestampValidBits,
+        families[indices.computeFamily()].timestampValidBits);
+    if (validBits == 0) return;
+
+    m_timestampPeriod = properties.limits.timestampPeriod;
+    m_timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+    VkQueryPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = config::MAX_FRAMES_IN_FLIGHT * kStageCount * 2;
+    if (vkCreateQueryPool(m_device.device(), &poolInfo, nullptr,
+                          &m_timestampPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timestamp query pool!");
+    }
+
+    if (m_device.enabledFeatures().pipelineStatisticsQuery) {
+        VkQueryPoolCreateInfo statisticsInfo{};
+        statisticsInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        statisticsInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        statisticsInfo.queryCount = config::MAX_FRAMES_IN_FLIGHT;
+        statisticsInfo.pipelineStatistics =
+            VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+        if (vkCreateQueryPool(m_device.device(), &statisticsInfo, nullptr,
+                              &m_statisticsPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create statistics query pool!");
+        }
+    }
+}
+
+GpuProfiler::~GpuProfiler() {
+    for (uint32_t i = 0; i < m_occupancyBuffers.size(); i++) {
+        destroyBuffer(m_device, m_occupancyBuffers[i],
+                      m_occupancyBuffersMemory[i]);
+    }
+    if (m_statisticsPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(m_device.device(), m_statisticsPool, nullptr);
+    }
+    if (m_timestampPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(m_device.device(), m_timestampPool, nullptr);
+    }
+}
+
+uint32_t GpuProfiler::timestampQuery(uint32_t slot, GpuStage stage) const {
+    return (slot * kStageCount + static_cast<uint32_t>(stage)) * 2;
+}
+
+void GpuProfiler::beginStage(VkCommandBuffer commandBuffer, uint32_t slot,
+                             GpuStage stage) {
+    if (!enabled()) return;
+    uint32_t query = timestampQuery(slot, stage);
+    vkCmdResetQueryPool(commandBuffer, m_timestampPool, query, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        m_timestampPool, query);
+    if (stage == GpuStage::Trace && statisticsEnabled()) {
+        vkCmdResetQueryPool(commandBuffer, m_statisticsPool, slot, 1);
+        vkCmdBeginQuery(commandBuffer, m_statisticsPool, slot, 0);
+    }
+}
+
+void GpuProfiler::endStage(VkCommandBuffer commandBuffer, uint32_t slot,
+                           GpuStage stage) {
+    if (!enabled()) return;
+    if (stage == GpuStage::Trace && statisticsEnabled()) {
+        vkCmdEndQuery(commandBuffer, m_statisticsPool, slot);
+    }
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        m_timestampPool, timestampQuery(slot, stage) + 1);
+}
+
+void GpuProfiler::resetOccupancy(VkCommandBuffer commandBuffer,
+                                 uint32_t slot) {
+    vkCmdFillBuffer(commandBuffer, m_occupancyBuffers[slot], 0,
+                    sizeof(OccupancyCounters), 0);
+}
+
+void GpuProfiler::submitted(uint32_t slot, GpuStage stage) {
+    m_slots[slot].stages |= stageBit(stage);
+}
+
+void GpuProfiler::collectOccupancy(uint32_t slot) {
+    // Coherent memory, and the frame's timeline value has been waited for
+    OccupancyCounters counters;
+    memcpy(&counters, m_occupancyBuffersMemory[slot].mapped,
+           sizeof(counters));
+    uint64_t active = (static_cast<uint64_t>(counters.activeHigh) << 32) |
+                      counters.activeLow;
+    uint64_t launched = (static_cast<uint64_t>(counters.launchedHigh) << 32) |
+                        counters.launchedLow;
+    if (launched == 0) return;
+    m_series[static_cast<size_t>(ProfilerMetric::LaneOccupancy)].push(
+        static_cast<float>(100.0 * active / launched));
+    // every lane that worked traced one bounce of one of the frame's paths
+    uint64_t paths = m_slots[slot].samples;
+    if (paths > 0) {
+        m_series[static_cast<size_t>(ProfilerMetric::PathLength)].push(
+            static_cast<float>(static_cast<double>(active) / paths));
+    }
+}
+
+void GpuProfiler::collect(uint32_t slot) {
+    FrameSlot& frame = m_slots[slot];
+    // counted by the shaders, with or without timestamps
+    if (frame.stages & stageBit(GpuStage::Trace)) collectOccupancy(slot);
+    if (!enabled() || frame.stages == 0) {
+        frame.stages = 0;
+        return;
+    }
+
+    // The frame has finished, every query submitted is available
+    double stageMs[kStageCount] = {};
+    uint64_t first = ~0ull;
+    uint64_t last = 0;
+    for (uint32_t s = 0; s < kStageCount; s++) {
+        GpuStage stage = static_cast<GpuStage>(s);
+        if (!(frame.stages & stageBit(stage))) continue;
+        uint64_t ticks[2];
+        if (vkGetQueryPoolResults(m_device.device(), m_timestampPool,
+                                  timestampQuery(slot, stage), 2,
+                                  sizeof(ticks), ticks, sizeof(uint64_t),
+                                  VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+            continue;
+        }
+        ticks[0] &= m_timestampMask;
+        ticks[1] &= m_timestampMask;
+        stageMs[s] = ((ticks[1] - ticks[0]) & m_timestampMask) *
+                     m_timestampPeriod / 1e6;
+        // only the durations compare across queues
+        if (stage == GpuStage::Interface && m_device.asyncCompute()) continue;
+        first = std::min(first, ticks[0]);
+        last = std::max(last, ticks[1]);
+    }
+    for (uint32_t s = 0; s < kStageCount; s++) {
+        m_series[s].push(static_cast<float>(stageMs[s]));
+    }
+    double gpuMs =
+        last >= first ? (last - first) * m_timestampPeriod / 1e6 : 0.0;
+    m_series[static_cast<size_t>(ProfilerMetric::GpuFrameMs)].push(
+        static_cast<float>(gpuMs));
+    // Frames are collected in submission order. A gap means the queue ran
+    // dry, the CPU did not submit far enough ahead.
+    if (last >= first) {
+        double idleMs = m_previousFrameEnd != 0 && first > m_previousFrameEnd
+                            ? (first - m_previousFrameEnd) *
+                                  m_timestampPeriod / 1e6
+                            : 0.0;
+        m_series[static_cast<size_t>(ProfilerMetric::GpuIdleMs)].push(
+            static_cast<float>(idleMs));
+        m_previousFrameEnd = last;
+    }
+
+    double traceMs = stageMs[static_cast<size_t>(GpuStage::Trace)];
+    double mrays = traceMs > 0.0 ? frame.samples / (traceMs * 1e3) : 0.0;
+    m_series[static_cast<size_t>(ProfilerMetric::Mrays)].push(
+        static_cast<float>(mrays));
+
+    if (statisticsEnabled() && (frame.stages & stageBit(GpuStage::Trace))) {
+        uint64_t invocations = 0;
+        if (vkGetQueryPoolResults(m_device.device(), m_statisticsPool, slot, 1,
+                                  sizeof(invocations), &invocations,
+                                  sizeof(invocations),
+                                  VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            m_shaderInvocations = invocations;
+        }
+    }
+    frame.stages = 0;
+}
+
+void GpuProfiler::recordPacing(double cpuWaitMs, uint64_t framesQueued) {
+    m_series[static_cast<size_t>(ProfilerMetric::CpuWaitMs)].push(
+        static_cast<float>(cpuWaitMs));
+    m_series[static_cast<size_t>(ProfilerMetric::FramesQueued)].push(
+        static_cast<float>(framesQueued));
+}
+
+void GpuProfiler::beginFrame(uint32_t slot, uint64_t samples) {
+    Clock::time_point now = Clock::now();
+    if (m_started) {
+        double frameMs = millisecondsSince(m_lastFrame, now);
+        m_series[static_cast<size_t>(ProfilerMetric::FrameMs)].push(
+            static_cast<float>(frameMs));
+        double msamples = frameMs > 0.0 ? samples / (frameMs * 1e3) : 0.0;
+        m_series[static_cast<size_t>(ProfilerMetric::Msamples)].push(
+            static_cast<float>(msamples));
+    }
+    m_lastFrame = now;
+    m_started = true;
+    m_slots[slot] = FrameSlot{0, samples};
+}
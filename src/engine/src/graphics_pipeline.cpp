@@ -1,17 +1,23 @@
 #include "../includes/graphics_pipeline.hpp"
 
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
 #include <stdexcept>
 
 #include "../includes/config.hpp"
 
 GraphicsPipeline::GraphicsPipeline(Device& device, SwapChain& swapChain,
                                    Instance& instance, GLFWwindow* window,
-                                   Scene& scene)
+                                   Scene& scene, GpuProfiler& profiler,
+                                   ResolvePass& resolvePass)
     : m_device(device),
       m_swapChain(swapChain),
       m_window(window),
       m_instance(instance),
-      m_scene(scene) {
+      m_scene(scene),
+      m_profiler(profiler),
+      m_resolvePass(resolvePass) {
     createCommandPool();
     createCommandBuffers();
     initImGui();
@@ -92,6 +98,55 @@ void GraphicsPipeline::render(uint32_t imageIndex, uint32_t currentFrame) {
     if (ImGui::Button("Reset frame count")) {
         m_scene.m_camera.frameCount = 0;
     }
+    // Same order as config::QualityPreset
+    const char* presets[] = {"Preview", "Interactive", "Full"};
+    int preset = static_cast<int>(m_qualityPreset);
+    if (ImGui::Combo("Quality", &preset, presets, IM_ARRAYSIZE(presets))) {
+        m_qualityPreset = static_cast<config::QualityPreset>(preset);
+        m_scene.m_camera.frameCount = 0;
+    }
+    // Same order as config::AccumulationFormat, switching restarts the
+    // accumulation
+    const char* formats[] = {"RGB32F (12 B)", "RGB16F (8 B)", "RGB9E5 (4 B)"};
+    int format = static_cast<int>(m_accumulationFormat);
+    if (ImGui::Combo("Accumulation", &format, formats,
+                     IM_ARRAYSIZE(formats))) {
+        m_accumulationFormat = static_cast<config::AccumulationFormat>(format);
+    }
+    // Same order as config::Integrator, both trace the same samples so the
+    // accumulation goes on. Compare their lane occupancy in the profiler.
+    const char* integrators[] = {"Megakernel", "Wavefront"};
+    int integrator = static_cast<int>(m_integrator);
+    if (ImGui::Combo("Integrator", &integrator, integrators,
+                     IM_ARRAYSIZE(integrators))) {
+        m_integrator = static_cast<config::Integrator>(integrator);
+    }
+    // More frames in flight keep the GPU busy, fewer cut input latency
+    int maxFramesInFlight = std::min<int>(config::MAX_FRAMES_IN_FLIGHT,
+                                          m_swapChain.imageCount());
+    ImGui::SliderInt("Frames in flight", &m_framesInFlight, 1,
+                     maxFramesInFlight);
+    // Only change how the traced image is displayed, accumulation goes on
+    const char* tonemappers[] = {"Clamp", "Reinhard", "ACES"};
+    int tonemapper = static_cast<int>(m_tonemap.tonemapper);
+    if (ImGui::Combo("Tonemapper", &tonemapper, tonemappers,
+                     IM_ARRAYSIZE(tonemappers))) {
+        m_tonemap.tonemapper = static_cast<config::Tonemapper>(tonemapper);
+    }
+    ImGui::SliderFloat("Exposure", &m_tonemap.exposure, 0.1f, 4.0f, "%.2f");
+    // Frames in between present the last trace again, at the resolve's cost
+    ImGui::SliderInt("Trace every N frames", &m_traceInterval, 1, 8);
+    // Only while the view is still, a frame takes about their product times
+    // as long to trace, and the UI is drawn once per frame
+    ImGui::SliderInt("Samples per pixel", &m_samplesPerPixel, 1, 16);
+    ImGui::SliderInt("Dispatches per frame", &m_dispatchesPerFrame, 1, 16);
+    // Paths past this many bounces may end early by Russian roulette, the
+    // image converges to the same result either way
+    ImGui::SliderInt("Roulette after bounce", &m_rouletteDepth, 1, 50);
+    // Above 0, tiles whose pixels are this close to their mean stop being
+    // traced, and once none are left frames only resolve
+    ImGui::SliderFloat("Noise threshold", &m_noiseThreshold, 0.0f, 0.1f,
+                       "%.3f");
     ImGui::SliderFloat("camera.x", &m_scene.m_camera.camera_position.x, -gap,
                        gap, "%.3f");
     ImGui::SliderFloat("camera.y", &m_scene.m_camera.camera_position.y, -gap,
@@ -107,20 +162,29 @@ void GraphicsPipeline::render(uint32_t imageIndex, uint32_t currentFrame) {
     for (int i = 0; i < m_scene.spheres().size(); i++) {
         ImGui::PushID(i);
         char label[32];
-        sprintf_s(label, "Object number %d", i);
+        snprintf(label, sizeof(label), "Object number %d", i);
         if (ImGui::CollapsingHeader(label)) {
             // if (ImGui::CollapsingHeader("Object number %d", i)) {
-            ImGui::SliderFloat("sphere.x", &m_scene.m_spheres[i].center.x,
-                               -10.0f, 10.0f, "%.3f");
-            ImGui::SliderFloat("sphere.y", &m_scene.m_spheres[i].center.y,
-                               -10.0f, 10.0f, "%.3f");
-            ImGui::SliderFloat("sphere.z", &m_scene.m_spheres[i].center.z,
-                               -10.0f, 10.0f, "%.3f");
+            bool moved = false;
+            moved |= ImGui::SliderFloat(
+                "sphere.x", &m_scene.m_spheres[i].center.x, -10.0f, 10.0f,
+                "%.3f");
+            moved |= ImGui::SliderFloat(
+                "sphere.y", &m_scene.m_spheres[i].center.y, -10.0f, 10.0f,
+                "%.3f");
+            moved |= ImGui::SliderFloat(
+                "sphere.z", &m_scene.m_spheres[i].center.z, -10.0f, 10.0f,
+                "%.3f");
+            if (moved) {
+                m_scene.markSphereDirty(i);
+            }
         }
         ImGui::PopID();
     }
+    m_scene.updateBvh();
     ImGui::Separator();
     ImGui::End();
+    showProfiler();
 
     ImGui::Render();
     ImGuiIO& io = ImGui::GetIO();
@@ -129,8 +193,44 @@ void GraphicsPipeline::render(uint32_t imageIndex, uint32_t currentFrame) {
         ImGui::UpdatePlatformWindows();
         ImGui::RenderPlatformWindowsDefault();
     }
-    vkResetCommandBuffer(m_commandBuffers[currentFrame], 0);
-    recordCommandBuffer(m_commandBuffers[currentFrame], imageIndex);
+    // Recorded every frame: ImGui uploads the vertices into the next of its
+    // imageCount buffers, and no more frames than that are in flight. The
+    // slot's previous frame is done with its command buffer.
+    VkCommandBuffer commandBuffer = m_commandBuffers[currentFrame];
+    vkResetCommandBuffer(commandBuffer, 0);
+    recordCommandBuffer(commandBuffer, imageIndex, currentFrame);
+    m_profiler.submitted(currentFrame, GpuStage::Interface);
+}
+
+void GraphicsPipeline::showProfiler() {
+    ImGui::Begin("Performance");
+    if (!m_profiler.enabled()) {
+        ImGui::Text("No GPU timestamps on this queue");
+    }
+    ImGui::Text(m_device.asyncCompute() ? "Tracing on an async compute queue"
+                                        : "Tracing on the graphics queue");
+    // ms per stage, then frame rate and throughput
+    for (int m = 0; m < static_cast<int>(ProfilerMetric::Count); m++) {
+        ProfilerMetric metric = static_cast<ProfilerMetric>(m);
+        const ProfilerSeries& series = m_profiler.series(metric);
+        char overlay[32];
+        snprintf(overlay, sizeof(overlay), "%.2f", series.latest());
+        ImGui::PlotLines(profilerMetricName(metric), series.values.data(),
+                         ProfilerSeries::kLength, series.offset, overlay,
+                         0.0f, FLT_MAX, ImVec2(0.0f, 40.0f));
+    }
+    float frameMs = m_profiler.series(ProfilerMetric::FrameMs).average();
+    ImGui::Text("%.1f fps", frameMs > 0.0f ? 1000.0f / frameMs : 0.0f);
+    if (m_profiler.statisticsEnabled()) {
+        ImGui::Text("Compute invocations: %llu",
+                    static_cast<unsigned long long>(
+                        m_profiler.shaderInvocations()));
+    }
+    ImGui::End();
+}
+
+void GraphicsPipeline::setFramesInFlight(uint32_t count) {
+    m_framesInFlight = static_cast<int>(count);
 }
 
 GraphicsPipeline::~GraphicsPipeline() {
@@ -166,7 +266,7 @@ void GraphicsPipeline::createCommandPool() {
 }
 
 void GraphicsPipeline::createCommandBuffers() {
-    m_commandBuffers.resize(m_swapChain.imageCount());
+    m_commandBuffers.resize(config::MAX_FRAMES_IN_FLIGHT);
 
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -182,7 +282,8 @@ void GraphicsPipeline::createCommandBuffers() {
 }
 
 void GraphicsPipeline::recordCommandBuffer(VkCommandBuffer commandBuffer,
-                                           uint32_t imageIndex) {
+                                           uint32_t imageIndex,
+                                           uint32_t currentFrame) {
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = 0;
@@ -201,6 +302,14 @@ void GraphicsPipeline::recordCommandBuffer(VkCommandBuffer commandBuffer,
 
     renderPassInfo.pClearValues = nullptr;
 
+    // The query reset has to stay outside the render pass
+    m_profiler.beginStage(commandBuffer, currentFrame, GpuStage::Interface);
+    if (m_device.asyncCompute()) {
+        // The resolve ran on the compute queue, the copy into the swap
+        // chain image is done here
+        m_resolvePass.recordGraphicsCopy(commandBuffer, imageIndex,
+                                         currentFrame);
+    }
     vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
                          VK_SUBPASS_CONTENTS_INLINE);
 
@@ -208,6 +317,7 @@ void GraphicsPipeline::recordCommandBuffer(VkCommandBuffer commandBuffer,
     ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), commandBuffer);
 
     vkCmdEndRenderPass(commandBuffer);
+    m_profiler.endStage(commandBuffer, currentFrame, GpuStage::Interface);
 
     if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
@@ -6,22 +6,32 @@
 Instance::Instance(GLFWwindow* window) : m_window(window) {
     createInstance();
     setupDebugMessenger();
-    createSurface();
+    if (m_window != nullptr) {
+        createSurface();
+    }
 }
 
 Instance::~Instance() {
-    DestroyDebugUtilsMessengerEXT(m_instance, m_debugMessenger, nullptr);
-    vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
+    if (m_debugMessenger != VK_NULL_HANDLE) {
+        DestroyDebugUtilsMessengerEXT(m_instance, m_debugMessenger, nullptr);
+    }
+    if (m_surface != VK_NULL_HANDLE) {
+        vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
+    }
     vkDestroyInstance(m_instance, nullptr);
 }
 
 std::vector<const char*> Instance::getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions,
-                                        glfwExtensions + glfwExtensionCount);
+    std::vector<const char*> extensions;
+
+    // Surface extensions are only needed when presenting to a window
+    if (m_window != nullptr) {
+        uint32_t glfwExtensionCount = 0;
+        const char** glfwExtensions;
+        glfwExtensions =
+            glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 
     if (config::enableValidationLayers) {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -81,7 +91,8 @@ void Instance::createInstance() {
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    // timeline semaphores pace the frames
+    appInfo.apiVersion = VK_API_VERSION_1_2;
 
     VkInstanceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
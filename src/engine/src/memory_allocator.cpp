@@ -0,0 +1,335 @@
+#include "../includes/memory_allocator.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+
+struct MemoryBlock {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t memoryType = 0;
+    bool linear = true;
+    // holds a single resource too large to share a block
+    bool dedicated = false;
+    uint8_t* mapped = nullptr;
+    // live ranges by offset
+    std::map<VkDeviceSize, MovableAllocation> allocations;
+
+    // free ranges as offset -> size, and the same ranges as size -> offset
+    std::map<VkDeviceSize, VkDeviceSize> freeByOffset;
+    std::multimap<VkDeviceSize, VkDeviceSize> freeBySize;
+};
+
+namespace {
+constexpr VkDeviceSize kDefaultBlockSize = 64ull << 20;
+constexpr VkDeviceSize kSmallHeapSize = 1ull << 30;
+
+VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return alignment > 1 ? (value + alignment - 1) / alignment * alignment
+                         : value;
+}
+
+void eraseFreeRange(MemoryBlock& block,
+                    std::map<VkDeviceSize, VkDeviceSize>::iterator range) {
+    auto bySize = block.freeBySize.equal_range(range->second);
+    for (auto it = bySize.first; it != bySize.second; ++it) {
+        if (it->second == range->first) {
+            block.freeBySize.erase(it);
+            break;
+        }
+    }
+    block.freeByOffset.erase(range);
+}
+
+// Returns the range to the block, merged with the free ranges either side
+void addFreeRange(MemoryBlock& block, VkDeviceSize offset, VkDeviceSize size) {
+    if (size == 0) return;
+    auto next = block.freeByOffset.lower_bound(offset);
+    if (next != block.freeByOffset.end() && offset + size == next->first) {
+        size += next->second;
+        eraseFreeRange(block, next);
+    }
+    auto previous = block.freeByOffset.lower_bound(offset);
+    if (previous != block.freeByOffset.begin()) {
+        --previous;
+        if (previous->first + previous->second == offset) {
+            offset = previous->first;
+            size += previous->second;
+            eraseFreeRange(block, previous);
+        }
+    }
+    block.freeByOffset.emplace(offset, size);
+    block.freeBySize.emplace(size, offset);
+}
+
+// Best fit: the smallest free range that still fits once aligned
+bool suballocate(MemoryBlock& block, const VkMemoryRequirements& requirements,
+                 MemoryCategory category, Allocation& allocation) {
+    for (auto it = block.freeBySize.lower_bound(requirements.size);
+         it != block.freeBySize.end(); ++it) {
+        VkDeviceSize rangeOffset = it->second;
+        VkDeviceSize rangeSize = it->first;
+        VkDeviceSize offset = alignUp(rangeOffset, requirements.alignment);
+        if (offset + requirements.size > rangeOffset + rangeSize) continue;
+
+        eraseFreeRange(block, block.freeByOffset.find(rangeOffset));
+        // the padding and the tail go back as ranges of their own
+        addFreeRange(block, rangeOffset, offset - rangeOffset);
+        addFreeRange(block, offset + requirements.size,
+                     rangeOffset + rangeSize - offset - requirements.size);
+
+        allocation.memory = block.memory;
+        allocation.offset = offset;
+        allocation.size = requirements.size;
+        allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+        allocation.category = category;
+        allocation.block = &block;
+        block.allocations.emplace(
+            offset, MovableAllocation{offset, requirements.size, category});
+        return true;
+    }
+    return false;
+}
+}  // namespace
+
+const char* memoryCategoryName(MemoryCategory category) {
+    switch (category) {
+        case MemoryCategory::SceneBuffers:
+            return "scene";
+        case MemoryCategory::Staging:
+            return "staging";
+        case MemoryCategory::Uniforms:
+            return "uniforms";
+        case MemoryCategory::Images:
+            return "images";
+        case MemoryCategory::TraceBuffers:
+            return "trace";
+        case MemoryCategory::Readback:
+            return "readback";
+        case MemoryCategory::Count:
+            break;
+    }
+    return "unknown";
+}
+
+MemoryAllocator::MemoryAllocator(VkDevice device,
+                                 VkPhysicalDevice physicalDevice)
+    : m_device(device) {
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memoryProperties);
+}
+
+MemoryAllocator::~MemoryAllocator() {
+    for (const auto& block : m_blocks) {
+        if (block->mapped) vkUnmapMemory(m_device, block->memory);
+        vkFreeMemory(m_device, block->memory, nullptr);
+    }
+}
+
+uint32_t MemoryAllocator::findMemoryType(
+    uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; i++) {
+        if ((typeFilter & (1 << i)) &&
+            (m_memoryProperties.memoryTypes[i].propertyFlags & properties) ==
+                properties) {
+            return i;
+        }
+    }
+
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+VkDeviceSize MemoryAllocator::blockSize(uint32_t memoryType) const {
+    uint32_t heap = m_memoryProperties.memoryTypes[memoryType].heapIndex;
+    VkDeviceSize heapSize = m_memoryProperties.memoryHeaps[heap].size;
+    // small heaps, such as the host visible window into VRAM, get an eighth
+    return heapSize <= kSmallHeapSize ? heapSize / 8 : kDefaultBlockSize;
+}
+
+Allocation MemoryAllocator::allocateBuffer(VkBuffer buffer,
+                                           VkMemoryPropertyFlags properties,
+                                           MemoryCategory category) {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(m_device, buffer, &requirements);
+    Allocation allocation = allocate(requirements, properties, category, true);
+    if (vkBindBufferMemory(m_device, buffer, allocation.memory,
+                           allocation.offset) != VK_SUCCESS) {
+        free(allocation);
+        throw std::runtime_error("failed to bind buffer memory!");
+    }
+    return allocation;
+}
+
+Allocation MemoryAllocator::allocateImage(VkImage image,
+                                          VkMemoryPropertyFlags properties,
+                                          MemoryCategory category) {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(m_device, image, &requirements);
+    Allocation allocation = allocate(requirements, properties, category, false);
+    if (vkBindImageMemory(m_device, image, allocation.memory,
+                          allocation.offset) != VK_SUCCESS) {
+        free(allocation);
+        throw std::runtime_error("failed to bind image memory!");
+    }
+    return allocation;
+}
+
+Allocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+                                     VkMemoryPropertyFlags properties,
+                                     MemoryCategory category, bool linear) {
+    uint32_t memoryType =
+        findMemoryType(requirements.memoryTypeBits, properties);
+    VkDeviceSize size = blockSize(memoryType);
+
+    Allocation allocation;
+    if (requirements.size <= size / 2) {
+        for (const auto& block : m_blocks) {
+            if (block->dedicated || block->memoryType != memoryType ||
+                block->linear != linear) {
+                continue;
+            }
+            if (suballocate(*block, requirements, category, allocation)) {
+                break;
+            }
+        }
+        if (!allocation.block) {
+            MemoryBlock* block = createBlock(memoryType, size, linear, false);
+            if (block) {
+                suballocate(*block, requirements, category, allocation);
+            }
+        }
+    }
+    // Too large to share, or no room left for another block
+    if (!allocation.block) {
+        MemoryBlock* block =
+            createBlock(memoryType, requirements.size, linear, true);
+        if (!block) {
+            throw std::runtime_error("failed to allocate device memory!");
+        }
+        suballocate(*block, requirements, category, allocation);
+    }
+
+    size_t index = static_cast<size_t>(category);
+    m_usedBytes[index] += allocation.size;
+    m_allocationCount[index]++;
+    return allocation;
+}
+
+void MemoryAllocator::free(Allocation& allocation) {
+    MemoryBlock* block = allocation.block;
+    if (!block) return;
+    size_t index = static_cast<size_t>(allocation.category);
+    m_usedBytes[index] -= allocation.size;
+    m_allocationCount[index]--;
+
+    block->allocations.erase(allocation.offset);
+    addFreeRange(*block, allocation.offset, allocation.size);
+    allocation = Allocation{};
+    if (!block->allocations.empty()) return;
+
+    // One empty block per pool is kept, so a resource recreated on every
+    // resize does not allocate device memory each time
+    bool spare = std::any_of(
+        m_blocks.begin(), m_blocks.end(),
+        [block](const std::unique_ptr<MemoryBlock>& other) {
+            return other.get() != block && !other->dedicated &&
+                   other->allocations.empty() &&
+                   other->memoryType == block->memoryType &&
+                   other->linear == block->linear;
+        });
+    if (block->dedicated || spare) destroyBlock(block);
+}
+
+MemoryBlock* MemoryAllocator::createBlock(uint32_t memoryType,
+                                          VkDeviceSize size, bool linear,
+                                          bool dedicated) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(m_device, &allocInfo, nullptr, &memory) !=
+        VK_SUCCESS) {
+        return nullptr;
+    }
+    m_deviceAllocations++;
+
+    auto block = std::make_unique<MemoryBlock>();
+    block->memory = memory;
+    block->size = size;
+    block->memoryType = memoryType;
+    block->linear = linear;
+    block->dedicated = dedicated;
+    if (m_memoryProperties.memoryTypes[memoryType].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void* mapped;
+        if (vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &mapped) !=
+            VK_SUCCESS) {
+            vkFreeMemory(m_device, memory, nullptr);
+            throw std::runtime_error("failed to map device memory!");
+        }
+        block->mapped = static_cast<uint8_t*>(mapped);
+    }
+    addFreeRange(*block, 0, size);
+    m_blocks.push_back(std::move(block));
+    return m_blocks.back().get();
+}
+
+void MemoryAllocator::destroyBlock(MemoryBlock* block) {
+    if (block->mapped) vkUnmapMemory(m_device, block->memory);
+    vkFreeMemory(m_device, block->memory, nullptr);
+    m_blocks.erase(std::find_if(
+        m_blocks.begin(), m_blocks.end(),
+        [block](const std::unique_ptr<MemoryBlock>& other) {
+            return other.get() == block;
+        }));
+}
+
+MemoryStats MemoryAllocator::stats() const {
+    MemoryStats stats;
+    stats.deviceAllocations = m_deviceAllocations;
+    for (const auto& block : m_blocks) {
+        stats.reservedBytes += block->size;
+        if (block->dedicated) {
+            stats.dedicatedCount++;
+            continue;
+        }
+        stats.blockCount++;
+        for (const auto& range : block->freeByOffset) {
+            stats.freeBytes += range.second;
+        }
+        if (!block->freeBySize.empty()) {
+            stats.largestFreeRange = std::max(
+                stats.largestFreeRange, block->freeBySize.rbegin()->first);
+        }
+    }
+    std::copy(std::begin(m_usedBytes), std::end(m_usedBytes),
+              std::begin(stats.usedBytes));
+    std::copy(std::begin(m_allocationCount), std::end(m_allocationCount),
+              std::begin(stats.allocationCount));
+    return stats;
+}
+
+std::vector<FragmentedBlock> MemoryAllocator::fragmentedBlocks() const {
+    std::vector<FragmentedBlock> blocks;
+    for (const auto& block : m_blocks) {
+        if (block->dedicated || block->freeByOffset.size() < 2) continue;
+        FragmentedBlock fragmented;
+        fragmented.memory = block->memory;
+        fragmented.size = block->size;
+        for (const auto& range : block->freeByOffset) {
+            fragmented.freeBytes += range.second;
+        }
+        fragmented.largestFreeRange = block->freeBySize.rbegin()->first;
+        for (const auto& allocation : block->allocations) {
+            fragmented.allocations.push_back(allocation.second);
+        }
+        blocks.push_back(std::move(fragmented));
+    }
+    std::sort(blocks.begin(), blocks.end(),
+              [](const FragmentedBlock& a, const FragmentedBlock& b) {
+                  return a.freeBytes > b.freeBytes;
+              });
+    return blocks;
+}
@@ -0,0 +1,198 @@
+#include "../includes/offscreen_target.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "../includes/device_structures.hpp"
+#include "../includes/utils.hpp"
+
+OffscreenTarget::OffscreenTarget(Device& device, uint32_t width,
+                                 uint32_t height)
+    : m_device(device), m_extent{width, height} {
+    createImage();
+    createCommandPool();
+}
+
+OffscreenTarget::~OffscreenTarget() {
+    for (auto imageView : m_imageViews) {
+        vkDestroyImageView(m_device.device(), imageView, nullptr);
+    }
+    for (auto image : m_images) {
+        vkDestroyImage(m_device.device(), image, nullptr);
+    }
+    m_device.allocator().free(m_imageMemory);
+    if (m_commandPool != VK_NULL_HANDLE) {
+        vkDestroyCommandPool(m_device.device(), m_commandPool, nullptr);
+    }
+}
+
+void OffscreenTarget::createImage() {
+    m_images.resize(1);
+    m_imageViews.resize(1);
+
+    // ResolvePass copies the tonemapped frame in and leaves the image in
+    // COLOR_ATTACHMENT_OPTIMAL, so it needs the attachment usage even though
+    // nothing is rasterized into it.
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+    imageInfo.extent.width = m_extent.width;
+    imageInfo.extent.height = m_extent.height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                      VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (vkCreateImage(m_device.device(), &imageInfo, nullptr, &m_images[0]) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create offscreen image!");
+    }
+
+    m_imageMemory = m_device.allocator().allocateImage(
+        m_images[0], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        MemoryCategory::Images);
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = m_images[0];
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    if (vkCreateImageView(m_device.device(), &viewInfo, nullptr,
+                          &m_imageViews[0]) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create offscreen image view!");
+    }
+}
+
+void OffscreenTarget::createCommandPool() {
+    QueueFamilyIndices queueFamilyIndices =
+        m_device.findQueueFamilies(m_device.physicalDevice());
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex =
+        queueFamilyIndices.graphicsAndComputeFamily.value();
+
+    if (vkCreateCommandPool(m_device.device(), &poolInfo, nullptr,
+                            &m_commandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create offscreen command pool!");
+    }
+}
+
+std::vector<uint8_t> OffscreenTarget::readPixels() {
+    VkDeviceSize size =
+        static_cast<VkDeviceSize>(m_extent.width) * m_extent.height * 4;
+
+    VkBuffer stagingBuffer;
+    Allocation stagingBufferMemory;
+    createBuffer(m_device, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 MemoryCategory::Readback, stagingBuffer, stagingBufferMemory);
+
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = m_commandPool;
+    allocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(m_device.device(), &allocInfo, &commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+    // The image arrives in COLOR_ATTACHMENT_OPTIMAL, last written by the UI
+    // pass or, in a frame that only resolves, by the resolve's copy and the
+    // transition after it, which completes by COLOR_ATTACHMENT_OUTPUT
+    VkImageMemoryBarrier toTransfer{};
+    toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    toTransfer.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.image = m_images[0];
+    toTransfer.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    toTransfer.subresourceRange.baseMipLevel = 0;
+    toTransfer.subresourceRange.levelCount = 1;
+    toTransfer.subresourceRange.baseArrayLayer = 0;
+    toTransfer.subresourceRange.layerCount = 1;
+    toTransfer.srcAccessMask =
+        VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT |
+                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 1, &toTransfer);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {m_extent.width, m_extent.height, 1};
+
+    vkCmdCopyImageToBuffer(commandBuffer, m_images[0],
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, stagingBuffer,
+                           1, &region);
+
+    // Make the copy visible to the host
+    VkBufferMemoryBarrier toHost{};
+    toHost.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    toHost.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    toHost.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    toHost.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toHost.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toHost.buffer = stagingBuffer;
+    toHost.offset = 0;
+    toHost.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &toHost,
+                         0, nullptr);
+
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    vkQueueSubmit(m_device.computeQueue(), 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(m_device.computeQueue());
+
+    vkFreeCommandBuffers(m_device.device(), m_commandPool, 1, &commandBuffer);
+
+    std::vector<uint8_t> pixels(static_cast<size_t>(size));
+    memcpy(pixels.data(), stagingBufferMemory.mapped,
+           static_cast<size_t>(size));
+    destroyBuffer(m_device, stagingBuffer, stagingBufferMemory);
+
+    return pixels;
+}
+
+void OffscreenTarget::save(const std::string& path) {
+    std::vector<uint8_t> pixels = readPixels();
+    writeImagePPM(path, m_extent.width, m_extent.height, pixels.data());
+}
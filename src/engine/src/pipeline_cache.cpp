@@ -0,0 +1,161 @@
+#include "../includes/pipeline_cache.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+constexpr uint32_t kMagic = 0x43505452;  // "RTPC"
+constexpr uint32_t kVersion = 1;
+
+using Clock = std::chrono::high_resolution_clock;
+
+double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+}
+
+// Writes next to path and renames over it, which replaces the file at once
+void writeAtomically(const std::string& path, const std::vector<char>& bytes) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        if (!file) {
+            std::cerr << "failed to write pipeline cache " << temporary
+                      << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::cerr << "failed to replace pipeline cache " << path << ": "
+                  << error.message() << std::endl;
+    }
+}
+}  // namespace
+
+PipelineCache::PipelineCache(Device& device, std::string path)
+    : m_device(device), m_path(std::move(path)) {
+    vkGetPhysicalDeviceProperties(m_device.physicalDevice(), &m_properties);
+
+    auto start = Clock::now();
+    std::vector<char> data = load();
+
+    VkPipelineCacheCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = data.size();
+    createInfo.pInitialData = data.empty() ? nullptr : data.data();
+    if (vkCreatePipelineCache(m_device.device(), &createInfo, nullptr,
+                              &m_cache) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline cache!");
+    }
+    m_stats.loadedBytes = data.size();
+    m_stats.loadMs = millisecondsSince(start);
+}
+
+PipelineCache::~PipelineCache() {
+    waitForSave();
+    if (m_dirty) save();
+    vkDestroyPipelineCache(m_device.device(), m_cache, nullptr);
+}
+
+std::vector<char> PipelineCache::load() {
+    std::ifstream file(m_path, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) return {};
+    size_t fileSize = static_cast<size_t>(file.tellg());
+    file.seekg(0);
+
+    FileHeader header{};
+    FileHeader expected = deviceHeader();
+    if (fileSize < sizeof(header) ||
+        !file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        m_stats.rejected = true;
+        return {};
+    }
+    // dataSize is compared too, a short file is a torn write
+    expected.dataSize = fileSize - sizeof(header);
+    if (std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        m_stats.rejected = true;
+        return {};
+    }
+
+    std::vector<char> data(header.dataSize);
+    if (!file.read(data.data(), static_cast<std::streamsize>(data.size()))) {
+        m_stats.rejected = true;
+        return {};
+    }
+    return data;
+}
+
+PipelineCache::FileHeader PipelineCache::deviceHeader() const {
+    // zeroed first so the padding compares equal too
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.vendorID = m_properties.vendorID;
+    header.deviceID = m_properties.deviceID;
+    header.driverVersion = m_properties.driverVersion;
+    std::memcpy(header.pipelineCacheUUID, m_properties.pipelineCacheUUID,
+                VK_UUID_SIZE);
+    return header;
+}
+
+VkPipeline PipelineCache::createComputePipeline(
+    const VkComputePipelineCreateInfo& info) {
+    auto start = Clock::now();
+    VkPipeline pipeline;
+    if (vkCreateComputePipelines(m_device.device(), m_cache, 1, &info, nullptr,
+                                 &pipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create compute pipeline!");
+    }
+    m_stats.pipelinesCreated++;
+    m_stats.createMs += millisecondsSince(start);
+    m_dirty = true;
+    return pipeline;
+}
+
+std::vector<char> PipelineCache::serialise() {
+    size_t dataSize = 0;
+    vkGetPipelineCacheData(m_device.device(), m_cache, &dataSize, nullptr);
+    std::vector<char> bytes(sizeof(FileHeader) + dataSize);
+    // no throwing, this also runs from the destructor
+    if (vkGetPipelineCacheData(m_device.device(), m_cache, &dataSize,
+                               bytes.data() + sizeof(FileHeader)) !=
+        VK_SUCCESS) {
+        std::cerr << "failed to read pipeline cache data" << std::endl;
+        return {};
+    }
+    bytes.resize(sizeof(FileHeader) + dataSize);
+    FileHeader header = deviceHeader();
+    header.dataSize = dataSize;
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    m_dirty = false;
+    return bytes;
+}
+
+void PipelineCache::save() {
+    waitForSave();
+    std::vector<char> bytes = serialise();
+    if (!bytes.empty()) writeAtomically(m_path, bytes);
+}
+
+void PipelineCache::saveIfChanged() {
+    if (!m_dirty) return;
+    // one write at a time, they share the temporary file
+    waitForSave();
+    std::vector<char> bytes = serialise();
+    if (bytes.empty()) return;
+    m_pendingSave = std::async(std::launch::async, writeAtomically, m_path,
+                               std::move(bytes));
+}
+
+void PipelineCache::waitForSave() {
+    if (m_pendingSave.valid()) m_pendingSave.get();
+}
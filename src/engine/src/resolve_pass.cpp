@@ -0,0 +1,543 @@
+#include "../includes/resolve_pass.hpp"
+
+#include <array>
+#include <stdexcept>
+
+#include "../includes/device_structures.hpp"
+#include "../includes/utils.hpp"
+
+namespace {
+constexpr uint32_t kWorkgroupSize = 8;
+constexpr VkFormat kHdrFormat = VK_FORMAT_R32G32B32A32_SFLOAT;
+constexpr VkFormat kDisplayFormat = VK_FORMAT_R8G8B8A8_UNORM;
+
+// 8-bit RGBA formats, whose texels take the display image's bytes as they
+// are. An sRGB view of the bytes is what tonemap.comp already encodes.
+bool copiesDisplayImage(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+        case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool swapsRedBlue(VkFormat format) {
+    return format == VK_FORMAT_B8G8R8A8_UNORM ||
+           format == VK_FORMAT_B8G8R8A8_SRGB;
+}
+
+VkImageMemoryBarrier imageBarrier(VkImage image, VkImageLayout oldLayout,
+                                  VkImageLayout newLayout,
+                                  VkAccessFlags srcAccess,
+                                  VkAccessFlags dstAccess) {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+    return barrier;
+}
+
+void createImage(Device& device, VkFormat format, VkExtent2D extent,
+                 VkImageUsageFlags usage, VkImage& image,
+                 Allocation& allocation, VkImageView& view) {
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = extent.width;
+    imageInfo.extent.height = extent.height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = usage;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (vkCreateImage(device.device(), &imageInfo, nullptr, &image) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create resolve image!");
+    }
+    allocation = device.allocator().allocateImage(
+        image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MemoryCategory::Images);
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    if (vkCreateImageView(device.device(), &viewInfo, nullptr, &view) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create resolve image view!");
+    }
+}
+
+void destroyImage(Device& device, VkImage& image, Allocation& allocation,
+                  VkImageView& view) {
+    if (view != VK_NULL_HANDLE) {
+        vkDestroyImageView(device.device(), view, nullptr);
+    }
+    if (image != VK_NULL_HANDLE) {
+        vkDestroyImage(device.device(), image, nullptr);
+    }
+    device.allocator().free(allocation);
+    view = VK_NULL_HANDLE;
+    image = VK_NULL_HANDLE;
+}
+}  // namespace
+
+ResolvePass::ResolvePass(Device& device, RenderTarget& target,
+                         GpuProfiler& profiler, PipelineCache& pipelineCache)
+    : m_device(device),
+      m_target(target),
+      m_profiler(profiler),
+      m_pipelineCache(pipelineCache) {
+    createDescriptorSetLayout();
+    createPipeline();
+    createCommandPool();
+    createImages();
+    createDescriptorSets();
+    writeDescriptorSets();
+    createCommandBuffers();
+}
+
+ResolvePass::~ResolvePass() {
+    destroyImages();
+    vkDestroyDescriptorPool(m_device.device(), m_descriptorPool, nullptr);
+    vkDestroyPipeline(m_device.device(), m_pipeline, nullptr);
+    vkDestroyPipelineLayout(m_device.device(), m_pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(m_device.device(), m_descriptorSetLayout,
+                                 nullptr);
+    vkDestroyCommandPool(m_device.device(), m_commandPool, nullptr);
+}
+
+void ResolvePass::windowResized() {
+    vkDeviceWaitIdle(m_device.device());
+    destroyImages();
+    createImages();
+    writeDescriptorSets();
+    // the target may have a different image count, and every recording
+    // references the old images
+    createCommandBuffers();
+}
+
+void ResolvePass::createDescriptorSetLayout() {
+    std::array<VkDescriptorSetLayoutBinding, 2> layoutBindings{};
+
+    // Binding 0: HDR image (hdrImage)
+    layoutBindings[0].binding = 0;
+    layoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    layoutBindings[0].descriptorCount = 1;
+    layoutBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    // Binding 1: Display image (displayImage)
+    layoutBindings[1].binding = 1;
+    layoutBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    layoutBindings[1].descriptorCount = 1;
+    layoutBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+    layoutInfo.pBindings = layoutBindings.data();
+
+    if (vkCreateDescriptorSetLayout(m_device.device(), &layoutInfo, nullptr,
+                                    &m_descriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error(
+            "failed to create resolve descriptor set layout!");
+    }
+}
+
+void ResolvePass::createPipeline() {
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(ResolvePushConstants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &m_descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    if (vkCreatePipelineLayout(m_device.device(), &pipelineLayoutInfo, nullptr,
+                               &m_pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create resolve pipeline layout!");
+    }
+
+    auto shaderCode = readFile("../res/shaders/tonemap.spv");
+    VkShaderModule shaderModule =
+        createShaderModule(m_device.device(), shaderCode);
+
+    VkPipelineShaderStageCreateInfo shaderStageInfo{};
+    shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    shaderStageInfo.module = shaderModule;
+    shaderStageInfo.pName = "main";
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = m_pipelineLayout;
+    pipelineInfo.stage = shaderStageInfo;
+
+    m_pipeline = m_pipelineCache.createComputePipeline(pipelineInfo);
+    vkDestroyShaderModule(m_device.device(), shaderModule, nullptr);
+}
+
+void ResolvePass::createCommandPool() {
+    QueueFamilyIndices queueFamilyIndices =
+        m_device.findQueueFamilies(m_device.physicalDevice());
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.computeFamily();
+
+    if (vkCreateCommandPool(m_device.device(), &poolInfo, nullptr,
+                            &m_commandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create command pool!");
+    }
+}
+
+void ResolvePass::createImages() {
+    VkExtent2D extent = m_target.extent();
+    createImage(m_device, kHdrFormat, extent,
+                VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                m_hdrImage, m_hdrImageMemory, m_hdrImageView);
+    m_displayImages.assign(config::MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+    m_displayImagesMemory.assign(config::MAX_FRAMES_IN_FLIGHT, {});
+    m_displayImageViews.assign(config::MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+    for (size_t i = 0; i < config::MAX_FRAMES_IN_FLIGHT; i++) {
+        createImage(m_device, kDisplayFormat, extent,
+                    VK_IMAGE_USAGE_STORAGE_BIT |
+                        VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                    m_displayImages[i], m_displayImagesMemory[i],
+                    m_displayImageViews[i]);
+    }
+
+    // The HDR image stays in GENERAL. Display images are discarded by
+    // every resolve, so they start each frame from UNDEFINED.
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = m_commandPool;
+    allocInfo.commandBufferCount = 1;
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(m_device.device(), &allocInfo, &commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    VkImageMemoryBarrier toGeneral = imageBarrier(
+        m_hdrImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+            VK_ACCESS_TRANSFER_WRITE_BIT);
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &toGeneral);
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    vkQueueSubmit(m_device.computeQueue(), 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(m_device.computeQueue());
+    vkFreeCommandBuffers(m_device.device(), m_commandPool, 1, &commandBuffer);
+}
+
+void ResolvePass::destroyImages() {
+    destroyImage(m_device, m_hdrImage, m_hdrImageMemory, m_hdrImageView);
+    for (size_t i = 0; i < m_displayImages.size(); i++) {
+        destroyImage(m_device, m_displayImages[i], m_displayImagesMemory[i],
+                     m_displayImageViews[i]);
+    }
+}
+
+void ResolvePass::createDescriptorSets() {
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSize.descriptorCount = 2 * config::MAX_FRAMES_IN_FLIGHT;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    poolInfo.maxSets = config::MAX_FRAMES_IN_FLIGHT;
+
+    if (vkCreateDescriptorPool(m_device.device(), &poolInfo, nullptr,
+                               &m_descriptorPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create descriptor pool!");
+    }
+
+    std::vector<VkDescriptorSetLayout> layouts(config::MAX_FRAMES_IN_FLIGHT,
+                                               m_descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = m_descriptorPool;
+    allocInfo.descriptorSetCount = config::MAX_FRAMES_IN_FLIGHT;
+    allocInfo.pSetLayouts = layouts.data();
+    m_descriptorSets.resize(config::MAX_FRAMES_IN_FLIGHT);
+    if (vkAllocateDescriptorSets(m_device.device(), &allocInfo,
+                                 m_descriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate descriptor sets!");
+    }
+}
+
+void ResolvePass::writeDescriptorSets() {
+    for (size_t i = 0; i < m_descriptorSets.size(); i++) {
+        VkDescriptorImageInfo hdrImageInfo{};
+        hdrImageInfo.imageView = m_hdrImageView;
+        hdrImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        VkDescriptorImageInfo displayImageInfo{};
+        displayImageInfo.imageView = m_displayImageViews[i];
+        displayImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+        descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[0].dstSet = m_descriptorSets[i];
+        descriptorWrites[0].dstBinding = 0;
+        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptorWrites[0].descriptorCount = 1;
+        descriptorWrites[0].pImageInfo = &hdrImageInfo;
+
+        descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[1].dstSet = m_descriptorSets[i];
+        descriptorWrites[1].dstBinding = 1;
+        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptorWrites[1].descriptorCount = 1;
+        descriptorWrites[1].pImageInfo = &displayImageInfo;
+
+        vkUpdateDescriptorSets(m_device.device(),
+                               static_cast<uint32_t>(descriptorWrites.size()),
+                               descriptorWrites.data(), 0, nullptr);
+    }
+}
+
+void ResolvePass::createCommandBuffers() {
+    if (!m_commandBuffers.empty()) {
+        std::vector<VkCommandBuffer> previous;
+        for (const ResolveCommandBuffer& resolve : m_commandBuffers) {
+            previous.push_back(resolve.commandBuffer);
+        }
+        vkFreeCommandBuffers(m_device.device(), m_commandPool,
+                             static_cast<uint32_t>(previous.size()),
+                             previous.data());
+    }
+
+    std::vector<VkCommandBuffer> commandBuffers(
+        static_cast<size_t>(m_target.imageCount()) *
+        config::MAX_FRAMES_IN_FLIGHT);
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = m_commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+    if (vkAllocateCommandBuffers(m_device.device(), &allocInfo,
+                                 commandBuffers.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate resolve command buffers!");
+    }
+    m_commandBuffers.assign(commandBuffers.size(), {});
+    for (size_t i = 0; i < commandBuffers.size(); i++) {
+        m_commandBuffers[i].commandBuffer = commandBuffers[i];
+    }
+}
+
+ResolvePushConstants ResolvePass::pushConstants() const {
+    ResolvePushConstants constants{};
+    constants.exposure = m_settings.exposure;
+    constants.tonemapper = static_cast<uint32_t>(m_settings.tonemapper);
+    // A blit converts the channels itself
+    VkFormat format = m_target.imageFormat();
+    constants.swapRedBlue =
+        copiesDisplayImage(format) && swapsRedBlue(format) ? 1 : 0;
+    return constants;
+}
+
+VkCommandBuffer ResolvePass::commandBuffer(uint32_t imageIndex,
+                                           uint32_t currentFrame) {
+    ResolveCommandBuffer& resolve =
+        m_commandBuffers[static_cast<size_t>(imageIndex) *
+                             config::MAX_FRAMES_IN_FLIGHT +
+                         currentFrame];
+    // The slot's previous frame has finished, the only one that could still
+    // have been running this recording
+    VkExtent2D extent = m_target.extent();
+    if (!resolve.valid || resolve.extent.width != extent.width ||
+        resolve.extent.height != extent.height ||
+        !(resolve.settings == m_settings)) {
+        vkResetCommandBuffer(resolve.commandBuffer, 0);
+        recordCommandBuffer(resolve.commandBuffer, imageIndex, currentFrame);
+        resolve.extent = extent;
+        resolve.settings = m_settings;
+        resolve.valid = true;
+    }
+    m_profiler.submitted(currentFrame, GpuStage::Resolve);
+    return resolve.commandBuffer;
+}
+
+void ResolvePass::recordCommandBuffer(VkCommandBuffer commandBuffer,
+                                      uint32_t imageIndex,
+                                      uint32_t currentFrame) {
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+    }
+    m_profiler.beginStage(commandBuffer, currentFrame, GpuStage::Resolve);
+
+    // The trace or the host frame upload wrote the HDR image
+    VkMemoryBarrier hdrBarrier{};
+    hdrBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hdrBarrier.srcAccessMask =
+        VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    hdrBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    // The slot's previous copy read the display image, on this queue
+    // without async compute
+    VkImageMemoryBarrier toGeneral = imageBarrier(
+        m_displayImages[currentFrame], VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT);
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &hdrBarrier, 0, nullptr, 1, &toGeneral);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      m_pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            m_pipelineLayout, 0, 1,
+                            &m_descriptorSets[currentFrame], 0, nullptr);
+    ResolvePushConstants constants = pushConstants();
+    vkCmdPushConstants(commandBuffer, m_pipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                       &constants);
+    VkExtent2D extent = m_target.extent();
+    vkCmdDispatch(commandBuffer,
+                  (extent.width + kWorkgroupSize - 1) / kWorkgroupSize,
+                  (extent.height + kWorkgroupSize - 1) / kWorkgroupSize, 1);
+
+    VkImageMemoryBarrier toTransfer = imageBarrier(
+        m_displayImages[currentFrame], VK_IMAGE_LAYOUT_GENERAL,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_ACCESS_TRANSFER_READ_BIT);
+    if (m_device.asyncCompute()) {
+        // Released to the graphics family, recordGraphicsCopy() acquires it
+        // with the same barrier
+        QueueFamilyIndices indices =
+            m_device.findQueueFamilies(m_device.physicalDevice());
+        toTransfer.srcQueueFamilyIndex = indices.computeFamily();
+        toTransfer.dstQueueFamilyIndex =
+            indices.graphicsAndComputeFamily.value();
+        toTransfer.dstAccessMask = 0;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+                             nullptr, 0, nullptr, 1, &toTransfer);
+    } else {
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                             nullptr, 1, &toTransfer);
+        recordTargetCopy(commandBuffer, imageIndex, currentFrame);
+    }
+    m_profiler.endStage(commandBuffer, currentFrame, GpuStage::Resolve);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+    }
+}
+
+void ResolvePass::recordGraphicsCopy(VkCommandBuffer commandBuffer,
+                                     uint32_t imageIndex,
+                                     uint32_t currentFrame) {
+    QueueFamilyIndices indices =
+        m_device.findQueueFamilies(m_device.physicalDevice());
+    VkImageMemoryBarrier fromCompute = imageBarrier(
+        m_displayImages[currentFrame], VK_IMAGE_LAYOUT_GENERAL,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 0, VK_ACCESS_TRANSFER_READ_BIT);
+    fromCompute.srcQueueFamilyIndex = indices.computeFamily();
+    fromCompute.dstQueueFamilyIndex = indices.graphicsAndComputeFamily.value();
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 1, &fromCompute);
+    recordTargetCopy(commandBuffer, imageIndex, currentFrame);
+}
+
+void ResolvePass::recordTargetCopy(VkCommandBuffer commandBuffer,
+                                   uint32_t imageIndex,
+                                   uint32_t currentFrame) {
+    VkImage target = m_target.images()[imageIndex];
+    // Starts at the stage the frame's submission waits for the acquire in,
+    // so the transition happens after the image is released
+    VkImageMemoryBarrier toTransfer =
+        imageBarrier(target, VK_IMAGE_LAYOUT_UNDEFINED,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+                     VK_ACCESS_TRANSFER_WRITE_BIT);
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 1, &toTransfer);
+
+    VkExtent2D extent = m_target.extent();
+    VkImageSubresourceLayers subresource{};
+    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource.mipLevel = 0;
+    subresource.baseArrayLayer = 0;
+    subresource.layerCount = 1;
+    if (copiesDisplayImage(m_target.imageFormat())) {
+        VkImageCopy region{};
+        region.srcSubresource = subresource;
+        region.dstSubresource = subresource;
+        region.extent = {extent.width, extent.height, 1};
+        vkCmdCopyImage(commandBuffer, m_displayImages[currentFrame],
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, target,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    } else {
+        VkImageBlit region{};
+        region.srcSubresource = subresource;
+        region.dstSubresource = subresource;
+        region.srcOffsets[1] = {static_cast<int32_t>(extent.width),
+                                static_cast<int32_t>(extent.height), 1};
+        region.dstOffsets[1] = region.srcOffsets[1];
+        vkCmdBlitImage(commandBuffer, m_displayImages[currentFrame],
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, target,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                       VK_FILTER_NEAREST);
+    }
+
+    VkImageMemoryBarrier toAttachment = imageBarrier(
+        target, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+            VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0,
+                         nullptr, 0, nullptr, 1, &toAttachment);
+}
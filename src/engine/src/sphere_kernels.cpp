@@ -0,0 +1,1018 @@
+#include "../includes/sphere_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define RT_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC emits any intrinsic without per-function opt in
+#define RT_TARGET(isa)
+#else
+#include <cpuid.h>
+#define RT_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// The kernels spell out every multiply and add in the scalar order, and the
+// file is built with -ffp-contract=off, so every level returns bit-identical
+// hits. A fused multiply-add would round differently.
+
+void SphereSoA::build(const std::vector<Sphere>& spheres, size_t count) {
+    m_size = std::min(count, spheres.size());
+    size_t padded =
+        (m_size + kLaneMultiple - 1) / kLaneMultiple * kLaneMultiple;
+    // A NaN center makes every comparison false, so padding never hits
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    m_cx.assign(padded, nan);
+    m_cy.assign(padded, nan);
+    m_cz.assign(padded, nan);
+    m_r2.assign(padded, 0.0f);
+    for (size_t i = 0; i < m_size; i++) {
+        m_cx[i] = spheres[i].center.x;
+        m_cy[i] = spheres[i].center.y;
+        m_cz[i] = spheres[i].center.z;
+        m_r2[i] = spheres[i].radius * spheres[i].radius;
+    }
+}
+
+namespace {
+// Near root of the ray/sphere quadratic for sphere i, or -1 without a real
+// root. a is dot(direction, direction).
+inline float nearRoot(const SphereSoA& spheres, size_t i,
+                      const glm::vec3& origin, const glm::vec3& direction,
+                      float a) {
+    float ox = origin.x - spheres.cx()[i];
+    float oy = origin.y - spheres.cy()[i];
+    float oz = origin.z - spheres.cz()[i];
+    float b = 2.0f * (ox * direction.x + oy * direction.y + oz * direction.z);
+    float c = (ox * ox + oy * oy + oz * oz) - spheres.radiusSquared()[i];
+    float discriminant = b * b - 4.0f * a * c;
+    if (discriminant < 0.0f) return -1.0f;
+    return (-b - std::sqrt(discriminant)) / (2.0f * a);
+}
+
+// Reciprocal for slab tests. Zero components get a huge finite value so a
+// ray parallel to a slab never computes 0 * inf.
+glm::vec3 slabInverse(const glm::vec3& direction) {
+    glm::vec3 inverse;
+    for (int i = 0; i < 3; i++) {
+        inverse[i] = direction[i] == 0.0f ? 1e30f : 1.0f / direction[i];
+    }
+    return inverse;
+}
+
+// Entry distance into the box, or infinity when the ray misses it or enters
+// beyond tMax
+float intersectAabb(const glm::vec3& origin, const glm::vec3& inverse,
+                    const glm::vec3& aabbMin, const glm::vec3& aabbMax,
+                    float tMax) {
+    glm::vec3 t0 = (aabbMin - origin) * inverse;
+    glm::vec3 t1 = (aabbMax - origin) * inverse;
+    glm::vec3 tMin = glm::min(t0, t1);
+    glm::vec3 tFarAxis = glm::max(t0, t1);
+    float tNear = std::max(std::max(tMin.x, tMin.y), tMin.z);
+    float tFar = std::min(std::min(tFarAxis.x, tFarAxis.y), tFarAxis.z);
+    if (tFar >= tNear && tFar > 0.0f && tNear <= tMax) return tNear;
+    return std::numeric_limits<float>::infinity();
+}
+}  // namespace
+
+SphereHit intersectSpheresScalar(const SphereSoA& spheres,
+                                 const glm::vec3& origin,
+                                 const glm::vec3& direction, float tMax) {
+    SphereHit best = {tMax, -1};
+    float a = glm::dot(direction, direction);
+    for (size_t i = 0; i < spheres.size(); i++) {
+        float t = nearRoot(spheres, i, origin, direction, a);
+        if (t > 0.0f && t < best.distance) {
+            best.distance = t;
+            best.index = static_cast<int>(i);
+        }
+    }
+    return best;
+}
+
+namespace {
+// Sphere data read per test: one float of each SoA array and the index
+constexpr uint64_t kSphereTestBytes = 4 * sizeof(float) + sizeof(uint32_t);
+
+// Tests sphere primitive and keeps it if it beats best. Leaves are not in
+// index order, so equal hits keep the lowest index like the linear loop.
+inline void testPrimitive(const SphereSoA& spheres, uint32_t primitive,
+                          const glm::vec3& origin, const glm::vec3& direction,
+                          float a, SphereHit& best) {
+    float t = nearRoot(spheres, primitive, origin, direction, a);
+    if (t > 0.0f &&
+        (t < best.distance ||
+         (t == best.distance && static_cast<int>(primitive) < best.index))) {
+        best.distance = t;
+        best.index = static_cast<int>(primitive);
+    }
+}
+
+template <bool kStats>
+SphereHit intersectBvhImpl(const Bvh& bvh, const SphereSoA& spheres,
+                           const glm::vec3& origin, const glm::vec3& direction,
+                           float tMax, TraversalStats* stats) {
+    SphereHit best = {tMax, -1};
+    if (bvh.primitiveCount() == 0) return best;
+    const BvhNode* nodes = bvh.nodes().data();
+    const uint32_t* primitives = bvh.primitiveIndices().data();
+    glm::vec3 inverse = slabInverse(direction);
+    if (kStats) {
+        stats->rays++;
+        stats->bytesFetched += sizeof(BvhNode);
+    }
+    if (intersectAabb(origin, inverse, nodes[0].aabbMin, nodes[0].aabbMax,
+                      tMax) == std::numeric_limits<float>::infinity()) {
+        return best;
+    }
+
+    float a = glm::dot(direction, direction);
+    uint32_t stack[Bvh::kMaxDepth];
+    uint32_t stackSize = 0;
+    const BvhNode* node = &nodes[0];
+    while (true) {
+        if (kStats) stats->nodeVisits++;
+        if (node->isLeaf()) {
+            for (uint32_t i = 0; i < node->count; i++) {
+                testPrimitive(spheres, primitives[node->leftFirst + i], origin,
+                              direction, a, best);
+            }
+            if (kStats) {
+                stats->sphereTests += node->count;
+                stats->bytesFetched += node->count * kSphereTestBytes;
+            }
+            if (stackSize == 0) break;
+            node = &nodes[stack[--stackSize]];
+            continue;
+        }
+
+        // Visit the nearer child first, keep the other for later
+        uint32_t nearChild = node->leftFirst;
+        uint32_t farChild = nearChild + 1;
+        if (kStats) stats->bytesFetched += 2 * sizeof(BvhNode);
+        float nearDistance =
+            intersectAabb(origin, inverse, nodes[nearChild].aabbMin,
+                          nodes[nearChild].aabbMax, best.distance);
+        float farDistance =
+            intersectAabb(origin, inverse, nodes[farChild].aabbMin,
+                          nodes[farChild].aabbMax, best.distance);
+        if (farDistance < nearDistance) {
+            std::swap(nearChild, farChild);
+            std::swap(nearDistance, farDistance);
+        }
+        if (nearDistance == std::numeric_limits<float>::infinity()) {
+            if (stackSize == 0) break;
+            node = &nodes[stack[--stackSize]];
+            continue;
+        }
+        node = &nodes[nearChild];
+        if (farDistance != std::numeric_limits<float>::infinity()) {
+            stack[stackSize++] = farChild;
+        }
+    }
+    return best;
+}
+
+uint32_t lowestBit(uint32_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return static_cast<uint32_t>(index);
+#else
+    return static_cast<uint32_t>(__builtin_ctz(v));
+#endif
+}
+
+// Entry distance into every child box of node, or infinity on a miss as in
+// intersectAabb(). Returns the mask of slots hit.
+template <uint32_t Width>
+using WideBoxFn = uint32_t (*)(const WideBvhNode<Width>& node,
+                               const glm::vec3& origin,
+                               const glm::vec3& inverse, float tMax,
+                               float* distances);
+
+template <uint32_t Width>
+uint32_t wideBoxesScalar(const WideBvhNode<Width>& node,
+                         const glm::vec3& origin, const glm::vec3& inverse,
+                         float tMax, float* distances) {
+    glm::vec3 base(node.origin[0], node.origin[1], node.origin[2]);
+    glm::vec3 scale(node.scale(0), node.scale(1), node.scale(2));
+    uint32_t hits = 0;
+    for (uint32_t s = 0; s < Width; s++) {
+        if (node.isEmpty(s)) break;
+        glm::vec3 lo(node.lo[0][s], node.lo[1][s], node.lo[2][s]);
+        glm::vec3 hi(node.hi[0][s], node.hi[1][s], node.hi[2][s]);
+        distances[s] = intersectAabb(origin, inverse, base + lo * scale,
+                                     base + hi * scale, tMax);
+        if (distances[s] != std::numeric_limits<float>::infinity()) {
+            hits |= 1u << s;
+        }
+    }
+    return hits;
+}
+}  // namespace
+
+SphereHit intersectBvh(const Bvh& bvh, const SphereSoA& spheres,
+                       const glm::vec3& origin, const glm::vec3& direction,
+                       float tMax, TraversalStats* stats) {
+    if (stats) {
+        return intersectBvhImpl<true>(bvh, spheres, origin, direction, tMax,
+                                      stats);
+    }
+    return intersectBvhImpl<false>(bvh, spheres, origin, direction, tMax,
+                                   nullptr);
+}
+
+namespace {
+constexpr uint32_t kPacketLanes = RayPacket::kMaxRays;
+
+// Rays of a packet still being traced, compacted to the front. Lanes past the
+// active count up to the next multiple of 16 hold NaN rays that never hit.
+struct PacketLanes {
+    alignas(64) float dx[kPacketLanes];
+    alignas(64) float dy[kPacketLanes];
+    alignas(64) float dz[kPacketLanes];
+    alignas(64) float fourA[kPacketLanes];
+    alignas(64) float twoA[kPacketLanes];
+    alignas(64) float best[kPacketLanes];
+    alignas(64) int32_t index[kPacketLanes];
+    uint8_t ray[kPacketLanes];  // lane -> ray in the packet
+};
+
+// One sphere relative to the shared packet origin, everything that does not
+// depend on the ray direction
+struct PacketSphere {
+    float lowerBound;  // no ray of the packet can hit it closer than this
+    float px, py, pz;
+    float c;
+    int32_t index;
+};
+
+// Intersects the first count lanes with one sphere and returns the smallest
+// closest hit among them. A hit at the same distance as the current one wins
+// if its sphere index is lower, since spheres are not visited in index order.
+using PacketLaneFn = float (*)(PacketLanes& lanes, uint32_t count,
+                               const PacketSphere& sphere);
+
+float packetSphereScalar(PacketLanes& lanes, uint32_t count,
+                         const PacketSphere& sphere) {
+    float minBest = std::numeric_limits<float>::infinity();
+    for (uint32_t i = 0; i < count; i++) {
+        float b = 2.0f * (sphere.px * lanes.dx[i] + sphere.py * lanes.dy[i] +
+                          sphere.pz * lanes.dz[i]);
+        float discriminant = b * b - lanes.fourA[i] * sphere.c;
+        if (discriminant >= 0.0f) {
+            float t = (-b - std::sqrt(discriminant)) / lanes.twoA[i];
+            if (t > 0.0f &&
+                (t < lanes.best[i] ||
+                 (t == lanes.best[i] && sphere.index < lanes.index[i]))) {
+                lanes.best[i] = t;
+                lanes.index[i] = sphere.index;
+            }
+        }
+        minBest = std::min(minBest, lanes.best[i]);
+    }
+    return minBest;
+}
+}  // namespace
+
+#ifdef RT_X86_SIMD
+namespace {
+
+RT_TARGET("avx2")
+SphereHit intersectSpheresAvx2(const SphereSoA& spheres,
+                               const glm::vec3& origin,
+                               const glm::vec3& direction, float tMax) {
+    const __m256 ox = _mm256_set1_ps(origin.x);
+    const __m256 oy = _mm256_set1_ps(origin.y);
+    const __m256 oz = _mm256_set1_ps(origin.z);
+    const __m256 dx = _mm256_set1_ps(direction.x);
+    const __m256 dy = _mm256_set1_ps(direction.y);
+    const __m256 dz = _mm256_set1_ps(direction.z);
+    const float aScalar = glm::dot(direction, direction);
+    const __m256 fourA = _mm256_set1_ps(4.0f * aScalar);
+    const __m256 twoA = _mm256_set1_ps(2.0f * aScalar);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+
+    // Each lane keeps its own closest hit, reduced once after the loop
+    __m256 bestT = _mm256_set1_ps(tMax);
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+
+    for (size_t i = 0; i < spheres.size(); i += 8) {
+        __m256 px = _mm256_sub_ps(ox, _mm256_load_ps(spheres.cx() + i));
+        __m256 py = _mm256_sub_ps(oy, _mm256_load_ps(spheres.cy() + i));
+        __m256 pz = _mm256_sub_ps(oz, _mm256_load_ps(spheres.cz() + i));
+        __m256 pd = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(px, dx), _mm256_mul_ps(py, dy)),
+            _mm256_mul_ps(pz, dz));
+        __m256 b = _mm256_mul_ps(two, pd);
+        __m256 pp = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)),
+            _mm256_mul_ps(pz, pz));
+        __m256 c =
+            _mm256_sub_ps(pp, _mm256_load_ps(spheres.radiusSquared() + i));
+        __m256 discriminant =
+            _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(fourA, c));
+        __m256 t = _mm256_div_ps(
+            _mm256_sub_ps(_mm256_xor_ps(b, signBit),
+                          _mm256_sqrt_ps(discriminant)),
+            twoA);
+        __m256 hit = _mm256_and_ps(
+            _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ),
+                          _mm256_cmp_ps(t, bestT, _CMP_LT_OQ)));
+        bestT = _mm256_blendv_ps(bestT, t, hit);
+        bestIndex = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), hit));
+        index = _mm256_add_epi32(index, step);
+    }
+
+    // Horizontal minimum of the distances, broadcast to every lane
+    __m256 minT =
+        _mm256_min_ps(bestT, _mm256_permute2f128_ps(bestT, bestT, 0x01));
+    minT = _mm256_min_ps(minT, _mm256_shuffle_ps(minT, minT, 0x4e));
+    minT = _mm256_min_ps(minT, _mm256_shuffle_ps(minT, minT, 0xb1));
+
+    // Lowest sphere index among the lanes at that distance. Lanes that never
+    // hit still hold -1, which as unsigned sorts last.
+    __m256i candidates = _mm256_castps_si256(
+        _mm256_blendv_ps(_mm256_castsi256_ps(_mm256_set1_epi32(-1)),
+                         _mm256_castsi256_ps(bestIndex),
+                         _mm256_cmp_ps(bestT, minT, _CMP_EQ_OQ)));
+    __m256i minIndex = _mm256_min_epu32(
+        candidates, _mm256_permute2x128_si256(candidates, candidates, 0x01));
+    minIndex = _mm256_min_epu32(minIndex,
+                                _mm256_shuffle_epi32(minIndex, 0x4e));
+    minIndex = _mm256_min_epu32(minIndex,
+                                _mm256_shuffle_epi32(minIndex, 0xb1));
+
+    return {_mm256_cvtss_f32(minT), _mm256_cvtsi256_si32(minIndex)};
+}
+
+// intersectAabb() on all eight children of a BVH8 node, one per lane. The
+// boxes decode with the same multiply and add as wideBoxesScalar().
+RT_TARGET("avx2")
+uint32_t wideBoxesAvx2(const WideBvhNode<8>& node, const glm::vec3& origin,
+                       const glm::vec3& inverse, float tMax,
+                       float* distances) {
+    __m256 tNear = _mm256_setzero_ps();
+    __m256 tFar = _mm256_setzero_ps();
+    for (int axis = 0; axis < 3; axis++) {
+        const __m256 base = _mm256_set1_ps(node.origin[axis]);
+        const __m256 scale = _mm256_set1_ps(node.scale(axis));
+        const __m256 o = _mm256_set1_ps(origin[axis]);
+        const __m256 inv = _mm256_set1_ps(inverse[axis]);
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(node.lo[axis]))));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(node.hi[axis]))));
+        __m256 t0 = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_add_ps(base, _mm256_mul_ps(lo, scale)), o),
+            inv);
+        __m256 t1 = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_add_ps(base, _mm256_mul_ps(hi, scale)), o),
+            inv);
+        __m256 axisNear = _mm256_min_ps(t0, t1);
+        __m256 axisFar = _mm256_max_ps(t0, t1);
+        tNear = axis == 0 ? axisNear : _mm256_max_ps(tNear, axisNear);
+        tFar = axis == 0 ? axisFar : _mm256_min_ps(tFar, axisFar);
+    }
+    __m256 hit = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(tFar, tNear, _CMP_GE_OQ),
+                      _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GT_OQ)),
+        _mm256_cmp_ps(tNear, _mm256_set1_ps(tMax), _CMP_LE_OQ));
+    _mm256_storeu_ps(distances, tNear);
+    __m128i empty =
+        _mm_cmpeq_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(
+                           node.meta)),
+                       _mm_setzero_si128());
+    uint32_t occupied = ~static_cast<uint32_t>(_mm_movemask_epi8(empty)) & 0xff;
+    return static_cast<uint32_t>(_mm256_movemask_ps(hit)) & occupied;
+}
+
+// Same for the four children of a BVH4 node in 128 bit lanes
+RT_TARGET("avx2")
+uint32_t wideBoxesAvx2(const WideBvhNode<4>& node, const glm::vec3& origin,
+                       const glm::vec3& inverse, float tMax,
+                       float* distances) {
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar = _mm_setzero_ps();
+    for (int axis = 0; axis < 3; axis++) {
+        const __m128 base = _mm_set1_ps(node.origin[axis]);
+        const __m128 scale = _mm_set1_ps(node.scale(axis));
+        const __m128 o = _mm_set1_ps(origin[axis]);
+        const __m128 inv = _mm_set1_ps(inverse[axis]);
+        int32_t loBytes;
+        int32_t hiBytes;
+        std::memcpy(&loBytes, node.lo[axis], sizeof(loBytes));
+        std::memcpy(&hiBytes, node.hi[axis], sizeof(hiBytes));
+        __m128 lo =
+            _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(loBytes)));
+        __m128 hi =
+            _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(hiBytes)));
+        __m128 t0 =
+            _mm_mul_ps(_mm_sub_ps(_mm_add_ps(base, _mm_mul_ps(lo, scale)), o),
+                       inv);
+        __m128 t1 =
+            _mm_mul_ps(_mm_sub_ps(_mm_add_ps(base, _mm_mul_ps(hi, scale)), o),
+                       inv);
+        __m128 axisNear = _mm_min_ps(t0, t1);
+        __m128 axisFar = _mm_max_ps(t0, t1);
+        tNear = axis == 0 ? axisNear : _mm_max_ps(tNear, axisNear);
+        tFar = axis == 0 ? axisFar : _mm_min_ps(tFar, axisFar);
+    }
+    __m128 hit = _mm_and_ps(
+        _mm_and_ps(_mm_cmpge_ps(tFar, tNear),
+                   _mm_cmpgt_ps(tFar, _mm_setzero_ps())),
+        _mm_cmple_ps(tNear, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(distances, tNear);
+    uint32_t occupied = 0;
+    for (uint32_t s = 0; s < 4; s++) {
+        if (!node.isEmpty(s)) occupied |= 1u << s;
+    }
+    return static_cast<uint32_t>(_mm_movemask_ps(hit)) & occupied;
+}
+
+// GCC 12 reports its own _mm512_undefined_* placeholders as uninitialized
+// when AVX-512 is enabled per function
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+RT_TARGET("avx512f")
+SphereHit intersectSpheresAvx512(const SphereSoA& spheres,
+                                 const glm::vec3& origin,
+                                 const glm::vec3& direction, float tMax) {
+    const __m512 ox = _mm512_set1_ps(origin.x);
+    const __m512 oy = _mm512_set1_ps(origin.y);
+    const __m512 oz = _mm512_set1_ps(origin.z);
+    const __m512 dx = _mm512_set1_ps(direction.x);
+    const __m512 dy = _mm512_set1_ps(direction.y);
+    const __m512 dz = _mm512_set1_ps(direction.z);
+    const float aScalar = glm::dot(direction, direction);
+    const __m512 fourA = _mm512_set1_ps(4.0f * aScalar);
+    const __m512 twoA = _mm512_set1_ps(2.0f * aScalar);
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 zero = _mm512_setzero_ps();
+
+    __m512 bestT = _mm512_set1_ps(tMax);
+    __m512i bestIndex = _mm512_set1_epi32(-1);
+    __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+                                      12, 13, 14, 15);
+    const __m512i step = _mm512_set1_epi32(16);
+
+    for (size_t i = 0; i < spheres.size(); i += 16) {
+        __m512 px = _mm512_sub_ps(ox, _mm512_load_ps(spheres.cx() + i));
+        __m512 py = _mm512_sub_ps(oy, _mm512_load_ps(spheres.cy() + i));
+        __m512 pz = _mm512_sub_ps(oz, _mm512_load_ps(spheres.cz() + i));
+        __m512 pd = _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(px, dx), _mm512_mul_ps(py, dy)),
+            _mm512_mul_ps(pz, dz));
+        __m512 b = _mm512_mul_ps(two, pd);
+        __m512 pp = _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(px, px), _mm512_mul_ps(py, py)),
+            _mm512_mul_ps(pz, pz));
+        __m512 c =
+            _mm512_sub_ps(pp, _mm512_load_ps(spheres.radiusSquared() + i));
+        __m512 discriminant =
+            _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(fourA, c));
+        // Lanes with a negative discriminant are masked out of the sqrt
+        __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ);
+        __m512 t = _mm512_div_ps(
+            _mm512_sub_ps(_mm512_sub_ps(zero, b),
+                          _mm512_maskz_sqrt_ps(hit, discriminant)),
+            twoA);
+        hit = _mm512_mask_cmp_ps_mask(hit, t, zero, _CMP_GT_OQ);
+        hit = _mm512_mask_cmp_ps_mask(hit, t, bestT, _CMP_LT_OQ);
+        bestT = _mm512_mask_blend_ps(hit, bestT, t);
+        bestIndex = _mm512_mask_blend_epi32(hit, bestIndex, index);
+        index = _mm512_add_epi32(index, step);
+    }
+
+    float minT = _mm512_reduce_min_ps(bestT);
+    __mmask16 closest =
+        _mm512_cmp_ps_mask(bestT, _mm512_set1_ps(minT), _CMP_EQ_OQ);
+    uint32_t minIndex = _mm512_mask_reduce_min_epu32(closest, bestIndex);
+    return {minT, static_cast<int>(minIndex)};
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+RT_TARGET("avx2")
+float packetSphereAvx2(PacketLanes& lanes, uint32_t count,
+                       const PacketSphere& sphere) {
+    const __m256 px = _mm256_set1_ps(sphere.px);
+    const __m256 py = _mm256_set1_ps(sphere.py);
+    const __m256 pz = _mm256_set1_ps(sphere.pz);
+    const __m256 c = _mm256_set1_ps(sphere.c);
+    const __m256i index = _mm256_set1_epi32(sphere.index);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    __m256 minBest = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256 pd = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(px, _mm256_load_ps(lanes.dx + i)),
+                          _mm256_mul_ps(py, _mm256_load_ps(lanes.dy + i))),
+            _mm256_mul_ps(pz, _mm256_load_ps(lanes.dz + i)));
+        __m256 b = _mm256_mul_ps(two, pd);
+        __m256 discriminant = _mm256_sub_ps(
+            _mm256_mul_ps(b, b),
+            _mm256_mul_ps(_mm256_load_ps(lanes.fourA + i), c));
+        __m256 t = _mm256_div_ps(
+            _mm256_sub_ps(_mm256_xor_ps(b, signBit),
+                          _mm256_sqrt_ps(discriminant)),
+            _mm256_load_ps(lanes.twoA + i));
+
+        __m256 best = _mm256_load_ps(lanes.best + i);
+        __m256i bestIndex =
+            _mm256_load_si256(reinterpret_cast<__m256i*>(lanes.index + i));
+        __m256 lowerIndex = _mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(bestIndex, index));
+        __m256 closer = _mm256_or_ps(
+            _mm256_cmp_ps(t, best, _CMP_LT_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(t, best, _CMP_EQ_OQ), lowerIndex));
+        __m256 hit = _mm256_and_ps(
+            _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), closer));
+
+        best = _mm256_blendv_ps(best, t, hit);
+        bestIndex = _mm256_castps_si256(
+            _mm256_blendv_ps(_mm256_castsi256_ps(bestIndex),
+                             _mm256_castsi256_ps(index), hit));
+        _mm256_store_ps(lanes.best + i, best);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes.index + i),
+                           bestIndex);
+        minBest = _mm256_min_ps(minBest, best);
+    }
+
+    minBest =
+        _mm256_min_ps(minBest, _mm256_permute2f128_ps(minBest, minBest, 0x01));
+    minBest = _mm256_min_ps(minBest, _mm256_shuffle_ps(minBest, minBest, 0x4e));
+    minBest = _mm256_min_ps(minBest, _mm256_shuffle_ps(minBest, minBest, 0xb1));
+    return _mm256_cvtss_f32(minBest);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+RT_TARGET("avx512f")
+float packetSphereAvx512(PacketLanes& lanes, uint32_t count,
+                         const PacketSphere& sphere) {
+    const __m512 px = _mm512_set1_ps(sphere.px);
+    const __m512 py = _mm512_set1_ps(sphere.py);
+    const __m512 pz = _mm512_set1_ps(sphere.pz);
+    const __m512 c = _mm512_set1_ps(sphere.c);
+    const __m512i index = _mm512_set1_epi32(sphere.index);
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 zero = _mm512_setzero_ps();
+    __m512 minBest = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+
+    for (uint32_t i = 0; i < count; i += 16) {
+        __m512 pd = _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(px, _mm512_load_ps(lanes.dx + i)),
+                          _mm512_mul_ps(py, _mm512_load_ps(lanes.dy + i))),
+            _mm512_mul_ps(pz, _mm512_load_ps(lanes.dz + i)));
+        __m512 b = _mm512_mul_ps(two, pd);
+        __m512 discriminant = _mm512_sub_ps(
+            _mm512_mul_ps(b, b),
+            _mm512_mul_ps(_mm512_load_ps(lanes.fourA + i), c));
+        __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ);
+        __m512 t = _mm512_div_ps(
+            _mm512_sub_ps(_mm512_sub_ps(zero, b),
+                          _mm512_maskz_sqrt_ps(hit, discriminant)),
+            _mm512_load_ps(lanes.twoA + i));
+
+        __m512 best = _mm512_load_ps(lanes.best + i);
+        __m512i bestIndex = _mm512_load_si512(lanes.index + i);
+        __mmask16 closer =
+            _mm512_cmp_ps_mask(t, best, _CMP_LT_OQ) |
+            (_mm512_cmp_ps_mask(t, best, _CMP_EQ_OQ) &
+             _mm512_cmpgt_epi32_mask(bestIndex, index));
+        hit = _mm512_mask_cmp_ps_mask(hit & closer, t, zero, _CMP_GT_OQ);
+
+        best = _mm512_mask_blend_ps(hit, best, t);
+        _mm512_store_ps(lanes.best + i, best);
+        _mm512_store_si512(lanes.index + i,
+                           _mm512_mask_blend_epi32(hit, bestIndex, index));
+        minBest = _mm512_min_ps(minBest, best);
+    }
+    return _mm512_reduce_min_ps(minBest);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+void cpuid(int leaf, int subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++) regs[i] = static_cast<uint32_t>(info[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+uint64_t xgetbv0() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+SimdLevel detectHardwareSimdLevel() {
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    uint32_t maxLeaf = regs[0];
+    if (maxLeaf < 7) return SimdLevel::Scalar;
+
+    cpuid(1, 0, regs);
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx = (regs[2] & (1u << 28)) != 0;
+    if (!osxsave || !avx) return SimdLevel::Scalar;
+
+    // The OS has to save the wider registers on context switches
+    uint64_t xcr0 = xgetbv0();
+    bool ymmState = (xcr0 & 0x6) == 0x6;
+    bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+    cpuid(7, 0, regs);
+    bool avx2 = (regs[1] & (1u << 5)) != 0;
+    bool avx512f = (regs[1] & (1u << 16)) != 0;
+
+    if (avx512f && zmmState) return SimdLevel::Avx512;
+    if (avx2 && ymmState) return SimdLevel::Avx2;
+    return SimdLevel::Scalar;
+}
+}  // namespace
+#endif
+
+SimdLevel detectSimdLevel() {
+#ifdef RT_X86_SIMD
+    SimdLevel level = detectHardwareSimdLevel();
+#else
+    SimdLevel level = SimdLevel::Scalar;
+#endif
+    const char* cap = std::getenv("RT_SIMD");
+    if (cap) {
+        SimdLevel capped = level;
+        if (strcmp(cap, "scalar") == 0) capped = SimdLevel::Scalar;
+        if (strcmp(cap, "avx2") == 0) capped = SimdLevel::Avx2;
+        if (static_cast<int>(capped) < static_cast<int>(level)) level = capped;
+    }
+    return level;
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Avx512:
+            return "avx512";
+        case SimdLevel::Avx2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+IntersectSpheresFn selectIntersectKernel(SimdLevel level) {
+#ifdef RT_X86_SIMD
+    switch (level) {
+        case SimdLevel::Avx512:
+            return intersectSpheresAvx512;
+        case SimdLevel::Avx2:
+            return intersectSpheresAvx2;
+        default:
+            break;
+    }
+#else
+    (void)level;
+#endif
+    return intersectSpheresScalar;
+}
+
+namespace {
+// Both SIMD levels use the AVX2 kernels, eight children fill one register
+template <uint32_t Width>
+WideBoxFn<Width> selectWideBoxKernel(SimdLevel level) {
+#ifdef RT_X86_SIMD
+    if (level != SimdLevel::Scalar) {
+        return static_cast<WideBoxFn<Width>>(wideBoxesAvx2);
+    }
+#else
+    (void)level;
+#endif
+    return wideBoxesScalar<Width>;
+}
+
+template <uint32_t Width, bool kStats>
+SphereHit intersectWideBvhImpl(const WideBvh<Width>& bvh,
+                               const SphereSoA& spheres,
+                               const glm::vec3& origin,
+                               const glm::vec3& direction, float tMax,
+                               WideBoxFn<Width> boxes, TraversalStats* stats) {
+    SphereHit best = {tMax, -1};
+    if (bvh.primitiveCount() == 0) return best;
+    const WideBvhNode<Width>* nodes = bvh.nodes().data();
+    const uint32_t* primitives = bvh.primitiveIndices().data();
+    glm::vec3 inverse = slabInverse(direction);
+    float a = glm::dot(direction, direction);
+    if (kStats) stats->rays++;
+
+    // Each entry is childBase << 8 | mask of the child ranks still to
+    // visit. At most one entry is pushed per level.
+    uint32_t stack[Bvh::kMaxDepth];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+    alignas(32) float distances[Width];
+    float childDistances[Width];
+    while (true) {
+        const WideBvhNode<Width>& node = nodes[nodeIndex];
+        if (kStats) {
+            stats->nodeVisits++;
+            stats->bytesFetched += sizeof(WideBvhNode<Width>);
+        }
+        uint32_t hits = boxes(node, origin, inverse, best.distance, distances);
+
+        // Leaves right away, their hits can cull the interior children
+        uint32_t interior = 0;
+        for (; hits != 0; hits &= hits - 1) {
+            uint32_t slot = lowestBit(hits);
+            if (node.isInterior(slot)) {
+                uint32_t rank = node.childRank(slot);
+                interior |= 1u << rank;
+                childDistances[rank] = distances[slot];
+                continue;
+            }
+            uint32_t first = node.primitiveBase + node.leafOffset(slot);
+            uint32_t count = node.leafCount(slot);
+            for (uint32_t i = 0; i < count; i++) {
+                testPrimitive(spheres, primitives[first + i], origin,
+                              direction, a, best);
+            }
+            if (kStats) {
+                stats->sphereTests += count;
+                stats->bytesFetched += count * kSphereTestBytes;
+            }
+        }
+
+        // Nearest interior child next, the others as one stack entry
+        uint32_t remaining = 0;
+        uint32_t nearestRank = 0;
+        float nearest = std::numeric_limits<float>::infinity();
+        for (; interior != 0; interior &= interior - 1) {
+            uint32_t rank = lowestBit(interior);
+            if (childDistances[rank] > best.distance) continue;
+            remaining |= 1u << rank;
+            if (childDistances[rank] < nearest || remaining == 1u << rank) {
+                nearest = childDistances[rank];
+                nearestRank = rank;
+            }
+        }
+        if (remaining != 0) {
+            remaining &= ~(1u << nearestRank);
+            if (remaining != 0) {
+                stack[stackSize++] = node.childBase << 8 | remaining;
+            }
+            nodeIndex = node.childBase + nearestRank;
+            continue;
+        }
+
+        if (stackSize == 0) break;
+        uint32_t entry = stack[--stackSize];
+        uint32_t mask = entry & 0xff;
+        uint32_t rank = lowestBit(mask);
+        mask &= mask - 1;
+        if (mask != 0) stack[stackSize++] = (entry & ~0xffu) | mask;
+        nodeIndex = (entry >> 8) + rank;
+    }
+    return best;
+}
+}  // namespace
+
+template <uint32_t Width>
+SphereHit intersectWideBvh(const WideBvh<Width>& bvh, const SphereSoA& spheres,
+                           const glm::vec3& origin, const glm::vec3& direction,
+                           float tMax, SimdLevel level,
+                           TraversalStats* stats) {
+    WideBoxFn<Width> boxes = selectWideBoxKernel<Width>(level);
+    if (stats) {
+        return intersectWideBvhImpl<Width, true>(bvh, spheres, origin,
+                                                 direction, tMax, boxes, stats);
+    }
+    return intersectWideBvhImpl<Width, false>(bvh, spheres, origin, direction,
+                                              tMax, boxes, nullptr);
+}
+
+template SphereHit intersectWideBvh<4>(const WideBvh<4>&, const SphereSoA&,
+                                       const glm::vec3&, const glm::vec3&,
+                                       float, SimdLevel, TraversalStats*);
+template SphereHit intersectWideBvh<8>(const WideBvh<8>&, const SphereSoA&,
+                                       const glm::vec3&, const glm::vec3&,
+                                       float, SimdLevel, TraversalStats*);
+
+namespace {
+PacketLaneFn selectPacketLaneKernel(SimdLevel level) {
+#ifdef RT_X86_SIMD
+    switch (level) {
+        case SimdLevel::Avx512:
+            return packetSphereAvx512;
+        case SimdLevel::Avx2:
+            return packetSphereAvx2;
+        default:
+            break;
+    }
+#else
+    (void)level;
+#endif
+    return packetSphereScalar;
+}
+
+uint32_t roundUpToLanes(uint32_t count) { return (count + 15) / 16 * 16; }
+
+void padLanes(PacketLanes& lanes, uint32_t first) {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    for (uint32_t i = first; i < roundUpToLanes(first); i++) {
+        lanes.dx[i] = lanes.dy[i] = lanes.dz[i] = nan;
+        lanes.best[i] = std::numeric_limits<float>::infinity();
+        lanes.index[i] = -1;
+    }
+}
+
+// Writes out the rays whose hit is closer than bound and moves the rest to
+// the front. Returns the number of rays still active.
+uint32_t retireLanes(PacketLanes& lanes, uint32_t count, float bound,
+                     RayPacket& packet) {
+    uint32_t active = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (lanes.best[i] < bound) {
+            packet.distance[lanes.ray[i]] = lanes.best[i];
+            packet.index[lanes.ray[i]] = lanes.index[i];
+            continue;
+        }
+        if (active != i) {
+            lanes.dx[active] = lanes.dx[i];
+            lanes.dy[active] = lanes.dy[i];
+            lanes.dz[active] = lanes.dz[i];
+            lanes.fourA[active] = lanes.fourA[i];
+            lanes.twoA[active] = lanes.twoA[i];
+            lanes.best[active] = lanes.best[i];
+            lanes.index[active] = lanes.index[i];
+            lanes.ray[active] = lanes.ray[i];
+        }
+        active++;
+    }
+    padLanes(lanes, active);
+    return active;
+}
+}  // namespace
+
+void intersectPacket(const SphereSoA& spheres, RayPacket& packet, float tMax,
+                     SimdLevel level, const Bvh* bvh) {
+    const uint32_t count = std::min(packet.size(), RayPacket::kMaxRays);
+    if (count == 0) return;
+    const glm::vec3& origin = packet.origin;
+
+    // Side planes of the cone through the corner rays, facing inwards
+    glm::vec3 planes[4];
+    bool cull = packet.width >= 2 && packet.height >= 2;
+    if (cull) {
+        uint32_t cornerIndices[4] = {0, packet.width - 1, count - 1,
+                                     count - packet.width};
+        glm::vec3 corners[4];
+        glm::vec3 center(0.0f);
+        for (int i = 0; i < 4; i++) {
+            uint32_t r = cornerIndices[i];
+            corners[i] = glm::vec3(packet.dx[r], packet.dy[r], packet.dz[r]);
+            center += corners[i];
+        }
+        for (int i = 0; i < 4; i++) {
+            glm::vec3 normal = glm::cross(corners[i], corners[(i + 1) % 4]);
+            float length = glm::length(normal);
+            if (!(length > 0.0f)) {
+                cull = false;
+                break;
+            }
+            normal /= length;
+            planes[i] = glm::dot(normal, center) < 0.0f ? -normal : normal;
+        }
+    }
+
+    // Candidate spheres nearest first. Bounds get a relative margin so that
+    // rounding in the quadratic can never hit a sphere that was culled.
+    thread_local std::vector<PacketSphere> candidates;
+    candidates.clear();
+    auto consider = [&](size_t i) {
+        PacketSphere sphere;
+        sphere.px = origin.x - spheres.cx()[i];
+        sphere.py = origin.y - spheres.cy()[i];
+        sphere.pz = origin.z - spheres.cz()[i];
+        float pp = sphere.px * sphere.px + sphere.py * sphere.py +
+                   sphere.pz * sphere.pz;
+        sphere.c = pp - spheres.radiusSquared()[i];
+        // From inside (or on) a sphere the near root is never positive
+        if (!(sphere.c > 0.0f)) return;
+
+        float distance = std::sqrt(pp);
+        float reach = std::sqrt(spheres.radiusSquared()[i]) + 1e-4f * distance;
+        if (cull) {
+            glm::vec3 toCenter(-sphere.px, -sphere.py, -sphere.pz);
+            for (const glm::vec3& plane : planes) {
+                if (glm::dot(plane, toCenter) < -reach) return;
+            }
+        }
+        sphere.lowerBound = distance - reach;
+        if (sphere.lowerBound >= tMax) return;
+        sphere.index = static_cast<int32_t>(i);
+        candidates.push_back(sphere);
+    };
+
+    if (bvh && bvh->primitiveCount() == spheres.size()) {
+        // Only visit the leaves whose boxes reach into the frustum
+        const BvhNode* nodes = bvh->nodes().data();
+        const uint32_t* primitives = bvh->primitiveIndices().data();
+        uint32_t stack[Bvh::kMaxDepth];
+        uint32_t stackSize = spheres.size() > 0 ? 1 : 0;
+        stack[0] = 0;
+        while (stackSize > 0) {
+            const BvhNode& node = nodes[stack[--stackSize]];
+            bool outside = false;
+            for (int p = 0; cull && p < 4 && !outside; p++) {
+                // Corner of the box furthest along the plane normal
+                glm::vec3 corner =
+                    glm::mix(node.aabbMin, node.aabbMax,
+                             glm::vec3(glm::greaterThanEqual(
+                                 planes[p], glm::vec3(0.0f))));
+                glm::vec3 toCorner = corner - origin;
+                outside = glm::dot(planes[p], toCorner) <
+                          -1e-4f * glm::length(toCorner);
+            }
+            if (outside) continue;
+            if (node.isLeaf()) {
+                for (uint32_t i = 0; i < node.count; i++) {
+                    consider(primitives[node.leftFirst + i]);
+                }
+            } else {
+                stack[stackSize++] = node.leftFirst;
+                stack[stackSize++] = node.leftFirst + 1;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < spheres.size(); i++) consider(i);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const PacketSphere& a, const PacketSphere& b) {
+                  return a.lowerBound < b.lowerBound ||
+                         (a.lowerBound == b.lowerBound && a.index < b.index);
+              });
+
+    PacketLanes lanes;
+    for (uint32_t i = 0; i < count; i++) {
+        lanes.dx[i] = packet.dx[i];
+        lanes.dy[i] = packet.dy[i];
+        lanes.dz[i] = packet.dz[i];
+        float a = packet.dx[i] * packet.dx[i] + packet.dy[i] * packet.dy[i] +
+                  packet.dz[i] * packet.dz[i];
+        lanes.fourA[i] = 4.0f * a;
+        lanes.twoA[i] = 2.0f * a;
+        lanes.best[i] = tMax;
+        lanes.index[i] = -1;
+        lanes.ray[i] = static_cast<uint8_t>(i);
+    }
+    padLanes(lanes, count);
+
+    PacketLaneFn laneFn = selectPacketLaneKernel(level);
+    uint32_t active = count;
+    for (size_t k = 0; k < candidates.size() && active > 0; k++) {
+        float minBest = laneFn(lanes, active, candidates[k]);
+        // Rays already closer than every remaining sphere are done
+        float nextBound = k + 1 < candidates.size()
+                              ? candidates[k + 1].lowerBound
+                              : std::numeric_limits<float>::infinity();
+        if (minBest < nextBound) {
+            active = retireLanes(lanes, active, nextBound, packet);
+        }
+    }
+    retireLanes(lanes, active, std::numeric_limits<float>::infinity(),
+                packet);
+}
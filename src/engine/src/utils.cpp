@@ -2,25 +2,9 @@
 
 #include "../engine.hpp"
 
-uint32_t findMemoryType(Device& device, uint32_t typeFilter,
-                        VkMemoryPropertyFlags properties) {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(device.physicalDevice(),
-                                        &memProperties);
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-        if ((typeFilter & (1 << i)) &&
-            (memProperties.memoryTypes[i].propertyFlags & properties) ==
-                properties) {
-            return i;
-        }
-    }
-
-    throw std::runtime_error("failed to find suitable memory type!");
-}
-
 void createBuffer(Device& device, VkDeviceSize size, VkBufferUsageFlags usage,
-                  VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                  VkDeviceMemory& bufferMemory) {
+                  VkMemoryPropertyFlags properties, MemoryCategory category,
+                  VkBuffer& buffer, Allocation& allocation) {
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
@@ -32,21 +16,14 @@ void createBuffer(Device& device, VkDeviceSize size, VkBufferUsageFlags usage,
         throw std::runtime_error("failed to create buffer!");
     }
 
-    VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(device.device(), buffer, &memRequirements);
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex =
-        findMemoryType(device, memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device.device(), &allocInfo, nullptr, &bufferMemory) !=
-        VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate buffer memory!");
-    }
+    allocation =
+        device.allocator().allocateBuffer(buffer, properties, category);
+}
 
-    vkBindBufferMemory(device.device(), buffer, bufferMemory, 0);
+void destroyBuffer(Device& device, VkBuffer& buffer, Allocation& allocation) {
+    vkDestroyBuffer(device.device(), buffer, nullptr);
+    device.allocator().free(allocation);
+    buffer = VK_NULL_HANDLE;
 }
 
 void copyBuffer(Device& device, VkCommandPool commandPool, VkBuffer srcBuffer,
@@ -97,4 +74,25 @@ VkShaderModule createShaderModule(VkDevice device,
     }
 
     return shaderModule;
+}
+
+void writeImagePPM(const std::string& path, uint32_t width, uint32_t height,
+                   const uint8_t* rgba) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open output image!");
+    }
+
+    file << "P6\n" << width << " " << height << "\n255\n";
+    std::vector<char> row(static_cast<size_t>(width) * 3);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* src = rgba + static_cast<size_t>(y) * width * 4;
+        for (uint32_t x = 0; x < width; x++) {
+            row[x * 3 + 0] = static_cast<char>(src[x * 4 + 0]);
+            row[x * 3 + 1] = static_cast<char>(src[x * 4 + 1]);
+            row[x * 3 + 2] = static_cast<char>(src[x * 4 + 2]);
+        }
+        file.write(row.data(), static_cast<std::streamsize>(row.size()));
+    }
+    file.close();
 }
\ No newline at end of file
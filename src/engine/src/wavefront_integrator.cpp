@@ -0,0 +1,272 @@
+#include "../includes/wavefront_integrator.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "../includes/utils.hpp"
+
+namespace {
+// Sizes of the per path structs in wavefront.comp (std430)
+constexpr VkDeviceSize kPathStateSize = 64;
+constexpr VkDeviceSize kPathHitSize = 8;
+// queueCount[2] and padding, then dispatchSize[2]
+constexpr VkDeviceSize kDispatchSizeOffset = 16;
+constexpr VkDeviceSize kCounterBufferSize = kDispatchSizeOffset + 2 * 16;
+}  // namespace
+
+WavefrontIntegrator::WavefrontIntegrator(Device& device,
+                                         PipelineCache& pipelineCache,
+                                         VkDescriptorSetLayout sceneLayout)
+    : m_device(device), m_pipelineCache(pipelineCache) {
+    auto shaderCode = readFile("../res/shaders/wavefront.spv");
+    m_shaderModule = createShaderModule(m_device.device(), shaderCode);
+    createDescriptorSetLayout();
+    createPipelineLayout(sceneLayout);
+    createBuffers();
+    createDescriptorSet();
+}
+
+WavefrontIntegrator::~WavefrontIntegrator() {
+    for (const CompiledVariant& compiled : m_pipelines) {
+        for (VkPipeline pipeline : compiled.pipelines) {
+            vkDestroyPipeline(m_device.device(), pipeline, nullptr);
+        }
+    }
+    vkDestroyShaderModule(m_device.device(), m_shaderModule, nullptr);
+    vkDestroyPipelineLayout(m_device.device(), m_pipelineLayout, nullptr);
+    vkDestroyDescriptorPool(m_device.device(), m_descriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(m_device.device(), m_descriptorSetLayout,
+                                 nullptr);
+    destroyBuffer(m_device, m_pathBuffer, m_pathBufferMemory);
+    destroyBuffer(m_device, m_hitBuffer, m_hitBufferMemory);
+    destroyBuffer(m_device, m_queueBuffer, m_queueBufferMemory);
+    destroyBuffer(m_device, m_counterBuffer, m_counterBufferMemory);
+}
+
+void WavefrontIntegrator::createDescriptorSetLayout() {
+    // paths, hits, queues and counters, bindings 0 to 3 of set 1
+    std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings{};
+    for (uint32_t i = 0; i < layoutBindings.size(); i++) {
+        layoutBindings[i].binding = i;
+        layoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[i].descriptorCount = 1;
+        layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        layoutBindings[i].pImmutableSamplers = nullptr;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+    layoutInfo.pBindings = layoutBindings.data();
+
+    if (vkCreateDescriptorSetLayout(m_device.device(), &layoutInfo, nullptr,
+                                    &m_descriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error(
+            "failed to create wavefront descriptor set layout!");
+    }
+}
+
+void WavefrontIntegrator::createPipelineLayout(
+    VkDescriptorSetLayout sceneLayout) {
+    std::array<VkDescriptorSetLayout, 2> setLayouts = {sceneLayout,
+                                                       m_descriptorSetLayout};
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(FramePushConstants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount =
+        static_cast<uint32_t>(setLayouts.size());
+    pipelineLayoutInfo.pSetLayouts = setLayouts.data();
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    if (vkCreatePipelineLayout(m_device.device(), &pipelineLayoutInfo, nullptr,
+                               &m_pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create wavefront pipeline layout!");
+    }
+}
+
+void WavefrontIntegrator::createBuffers() {
+    // Working memory of the trace, counted with the accumulation buffer.
+    // Generate writes every path and count before a bounce reads them.
+    createBuffer(m_device, kPathStateSize * kPathCapacity,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_pathBuffer, m_pathBufferMemory);
+    createBuffer(m_device, kPathHitSize * kPathCapacity,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers, m_hitBuffer, m_hitBufferMemory);
+    createBuffer(m_device, 2 * sizeof(uint32_t) * kPathCapacity,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_queueBuffer, m_queueBufferMemory);
+    createBuffer(m_device, kCounterBufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 MemoryCategory::TraceBuffers,
+                 m_counterBuffer, m_counterBufferMemory);
+}
+
+void WavefrontIntegrator::createDescriptorSet() {
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = 4;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    poolInfo.maxSets = 1;
+
+    if (vkCreateDescriptorPool(m_device.device(), &poolInfo, nullptr,
+                               &m_descriptorPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create descriptor pool!");
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = m_descriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &m_descriptorSetLayout;
+    if (vkAllocateDescriptorSets(m_device.device(), &allocInfo,
+                                 &m_descriptorSet) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate descriptor sets!");
+    }
+
+    std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+    bufferInfos[0] = {m_pathBuffer, 0, VK_WHOLE_SIZE};
+    bufferInfos[1] = {m_hitBuffer, 0, VK_WHOLE_SIZE};
+    bufferInfos[2] = {m_queueBuffer, 0, VK_WHOLE_SIZE};
+    bufferInfos[3] = {m_counterBuffer, 0, VK_WHOLE_SIZE};
+
+    std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
+    for (uint32_t i = 0; i < descriptorWrites.size(); i++) {
+        descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[i].dstSet = m_descriptorSet;
+        descriptorWrites[i].dstBinding = i;
+        descriptorWrites[i].dstArrayElement = 0;
+        descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[i].descriptorCount = 1;
+        descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+    }
+    vkUpdateDescriptorSets(m_device.device(),
+                           static_cast<uint32_t>(descriptorWrites.size()),
+                           descriptorWrites.data(), 0, nullptr);
+}
+
+const std::array<VkPipeline, WavefrontIntegrator::kStages>&
+WavefrontIntegrator::pipelines(const ComputeVariant& variant) {
+    for (const CompiledVariant& compiled : m_pipelines) {
+        if (compiled.variant == variant) return compiled.pipelines;
+    }
+
+    // The variant's constants, then STAGE
+    std::array<VkSpecializationMapEntry, ComputeVariant::kConstantCount + 1>
+        entries{};
+    std::array<VkSpecializationMapEntry, ComputeVariant::kConstantCount>
+        variantEntries = ComputeVariant::mapEntries();
+    std::copy(variantEntries.begin(), variantEntries.end(), entries.begin());
+    entries.back() = {ComputeVariant::kConstantCount,
+                      offsetof(StageConstants, stage), sizeof(uint32_t)};
+
+    CompiledVariant compiled{variant, {}};
+    for (uint32_t stage = 0; stage < kStages; stage++) {
+        StageConstants constants{variant, stage};
+        VkSpecializationInfo specializationInfo{};
+        specializationInfo.mapEntryCount =
+            static_cast<uint32_t>(entries.size());
+        specializationInfo.pMapEntries = entries.data();
+        specializationInfo.dataSize = sizeof(StageConstants);
+        specializationInfo.pData = &constants;
+
+        VkPipelineShaderStageCreateInfo stageInfo{};
+        stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        stageInfo.module = m_shaderModule;
+        stageInfo.pName = "main";
+        stageInfo.pSpecializationInfo = &specializationInfo;
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = m_pipelineLayout;
+        pipelineInfo.stage = stageInfo;
+        compiled.pipelines[stage] =
+            m_pipelineCache.createComputePipeline(pipelineInfo);
+    }
+    m_pipelines.push_back(compiled);
+    return m_pipelines.back().pipelines;
+}
+
+void WavefrontIntegrator::record(VkCommandBuffer commandBuffer,
+                                 const ComputeVariant& variant,
+                                 VkDescriptorSet sceneSet,
+                                 const FramePushConstants& pushConstants,
+                                 uint32_t passes, uint32_t paths) {
+    ComputeVariant rowVariant = variant;
+    rowVariant.workgroupWidth = kGroupSize;
+    rowVariant.workgroupHeight = 1;
+    const std::array<VkPipeline, kStages>& stages = pipelines(rowVariant);
+
+    std::array<VkDescriptorSet, 2> sets = {sceneSet, m_descriptorSet};
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            m_pipelineLayout, 0,
+                            static_cast<uint32_t>(sets.size()), sets.data(), 0,
+                            nullptr);
+
+    // Every kernel reads what the one before wrote, the dispatch sizes of
+    // the indirect ones included
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                            VK_ACCESS_SHADER_WRITE_BIT |
+                            VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    auto run = [&](Stage stage, const FramePushConstants& constants) {
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          stages[stage]);
+        vkCmdPushConstants(commandBuffer, m_pipelineLayout,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                           sizeof(FramePushConstants), &constants);
+    };
+
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        for (uint32_t first = 0; first < paths; first += kPathCapacity) {
+            FramePushConstants constants = pushConstants;
+            constants.dispatchIndex = pass;
+            constants.firstPath = first;
+            constants.bounce = 0;
+            // every batch of the first pass starts its pixels over
+            if (pass > 0) constants.clearAccumulation = 0;
+            uint32_t batch = std::min(kPathCapacity, paths - first);
+            run(Generate, constants);
+            vkCmdDispatch(commandBuffer, (batch + kGroupSize - 1) / kGroupSize,
+                          1, 1);
+
+            for (uint32_t bounce = 0; bounce < variant.maxDepth; bounce++) {
+                constants.bounce = bounce;
+                // the queue this bounce reads, as InQueue() in the shader
+                VkDeviceSize dispatchSize =
+                    kDispatchSizeOffset + 16 * (bounce & 1);
+                for (Stage stage : {Extend, Shade, Compact}) {
+                    run(stage, constants);
+                    vkCmdDispatchIndirect(commandBuffer, m_counterBuffer,
+                                          dispatchSize);
+                }
+                run(Args, constants);
+                vkCmdDispatch(commandBuffer, 1, 1, 1);
+            }
+        }
+    }
+}
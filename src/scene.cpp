@@ -1,9 +1,12 @@
 #include "scene.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 
+#include "tile_scheduler.hpp"
 #include "utils.hpp"
 
 Scene::Scene() {
@@ -43,6 +46,7 @@ Scene::Scene() {
     // m_spheres[2].color = glm::vec3(0.0f, 0.0f, 1.0f);
     // m_spheres[2].center = glm::vec3(-20.0f, 20.0f, 0.0f);
     // m_spheres[2].radius = 10.0f;
+    rebuildBvh();
 }
 
 void Scene::reloadScene() {
@@ -52,6 +56,93 @@ void Scene::reloadScene() {
     m_spheres = scene["spheres"].as<std::vector<Sphere>>();
     m_camera = scene["camera"].as<UniformBufferObject>();
     file.close();
+    m_changes.spheres.addAll();
+    m_editedSpheres.clear();
+    rebuildBvh();
+}
+
+void Scene::rebuildBvh(BvhBuilder builder) {
+    size_t count = static_cast<size_t>(std::max(m_camera.sphereCount, 0));
+    if (builder == BvhBuilder::Linear) {
+        m_bvh.buildLinear(m_spheres, count, TileScheduler::global());
+    } else {
+        m_bvh.build(m_spheres, count);
+    }
+    m_wideBvh.build(m_bvh);
+    m_bvhGeneration++;
+    m_changes.bvhNodes.addAll();
+    m_changes.bvhIndices = true;
+}
+
+void Scene::markSphereDirty(uint32_t index) {
+    if (index >= m_spheres.size()) return;
+    m_editedSpheres.push_back(index);
+    m_changes.spheres.add(index);
+}
+
+void Scene::updateBvh() {
+    collectBackgroundRebuild();
+    if (m_editedSpheres.empty()) return;
+
+    // Past an eighth of the spheres a parallel rebuild beats walking up
+    // from every edited leaf
+    if (m_editedSpheres.size() > m_bvh.primitiveCount() / 8) {
+        rebuildBvh(BvhBuilder::Linear);
+    } else {
+        DirtyRanges changedNodes;
+        m_bvh.refit(m_spheres, m_editedSpheres, changedNodes);
+        m_wideBvh.refit(m_bvh, changedNodes, m_changes.bvhNodes);
+        if (m_rebuild.result.valid()) {
+            m_rebuild.edits.insert(m_rebuild.edits.end(),
+                                   m_editedSpheres.begin(),
+                                   m_editedSpheres.end());
+        } else if (m_bvh.sahCost() >
+                   kRebuildCostRatio * m_bvh.builtSahCost()) {
+            startBackgroundRebuild();
+        }
+    }
+    m_editedSpheres.clear();
+}
+
+SceneChanges Scene::takeChanges() {
+    SceneChanges changes = std::move(m_changes);
+    m_changes = SceneChanges();
+    return changes;
+}
+
+void Scene::startBackgroundRebuild() {
+    size_t count = m_bvh.primitiveCount();
+    std::vector<Sphere> spheres(m_spheres.begin(), m_spheres.begin() + count);
+    m_rebuild.generation = m_bvhGeneration;
+    m_rebuild.edits.clear();
+    m_rebuild.result = std::async(
+        std::launch::async, [spheres = std::move(spheres), count]() {
+            BackgroundBuild::Trees trees;
+            trees.bvh.build(spheres, count);
+            trees.wideBvh.build(trees.bvh);
+            return trees;
+        });
+}
+
+void Scene::collectBackgroundRebuild() {
+    if (!m_rebuild.result.valid() ||
+        m_rebuild.result.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready) {
+        return;
+    }
+    BackgroundBuild::Trees trees = m_rebuild.result.get();
+    if (m_rebuild.generation != m_bvhGeneration) return;
+
+    // Catch the new trees up with the edits made while they were building
+    m_bvh = std::move(trees.bvh);
+    m_wideBvh = std::move(trees.wideBvh);
+    DirtyRanges changedNodes;
+    DirtyRanges changedWideNodes;
+    m_bvh.refit(m_spheres, m_rebuild.edits, changedNodes);
+    m_wideBvh.refit(m_bvh, changedNodes, changedWideNodes);
+    m_rebuild.edits.clear();
+    m_changes.bvhNodes.addAll();
+    m_changes.bvhIndices = true;
 }
 
 void Scene::save() {
@@ -0,0 +1,242 @@
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+using Clock = std::chrono::high_resolution_clock;
+
+double elapsedMs(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// The scheduler whose job this thread is running tiles of, and as which
+// worker
+thread_local const TileScheduler* t_scheduler = nullptr;
+thread_local unsigned t_worker = 0;
+}  // namespace
+
+TileScheduler::TileScheduler(unsigned threadCount) {
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < threadCount; i++) {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    m_stats.resize(threadCount);
+    // Worker 0 is the thread that submits the job
+    for (unsigned i = 1; i < threadCount; i++) {
+        m_threads.emplace_back(&TileScheduler::workerLoop, this, i);
+    }
+}
+
+TileScheduler::~TileScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+}
+
+TileScheduler& TileScheduler::global() {
+    static TileScheduler scheduler;
+    return scheduler;
+}
+
+void TileScheduler::resetStats() {
+    std::lock_guard<std::mutex> lock(m_jobMutex);
+    std::fill(m_stats.begin(), m_stats.end(), WorkerStats{});
+}
+
+void TileScheduler::parallelTiles(uint32_t width, uint32_t height,
+                                  uint32_t tileSize, const TileFunction& fn,
+                                  uint32_t minTileSize) {
+    tileSize = std::max(1u, tileSize);
+    std::vector<Tile> tiles;
+    for (uint32_t y = 0; y < height; y += tileSize) {
+        for (uint32_t x = 0; x < width; x += tileSize) {
+            tiles.push_back({x, y, std::min(width, x + tileSize),
+                             std::min(height, y + tileSize)});
+        }
+    }
+    minTileSize = std::max(1u, minTileSize);
+    run(tiles, fn, minTileSize, minTileSize);
+}
+
+void TileScheduler::parallelFor(uint32_t count, uint32_t grain,
+                                const RangeFunction& fn) {
+    grain = std::max(1u, grain);
+    std::vector<Tile> tiles;
+    for (uint32_t begin = 0; begin < count; begin += grain) {
+        tiles.push_back({begin, 0, std::min(count, begin + grain), 1});
+    }
+    TileFunction rangeFn = [&fn](const Tile& tile, unsigned worker) {
+        fn(tile.x0, tile.x1, worker);
+    };
+    run(tiles, rangeFn, std::max(1u, grain / 4), 1);
+}
+
+void TileScheduler::run(std::vector<Tile>& tiles, const TileFunction& fn,
+                        uint32_t minWidth, uint32_t minHeight) {
+    if (tiles.empty()) return;
+    // Called from a task: m_jobMutex is held by the outer job, so waiting for
+    // it would never return
+    if (t_scheduler == this) {
+        for (const Tile& tile : tiles) {
+            fn(tile, t_worker);
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> jobLock(m_jobMutex);
+
+    // Deal contiguous runs of tiles so each worker starts on nearby pixels
+    unsigned workers = threadCount();
+    for (unsigned w = 0; w < workers; w++) {
+        size_t first = tiles.size() * w / workers;
+        size_t last = tiles.size() * (w + 1) / workers;
+        std::lock_guard<std::mutex> lock(m_queues[w]->mutex);
+        m_queues[w]->tiles.assign(tiles.begin() + first, tiles.begin() + last);
+    }
+
+    m_function = &fn;
+    m_minWidth = minWidth;
+    m_minHeight = minHeight;
+    m_unfinished = static_cast<int64_t>(tiles.size());
+    m_unstarted = static_cast<int64_t>(tiles.size());
+    m_cancelled = false;
+    m_exception = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_activeWorkers = workers;
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    runJob(0);
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return m_activeWorkers == 0; });
+    }
+    m_function = nullptr;
+
+    if (m_exception) {
+        std::rethrow_exception(m_exception);
+    }
+}
+
+void TileScheduler::workerLoop(unsigned worker) {
+    uint64_t seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&] {
+                return m_stop || m_generation != seenGeneration;
+            });
+            if (m_stop) return;
+            seenGeneration = m_generation;
+        }
+        runJob(worker);
+    }
+}
+
+void TileScheduler::runJob(unsigned worker) {
+    WorkerStats& stats = m_stats[worker];
+    t_scheduler = this;
+    t_worker = worker;
+    auto jobStart = Clock::now();
+    double busyMs = 0.0;
+
+    Tile tile;
+    while (m_unfinished.load() > 0) {
+        if (!popTile(worker, tile)) {
+            if (!stealTile(worker, tile)) {
+                std::this_thread::yield();
+                continue;
+            }
+            stats.tilesStolen++;
+        }
+        m_unstarted--;
+
+        // Near the end of the job, halve the tile. The other half goes on the
+        // front of our queue, so we run it next while idle workers steal from
+        // the back, which holds the larger halves split off first.
+        Tile other;
+        while (m_unstarted.load() < static_cast<int64_t>(threadCount()) &&
+               splitTile(tile, other)) {
+            m_unfinished++;
+            m_unstarted++;
+            {
+                std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+                m_queues[worker]->tiles.push_front(other);
+            }
+            stats.tilesSplit++;
+        }
+
+        if (!m_cancelled) {
+            auto start = Clock::now();
+            try {
+                (*m_function)(tile, worker);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_exceptionMutex);
+                if (!m_exception) m_exception = std::current_exception();
+                m_cancelled = true;
+            }
+            busyMs += elapsedMs(start, Clock::now());
+            stats.tilesExecuted++;
+        }
+        m_unfinished--;
+    }
+
+    stats.busyMs += busyMs;
+    stats.idleMs += std::max(0.0, elapsedMs(jobStart, Clock::now()) - busyMs);
+    t_scheduler = nullptr;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_activeWorkers == 0) {
+        m_done.notify_one();
+    }
+}
+
+bool TileScheduler::popTile(unsigned worker, Tile& tile) {
+    WorkerQueue& queue = *m_queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tiles.empty()) return false;
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::stealTile(unsigned worker, Tile& tile) {
+    unsigned workers = threadCount();
+    for (unsigned i = 1; i < workers; i++) {
+        WorkerQueue& queue = *m_queues[(worker + i) % workers];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tiles.empty()) continue;
+        tile = queue.tiles.back();
+        queue.tiles.pop_back();
+        return true;
+    }
+    return false;
+}
+
+bool TileScheduler::splitTile(Tile& tile, Tile& other) const {
+    // Split along the longer axis, keep the first half
+    if (tile.width() >= tile.height() && tile.width() >= 2 * m_minWidth) {
+        uint32_t mid = tile.x0 + tile.width() / 2;
+        other = {mid, tile.y0, tile.x1, tile.y1};
+        tile.x1 = mid;
+        return true;
+    }
+    if (tile.height() >= 2 * m_minHeight) {
+        uint32_t mid = tile.y0 + tile.height() / 2;
+        other = {tile.x0, mid, tile.x1, tile.y1};
+        tile.y1 = mid;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,206 @@
+#include "wide_bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+constexpr uint32_t kNoOwner = 0xffffffff;
+constexpr int kMinExponent = 1;
+constexpr int kMaxExponent = 254;
+
+float exponentScale(int exponent) {
+    uint32_t bits = static_cast<uint32_t>(exponent) << 23;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Same arithmetic as the traversals: q * scale is exact, only the add rounds
+float decode(float origin, int q, float scale) {
+    return origin + static_cast<float>(q) * scale;
+}
+
+// Smallest biased exponent whose 255 steps should cover extent
+int stepExponent(float extent) {
+    if (!(extent > 0.0f)) return kMinExponent;
+    int exponent;
+    std::frexp(extent / 255.0f, &exponent);
+    return std::clamp(exponent + 127, kMinExponent, kMaxExponent);
+}
+
+float boxArea(const BvhNode& node) {
+    glm::vec3 e = node.aabbMax - node.aabbMin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+}  // namespace
+
+template <uint32_t Width>
+void WideBvh<Width>::build(const Bvh& bvh) {
+    static_assert(Width >= 2 && Width <= 8, "child masks are 8 bits");
+    static_assert(Bvh::kMaxLeafSize < 7 &&
+                      (Width - 1) * Bvh::kMaxLeafSize < 32,
+                  "leaf counts and offsets must fit the meta byte");
+
+    m_nodes.clear();
+    m_primitiveIndices.clear();
+    m_slotNodes.clear();
+    m_owners.assign(bvh.nodes().size(), kNoOwner);
+    m_depth = 0;
+    if (bvh.primitiveCount() == 0) return;
+
+    const auto& binary = bvh.nodes();
+    const auto& primitives = bvh.primitiveIndices();
+    m_primitiveIndices.reserve(primitives.size());
+    // binary node each wide node is collapsed from, and its depth
+    std::vector<uint32_t> sources = {0};
+    std::vector<uint32_t> depths = {1};
+    m_nodes.push_back(Node{});
+    // Breadth first, so the interior children of a node are allocated
+    // together and the whole top of the tree shares a few cache lines
+    for (uint32_t w = 0; w < m_nodes.size(); w++) {
+        uint32_t slots[Width];
+        uint32_t slotCount = 0;
+        const BvhNode& source = binary[sources[w]];
+        if (source.isLeaf()) {
+            // only a root small enough to be a single leaf
+            slots[slotCount++] = sources[w];
+        } else {
+            slots[slotCount++] = source.leftFirst;
+            slots[slotCount++] = source.leftFirst + 1;
+            while (slotCount < Width) {
+                int widest = -1;
+                float widestArea = -1.0f;
+                for (uint32_t s = 0; s < slotCount; s++) {
+                    if (binary[slots[s]].isLeaf()) continue;
+                    float area = boxArea(binary[slots[s]]);
+                    if (area > widestArea) {
+                        widest = static_cast<int>(s);
+                        widestArea = area;
+                    }
+                }
+                if (widest < 0) break;
+                uint32_t expanded = slots[widest];
+                m_owners[expanded] = w;
+                slots[widest] = binary[expanded].leftFirst;
+                slots[slotCount++] = binary[expanded].leftFirst + 1;
+            }
+        }
+
+        Node node = {};
+        node.childBase = static_cast<uint32_t>(m_nodes.size());
+        node.primitiveBase = static_cast<uint32_t>(m_primitiveIndices.size());
+        uint32_t rank = 0;
+        uint32_t offset = 0;
+        for (uint32_t s = 0; s < slotCount; s++) {
+            const BvhNode& child = binary[slots[s]];
+            m_owners[slots[s]] = w;
+            if (child.isLeaf()) {
+                node.meta[s] = static_cast<uint8_t>(child.count << 5 | offset);
+                m_primitiveIndices.insert(
+                    m_primitiveIndices.end(),
+                    primitives.begin() + child.leftFirst,
+                    primitives.begin() + child.leftFirst + child.count);
+                offset += child.count;
+            } else {
+                node.meta[s] = static_cast<uint8_t>(Node::kInterior | rank++);
+                m_nodes.push_back(Node{});
+                sources.push_back(slots[s]);
+                depths.push_back(depths[w] + 1);
+            }
+        }
+        if (m_nodes.size() > kMaxNodes) {
+            throw std::runtime_error("failed to build wide BVH: too many nodes!");
+        }
+        m_nodes[w] = node;
+        m_depth = std::max(m_depth, depths[w]);
+        m_slotNodes.insert(m_slotNodes.end(), slots, slots + slotCount);
+        m_slotNodes.resize(m_slotNodes.size() + Width - slotCount, 0);
+        quantise(bvh, w);
+    }
+}
+
+template <uint32_t Width>
+void WideBvh<Width>::refit(const Bvh& bvh, DirtyRanges& changedNodes,
+                           DirtyRanges& changedWideNodes) {
+    if (m_nodes.empty() || changedNodes.empty()) return;
+    if (changedNodes.all()) {
+        for (uint32_t w = 0; w < m_nodes.size(); w++) quantise(bvh, w);
+        changedWideNodes.addAll();
+        return;
+    }
+    std::vector<uint32_t> owners;
+    for (const DirtyRanges::Range& range : changedNodes.ranges()) {
+        uint32_t end = std::min<uint32_t>(
+            range.second, static_cast<uint32_t>(m_owners.size()));
+        for (uint32_t b = range.first; b < end; b++) {
+            if (m_owners[b] != kNoOwner) owners.push_back(m_owners[b]);
+        }
+    }
+    std::sort(owners.begin(), owners.end());
+    owners.erase(std::unique(owners.begin(), owners.end()), owners.end());
+    for (uint32_t w : owners) {
+        quantise(bvh, w);
+        changedWideNodes.add(w);
+    }
+}
+
+template <uint32_t Width>
+void WideBvh<Width>::quantise(const Bvh& bvh, uint32_t w) {
+    Node& node = m_nodes[w];
+    const BvhNode* slots[Width];
+    uint32_t slotCount = 0;
+    for (uint32_t s = 0; s < Width; s++) {
+        if (node.isEmpty(s)) break;
+        slots[slotCount++] = &bvh.nodes()[m_slotNodes[w * Width + s]];
+    }
+
+    node.exponents = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float origin = slots[0]->aabbMin[axis];
+        float extent = slots[0]->aabbMax[axis];
+        for (uint32_t s = 1; s < slotCount; s++) {
+            origin = std::min(origin, slots[s]->aabbMin[axis]);
+            extent = std::max(extent, slots[s]->aabbMax[axis]);
+        }
+        node.origin[axis] = origin;
+
+        // Round every box outwards, checking against the decoded value
+        // since the add in decode() rounds too. A box that needs more than
+        // 255 steps retries with twice the step.
+        int exponent = stepExponent(extent - origin);
+        while (true) {
+            float scale = exponentScale(exponent);
+            bool fits = true;
+            for (uint32_t s = 0; s < slotCount && fits; s++) {
+                float low = slots[s]->aabbMin[axis];
+                float high = slots[s]->aabbMax[axis];
+                int lo = static_cast<int>(std::floor((low - origin) / scale));
+                lo = std::clamp(lo, 0, 255);
+                while (lo > 0 && decode(origin, lo, scale) > low) lo--;
+                int hi = static_cast<int>(
+                    std::min(std::ceil((high - origin) / scale), 256.0f));
+                hi = std::max(hi, lo);
+                while (hi <= 255 && decode(origin, hi, scale) < high) hi++;
+                if (hi > 255) {
+                    fits = false;
+                    hi = 255;
+                }
+                node.lo[axis][s] = static_cast<uint8_t>(lo);
+                node.hi[axis][s] = static_cast<uint8_t>(hi);
+            }
+            if (fits || exponent == kMaxExponent) break;
+            exponent++;
+        }
+        node.exponents |= static_cast<uint32_t>(exponent) << (8 * axis);
+    }
+    for (uint32_t s = slotCount; s < Width; s++) {
+        for (int axis = 0; axis < 3; axis++) {
+            node.lo[axis][s] = 0;
+            node.hi[axis][s] = 0;
+        }
+    }
+}
+
+template class WideBvh<4>;
+template class WideBvh<8>;